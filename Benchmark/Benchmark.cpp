@@ -0,0 +1,260 @@
+#include <Windows.h>
+#include <Psapi.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BenchmarkTargets.h"
+#include "Workloads.h"
+
+// Benchmark.exe [output.json] [seed]
+// Benchmark.exe --replay trace.bin [output.json]
+// every workload is generated once from the seed, or read from a trace of HeapManager::StartTrace,
+// and replayed on every allocator
+// results are written as JSON so runs can be compared by scripts
+namespace Benchmark
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	struct BenchmarkResult
+	{
+		std::string WorkloadName;
+		std::string TargetName;
+		size_t NumOps;
+		size_t NumFailedAllocs;
+		double OpsPerSecond;
+		long long LatencyP50;
+		long long LatencyP99;
+		long long LatencyP999;
+		size_t PeakWorkingSet;
+		size_t PeakLiveSize;
+		double Fragmentation;
+	};
+
+	static size_t GetWorkingSetSize()
+	{
+		PROCESS_MEMORY_COUNTERS counters;
+		if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) == FALSE)
+			return 0;
+
+		return counters.WorkingSetSize;
+	}
+
+	// i_percentile in 1/1000
+	static long long GetPercentile(std::vector<long long>& i_latencies, const size_t i_percentile)
+	{
+		if (i_latencies.empty())
+			return 0;
+
+		size_t index = std::min(i_latencies.size() * i_percentile / 1000, i_latencies.size() - 1);
+		std::nth_element(i_latencies.begin(), i_latencies.begin() + index, i_latencies.end());
+		return i_latencies[index];
+	}
+
+	static BenchmarkResult Run(const Workload& i_workload, BenchmarkTarget* i_pTarget)
+	{
+		// working set is sampled, a call per op would cost more than the allocator
+		const size_t sampleWorkingSetEvery = 4096;
+
+		BenchmarkResult result;
+		result.WorkloadName = i_workload.Name;
+		result.TargetName = i_pTarget->GetName();
+		result.NumOps = i_workload.Ops.size();
+		result.NumFailedAllocs = 0;
+		result.PeakWorkingSet = GetWorkingSetSize();
+		result.PeakLiveSize = 0;
+		result.Fragmentation = -1.0;
+
+		std::vector<void*> pointers(i_workload.NumSlots, nullptr);
+		std::vector<size_t> sizes(i_workload.NumSlots, 0);
+		std::vector<long long> latencies;
+		latencies.reserve(i_workload.Ops.size());
+
+		const size_t maxAllocSize = i_pTarget->GetMaxAllocSize();
+		size_t liveSize = 0;
+		size_t numLive = 0;
+		long long elapsedTotal = 0;
+
+		for (size_t iOp = 0; iOp < i_workload.Ops.size(); ++iOp)
+		{
+			const WorkloadOp& op = i_workload.Ops[iOp];
+
+			if (iOp == i_workload.CleanupStart)
+				result.Fragmentation = i_pTarget->GetFragmentation(liveSize, numLive);
+
+			if (op.Slot == s_CollectSlot)
+			{
+				// part of the total time, not an alloc or free latency
+				Clock::time_point start = Clock::now();
+				i_pTarget->Collect(op.Size);
+				elapsedTotal += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+			}
+			else if (op.Size)
+			{
+				size_t size = 1 + (op.Size - 1) % maxAllocSize;
+
+				Clock::time_point start = Clock::now();
+				void* pPtr = i_pTarget->Alloc(size, op.Alignment, op.Lifetime);
+				long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+				latencies.push_back(elapsed);
+				elapsedTotal += elapsed;
+
+				if (pPtr == nullptr)
+				{
+					++result.NumFailedAllocs;
+					continue;
+				}
+
+				pointers[op.Slot] = pPtr;
+				sizes[op.Slot] = size;
+				liveSize += size;
+				++numLive;
+				result.PeakLiveSize = std::max(result.PeakLiveSize, liveSize);
+			}
+			else if (pointers[op.Slot])
+			{
+				Clock::time_point start = Clock::now();
+				i_pTarget->Free(pointers[op.Slot]);
+				long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+				latencies.push_back(elapsed);
+				elapsedTotal += elapsed;
+
+				pointers[op.Slot] = nullptr;
+				liveSize -= sizes[op.Slot];
+				--numLive;
+			}
+
+			if (iOp % sampleWorkingSetEvery == 0)
+				result.PeakWorkingSet = std::max(result.PeakWorkingSet, GetWorkingSetSize());
+		}
+
+		// nothing left to free at the end
+		if (i_workload.CleanupStart >= i_workload.Ops.size())
+			result.Fragmentation = i_pTarget->GetFragmentation(liveSize, numLive);
+
+		result.NumOps = latencies.size();
+		result.OpsPerSecond = elapsedTotal ? latencies.size() * 1e9 / elapsedTotal : 0.0;
+		result.LatencyP50 = GetPercentile(latencies, 500);
+		result.LatencyP99 = GetPercentile(latencies, 990);
+		result.LatencyP999 = GetPercentile(latencies, 999);
+
+		return result;
+	}
+
+	// i_pTracePath is nullptr for generated workloads
+	static void WriteJson(FILE* i_pFile, const uint32_t i_seed, const char* i_pTracePath, const std::vector<BenchmarkResult>& i_results)
+	{
+		if (i_pTracePath)
+		{
+			// windows paths are full of backslashes
+			fprintf(i_pFile, "{\n  \"trace\": \"");
+			for (const char* pChar = i_pTracePath; *pChar; ++pChar)
+				fprintf(i_pFile, *pChar == '\\' || *pChar == '"' ? "\\%c" : "%c", *pChar);
+			fprintf(i_pFile, "\",\n  \"results\": [\n");
+		}
+		else
+			fprintf(i_pFile, "{\n  \"seed\": %u,\n  \"results\": [\n", i_seed);
+
+		for (size_t i = 0; i < i_results.size(); ++i)
+		{
+			const BenchmarkResult& result = i_results[i];
+
+			fprintf(i_pFile, "    {\"workload\": \"%s\", \"allocator\": \"%s\", \"ops\": %zu, \"failed_allocs\": %zu, \"ops_per_sec\": %.0f, "
+				"\"latency_ns\": {\"p50\": %lld, \"p99\": %lld, \"p999\": %lld}, \"peak_rss_bytes\": %zu, \"peak_live_bytes\": %zu, ",
+				result.WorkloadName.c_str(), result.TargetName.c_str(), result.NumOps, result.NumFailedAllocs, result.OpsPerSecond,
+				result.LatencyP50, result.LatencyP99, result.LatencyP999, result.PeakWorkingSet, result.PeakLiveSize);
+
+			if (result.Fragmentation < 0.0)
+				fprintf(i_pFile, "\"fragmentation\": null}");
+			else
+				fprintf(i_pFile, "\"fragmentation\": %.4f}", result.Fragmentation);
+
+			fprintf(i_pFile, "%s\n", i + 1 < i_results.size() ? "," : "");
+		}
+
+		fprintf(i_pFile, "  ]\n}\n");
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	using namespace Benchmark;
+
+	const bool bReplay = argc > 2 && strcmp(argv[1], "--replay") == 0;
+
+	const char* pOutputPath = "benchmark.json";
+	uint32_t seed = 20;
+
+	std::vector<Workload> workloads;
+	if (bReplay)
+	{
+		pOutputPath = argc > 3 ? argv[3] : pOutputPath;
+
+		workloads.push_back(Workload("trace"));
+		if (CreateTraceWorkload(argv[2], workloads.back()) == false)
+		{
+			fprintf(stderr, "can not read trace %s\n", argv[2]);
+			return 1;
+		}
+	}
+	else
+	{
+		pOutputPath = argc > 1 ? argv[1] : pOutputPath;
+		seed = argc > 2 ? static_cast<uint32_t>(strtoul(argv[2], nullptr, 10)) : seed;
+
+		// at most about 512KB alive, every allocator under test has 1MB
+		const size_t numOps = 1000 * 1000;
+		const uint32_t maxSize = 1024;
+		const size_t maxLive = 1024;
+
+		workloads.push_back(CreateUniformWorkload(seed, numOps, maxSize, maxLive));
+		workloads.push_back(CreatePowerLawWorkload(seed, numOps, maxSize, maxLive));
+		workloads.push_back(CreateProducerConsumerWorkload(seed, numOps, maxSize, maxLive));
+		workloads.push_back(CreateSawtoothWorkload(seed, numOps, maxSize, maxLive));
+		workloads.push_back(CreateLifetimeMixWorkload(seed, numOps, maxSize, maxLive));
+		workloads.push_back(CreateContainerChurnWorkload(seed, numOps, maxSize, maxLive));
+	}
+
+	std::vector<BenchmarkResult> results;
+	for (size_t iWorkload = 0; iWorkload < workloads.size(); ++iWorkload)
+	{
+		// same sizes as the default heap and fixed-size heaps in HeapManager
+		std::vector<std::unique_ptr<BenchmarkTarget> > targets;
+		targets.emplace_back(new HeapManagerTarget());
+		targets.emplace_back(new HeapManagerTarget(true));
+		targets.emplace_back(new HeapAllocatorTarget(1024 * 1024));
+		targets.emplace_back(new FixedSizeAllocatorTarget(64, 1024 * 1024 / 64));
+		targets.emplace_back(new FixedSizeAllocatorTarget(128, 1024 * 1024 / 128));
+		targets.emplace_back(new FixedSizeAllocatorTarget(256, 1024 * 1024 / 256));
+		targets.emplace_back(new SystemMallocTarget());
+
+		for (size_t iTarget = 0; iTarget < targets.size(); ++iTarget)
+		{
+			results.push_back(Run(workloads[iWorkload], targets[iTarget].get()));
+
+			const BenchmarkResult& result = results.back();
+			printf("%-18s %-26s %10.0f ops/s  p50 %6lld ns  p99 %6lld ns  p999 %6lld ns  failed %zu\n", result.WorkloadName.c_str(), result.TargetName.c_str(),
+				result.OpsPerSecond, result.LatencyP50, result.LatencyP99, result.LatencyP999, result.NumFailedAllocs);
+		}
+	}
+
+	FILE* pFile = nullptr;
+	if (fopen_s(&pFile, pOutputPath, "w") != 0 || pFile == nullptr)
+	{
+		fprintf(stderr, "can not open %s\n", pOutputPath);
+		return 1;
+	}
+
+	WriteJson(pFile, seed, bReplay ? argv[2] : nullptr, results);
+	fclose(pFile);
+
+	return 0;
+}
@@ -0,0 +1,245 @@
+#pragma once
+#include <Windows.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "BitArray.h"
+#include "FixedSizeAllocator.h"
+#include "HeapAllocator.h"
+#include "HeapManager.h"
+
+namespace Benchmark
+{
+	using namespace HeapManagerProxy;
+
+	// an allocator under test, created fresh for every workload
+	class BenchmarkTarget
+	{
+	public:
+		virtual ~BenchmarkTarget() {}
+
+		virtual const char* GetName() const = 0;
+
+		// larger sizes of a workload wrap around into [1, GetMaxAllocSize()]
+		virtual size_t GetMaxAllocSize() const = 0;
+
+		// i_lifetime is a hint, only targets that can use it look at it
+		virtual void* Alloc(const size_t i_size, const unsigned int i_alignment, const AllocationLifetime i_lifetime) = 0;
+
+		virtual bool Free(void* i_ptr) = 0;
+
+		// i_maxSteps = 0 for a full Collect
+		virtual void Collect(const size_t) {}
+
+		// 0 when all free memory can serve one allocation, negative when unknown
+		virtual double GetFragmentation(const size_t i_liveSize, const size_t i_numLive) = 0;
+	};
+
+	// baseline
+	class SystemMallocTarget : public BenchmarkTarget
+	{
+	public:
+		const char* GetName() const override { return "system_malloc"; }
+
+		size_t GetMaxAllocSize() const override { return SIZE_MAX; }
+
+		// malloc alignment covers what the workloads ask for
+		void* Alloc(const size_t i_size, const unsigned int, const AllocationLifetime) override { return ::malloc(i_size); }
+
+		bool Free(void* i_ptr) override { ::free(i_ptr); return true; }
+
+		double GetFragmentation(const size_t, const size_t) override { return -1.0; }
+	};
+
+	// a failed alloc is retried once after Collect, like the unit tests do
+	class HeapAllocatorTarget : public BenchmarkTarget
+	{
+	public:
+		HeapAllocatorTarget(const size_t i_sizeHeap) : m_sizeHeap(i_sizeHeap)
+		{
+			m_pHeapMemory = VirtualAlloc(NULL, m_sizeHeap, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+			assert(m_pHeapMemory);
+
+			void* pAllocatorMemory = reinterpret_cast<HeapAllocator*>(m_pHeapMemory) + 1;
+			m_pHeapAllocator = new (m_pHeapMemory) HeapAllocator(pAllocatorMemory, m_sizeHeap - sizeof(HeapAllocator));
+		}
+
+		~HeapAllocatorTarget()
+		{
+			m_pHeapAllocator->~HeapAllocator();
+			VirtualFree(m_pHeapMemory, 0, MEM_RELEASE);
+		}
+
+		const char* GetName() const override { return "heap_allocator"; }
+
+		size_t GetMaxAllocSize() const override { return SIZE_MAX; }
+
+		void* Alloc(const size_t i_size, const unsigned int i_alignment, const AllocationLifetime) override
+		{
+			void* pPtr = m_pHeapAllocator->alloc(i_size, i_alignment);
+			if (pPtr == nullptr)
+			{
+				m_pHeapAllocator->Collect();
+				pPtr = m_pHeapAllocator->alloc(i_size, i_alignment);
+			}
+
+			return pPtr;
+		}
+
+		bool Free(void* i_ptr) override { return m_pHeapAllocator->free(i_ptr); }
+
+		void Collect(const size_t i_maxSteps) override
+		{
+			if (i_maxSteps)
+				m_pHeapAllocator->Collect(i_maxSteps);
+			else
+				m_pHeapAllocator->Collect();
+		}
+
+		double GetFragmentation(const size_t, const size_t) override
+		{
+			m_pHeapAllocator->Collect();
+
+			size_t totalFree = m_pHeapAllocator->GetTotalFreeSize();
+			return totalFree ? 1.0 - static_cast<double>(m_pHeapAllocator->GetLargestFreeBlock()) / totalFree : 0.0;
+		}
+
+	private:
+		size_t m_sizeHeap;
+		void* m_pHeapMemory;
+		HeapAllocator* m_pHeapAllocator;
+	};
+
+	// the fixed-size heap and its BitArray are set up the same way as in HeapManager
+	// fragmentation is the space lost inside blocks
+	class FixedSizeAllocatorTarget : public BenchmarkTarget
+	{
+	public:
+		FixedSizeAllocatorTarget(const size_t i_sizeBlock, const size_t i_numBlocks) : m_sizeBlock(i_sizeBlock)
+		{
+			const size_t sizeBitArrayHeap = 64 * 1024;
+			m_sizeHeap = sizeBitArrayHeap + i_sizeBlock * i_numBlocks;
+
+			m_pHeapMemory = VirtualAlloc(NULL, m_sizeHeap, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+			assert(m_pHeapMemory);
+
+			void* pAllocatorMemory = reinterpret_cast<HeapAllocator*>(m_pHeapMemory) + 1;
+			m_pBitArrayHeap = new (m_pHeapMemory) HeapAllocator(pAllocatorMemory, sizeBitArrayHeap - sizeof(HeapAllocator));
+
+			m_pAvailableBlocks = BitArray::Create(i_numBlocks, m_pBitArrayHeap);
+			m_pFixedSizeAllocator = new (m_pBitArrayHeap->alloc(sizeof(FixedSizeAllocator)))
+				FixedSizeAllocator(static_cast<char*>(m_pHeapMemory) + sizeBitArrayHeap, m_pAvailableBlocks, i_sizeBlock, i_numBlocks);
+
+			snprintf(m_name, sizeof(m_name), "fixed_size_allocator_%zu", i_sizeBlock);
+		}
+
+		~FixedSizeAllocatorTarget()
+		{
+			m_pFixedSizeAllocator->Destroy();
+
+			m_pAvailableBlocks->~BitArray();
+			m_pBitArrayHeap->free(m_pAvailableBlocks);
+
+			m_pFixedSizeAllocator->~FixedSizeAllocator();
+			m_pBitArrayHeap->free(m_pFixedSizeAllocator);
+
+			m_pBitArrayHeap->~HeapAllocator();
+			VirtualFree(m_pHeapMemory, 0, MEM_RELEASE);
+		}
+
+		const char* GetName() const override { return m_name; }
+
+		size_t GetMaxAllocSize() const override { return m_sizeBlock - GUARD_BAND_SIZE - GUARD_BAND_SIZE; }
+
+		void* Alloc(const size_t i_size, const unsigned int i_alignment, const AllocationLifetime) override { return m_pFixedSizeAllocator->alloc(i_size, i_alignment); }
+
+		bool Free(void* i_ptr) override { return m_pFixedSizeAllocator->free(i_ptr); }
+
+		double GetFragmentation(const size_t i_liveSize, const size_t i_numLive) override
+		{
+			return i_numLive ? 1.0 - static_cast<double>(i_liveSize) / (i_numLive * m_sizeBlock) : 0.0;
+		}
+
+	private:
+		size_t m_sizeBlock;
+		size_t m_sizeHeap;
+		void* m_pHeapMemory;
+		HeapAllocator* m_pBitArrayHeap;
+		BitArray* m_pAvailableBlocks;
+		FixedSizeAllocator* m_pFixedSizeAllocator;
+		char m_name[64];
+	};
+
+	// one node, fragmentation of its arenas
+	// with lifetime hints, transient allocations get their own arena and persistent ones are grouped
+	class HeapManagerTarget : public BenchmarkTarget
+	{
+	public:
+		HeapManagerTarget(const bool i_bLifetimeHints = false) : m_bLifetimeHints(i_bLifetimeHints)
+		{
+			m_pHeapManager = new HeapManager();
+			m_pHeapManager->SetUseTransientArena(m_bLifetimeHints);
+			m_pHeapManager->CreateHeaps(1);
+		}
+
+		~HeapManagerTarget()
+		{
+			m_pHeapManager->Destroy();
+			delete m_pHeapManager;
+		}
+
+		const char* GetName() const override { return m_bLifetimeHints ? "heap_manager_hinted" : "heap_manager"; }
+
+		size_t GetMaxAllocSize() const override { return SIZE_MAX; }
+
+		void* Alloc(const size_t i_size, const unsigned int i_alignment, const AllocationLifetime i_lifetime) override
+		{
+			const AllocationLifetime lifetime = m_bLifetimeHints ? i_lifetime : AllocationLifetime::Default;
+
+			void* pPtr = m_pHeapManager->aligned_alloc(i_alignment, i_size, lifetime);
+			if (pPtr == nullptr)
+			{
+				m_pHeapManager->Collect();
+				pPtr = m_pHeapManager->aligned_alloc(i_alignment, i_size, lifetime);
+			}
+
+			return pPtr;
+		}
+
+		bool Free(void* i_ptr) override { return m_pHeapManager->free(i_ptr); }
+
+		void Collect(const size_t i_maxSteps) override
+		{
+			if (i_maxSteps)
+				m_pHeapManager->Collect(i_maxSteps);
+			else
+				m_pHeapManager->Collect();
+		}
+
+		double GetFragmentation(const size_t, const size_t) override
+		{
+			m_pHeapManager->Collect();
+
+			// free memory outside the largest block of its arena, an unused arena would only dilute it
+			size_t totalFree = 0;
+			size_t largestFree = 0;
+			for (unsigned int iArena = 0; iArena < m_pHeapManager->GetNumArenas(0); ++iArena)
+			{
+				HeapAllocator* pHeap = m_pHeapManager->GetArenaHeap(0, iArena);
+				if (pHeap->IsEmpty())
+					continue;
+
+				totalFree += pHeap->GetTotalFreeSize();
+				largestFree += pHeap->GetLargestFreeBlock();
+			}
+
+			return totalFree ? 1.0 - static_cast<double>(largestFree) / totalFree : 0.0;
+		}
+
+	private:
+		HeapManager* m_pHeapManager;
+		bool m_bLifetimeHints;
+	};
+}
@@ -0,0 +1,345 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "AllocationTrace.h"
+
+namespace Benchmark
+{
+	using HeapManagerProxy::AllocationLifetime;
+
+	// one step of a workload, Size = 0 frees the allocation in Slot
+	// Slot = s_CollectSlot is a Collect with Size steps, 0 for a full Collect
+	struct WorkloadOp
+	{
+		uint32_t Slot;
+		uint32_t Size;
+		uint32_t Alignment;
+		AllocationLifetime Lifetime; // hint known to the workload, targets may ignore it
+
+		WorkloadOp(uint32_t i_slot, uint32_t i_size, uint32_t i_alignment = 4, AllocationLifetime i_lifetime = AllocationLifetime::Default) :
+			Slot(i_slot), Size(i_size), Alignment(i_alignment), Lifetime(i_lifetime) {}
+	};
+
+	static const uint32_t s_CollectSlot = ~0u;
+
+	struct Workload
+	{
+		const char* Name;
+		std::vector<WorkloadOp> Ops;
+
+		// number of slots, never more allocations alive at the same time
+		uint32_t NumSlots;
+
+		// ops from here only free what is left
+		size_t CleanupStart;
+
+		Workload(const char* i_name) : Name(i_name), NumSlots(0), CleanupStart(0) {}
+	};
+
+	// keeps track of slots while a workload is generated
+	// only the raw mt19937 output is used, distributions are not the same in every standard library
+	class WorkloadBuilder
+	{
+	public:
+		WorkloadBuilder(Workload& i_workload, const uint32_t i_seed) : m_workload(i_workload), m_random(i_seed) {}
+
+		uint32_t Random(const uint32_t i_range) { return static_cast<uint32_t>(m_random() % i_range); }
+
+		// uniform in [0, 1)
+		double RandomUnit() { return (m_random() >> 8) / static_cast<double>(1 << 24); }
+
+		uint32_t Alloc(const uint32_t i_size, const uint32_t i_alignment = 4, const AllocationLifetime i_lifetime = AllocationLifetime::Default)
+		{
+			uint32_t slot;
+			if (m_freeSlots.empty())
+			{
+				slot = m_workload.NumSlots++;
+				m_livePositions.push_back(0);
+			}
+			else
+			{
+				slot = m_freeSlots.back();
+				m_freeSlots.pop_back();
+			}
+
+			m_workload.Ops.push_back(WorkloadOp(slot, i_size, i_alignment, i_lifetime));
+			m_livePositions[slot] = static_cast<uint32_t>(m_liveSlots.size());
+			m_liveSlots.push_back(slot);
+			return slot;
+		}
+
+		// lifetime of the allocation just made, for generators that decide it after the Alloc
+		void SetLifetime(const AllocationLifetime i_lifetime) { m_workload.Ops.back().Lifetime = i_lifetime; }
+
+		void Free(const uint32_t i_slot)
+		{
+			m_workload.Ops.push_back(WorkloadOp(i_slot, 0));
+			m_freeSlots.push_back(i_slot);
+
+			// move the last live slot into the hole
+			uint32_t position = m_livePositions[i_slot];
+			m_liveSlots[position] = m_liveSlots.back();
+			m_livePositions[m_liveSlots[position]] = position;
+			m_liveSlots.pop_back();
+		}
+
+		void Collect(const uint32_t i_maxSteps) { m_workload.Ops.push_back(WorkloadOp(s_CollectSlot, i_maxSteps)); }
+
+		// free a random live allocation
+		void FreeRandom() { Free(m_liveSlots[Random(static_cast<uint32_t>(m_liveSlots.size()))]); }
+
+		size_t GetNumLive() const { return m_liveSlots.size(); }
+
+		// free everything left in a random order
+		void Cleanup()
+		{
+			m_workload.CleanupStart = m_workload.Ops.size();
+			while (!m_liveSlots.empty())
+				FreeRandom();
+		}
+
+	private:
+		Workload& m_workload;
+		std::mt19937 m_random;
+		std::vector<uint32_t> m_freeSlots;
+		std::vector<uint32_t> m_liveSlots;
+
+		// index of each live slot in m_liveSlots
+		std::vector<uint32_t> m_livePositions;
+	};
+
+	// sizes uniform in [1, i_maxSize], alloc and free with the same chance up to i_maxLive
+	inline Workload CreateUniformWorkload(const uint32_t i_seed, const size_t i_numOps, const uint32_t i_maxSize, const size_t i_maxLive)
+	{
+		Workload workload("uniform");
+		WorkloadBuilder builder(workload, i_seed);
+
+		for (size_t i = 0; i < i_numOps; ++i)
+		{
+			if (builder.GetNumLive() == 0 || (builder.GetNumLive() < i_maxLive && builder.Random(2) == 0))
+				builder.Alloc(1 + builder.Random(i_maxSize));
+			else
+				builder.FreeRandom();
+		}
+
+		builder.Cleanup();
+		return workload;
+	}
+
+	// Pareto sizes, most allocations are small and a few are very large
+	inline Workload CreatePowerLawWorkload(const uint32_t i_seed, const size_t i_numOps, const uint32_t i_maxSize, const size_t i_maxLive)
+	{
+		const double minSize = 8.0;
+		const double alpha = 1.2;
+
+		Workload workload("power_law");
+		WorkloadBuilder builder(workload, i_seed);
+
+		for (size_t i = 0; i < i_numOps; ++i)
+		{
+			if (builder.GetNumLive() == 0 || (builder.GetNumLive() < i_maxLive && builder.Random(2) == 0))
+			{
+				double size = minSize * pow(1.0 - builder.RandomUnit(), -1.0 / alpha);
+				builder.Alloc(static_cast<uint32_t>(std::min(size, static_cast<double>(i_maxSize))));
+			}
+			else
+			{
+				builder.FreeRandom();
+			}
+		}
+
+		builder.Cleanup();
+		return workload;
+	}
+
+	// a queue of messages, the oldest is freed once the queue is full
+	inline Workload CreateProducerConsumerWorkload(const uint32_t i_seed, const size_t i_numOps, const uint32_t i_maxSize, const size_t i_maxLive)
+	{
+		Workload workload("producer_consumer");
+		WorkloadBuilder builder(workload, i_seed);
+
+		std::vector<uint32_t> queue;
+		size_t iHead = 0;
+		for (size_t i = 0; i < i_numOps; ++i)
+		{
+			if (queue.size() - iHead < i_maxLive && (iHead == queue.size() || builder.Random(2) == 0))
+				queue.push_back(builder.Alloc(1 + builder.Random(i_maxSize)));
+			else
+				builder.Free(queue[iHead++]);
+		}
+
+		builder.Cleanup();
+		return workload;
+	}
+
+	// grow up to i_maxLive allocations, then free them all, again and again
+	inline Workload CreateSawtoothWorkload(const uint32_t i_seed, const size_t i_numOps, const uint32_t i_maxSize, const size_t i_maxLive)
+	{
+		Workload workload("sawtooth");
+		WorkloadBuilder builder(workload, i_seed);
+
+		bool bGrowing = true;
+		for (size_t i = 0; i < i_numOps; ++i)
+		{
+			if (bGrowing)
+			{
+				builder.Alloc(1 + builder.Random(i_maxSize));
+				bGrowing = builder.GetNumLive() < i_maxLive;
+			}
+			else
+			{
+				builder.FreeRandom();
+				bGrowing = builder.GetNumLive() == 0;
+			}
+		}
+
+		builder.Cleanup();
+		return workload;
+	}
+
+	// one allocation in ten lives until the end, the others die within a few ops
+	// allocations carry their lifetime as a hint
+	inline Workload CreateLifetimeMixWorkload(const uint32_t i_seed, const size_t i_numOps, const uint32_t i_maxSize, const size_t i_maxLive)
+	{
+		const uint32_t maxShortLifetime = 16;
+
+		Workload workload("lifetime_mix");
+		WorkloadBuilder builder(workload, i_seed);
+
+		// short-lived slot and the op it dies at
+		std::vector<std::pair<size_t, uint32_t> > shortLived;
+		size_t numLongLived = 0;
+		for (size_t i = 0; i < i_numOps; ++i)
+		{
+			std::vector<std::pair<size_t, uint32_t> >::iterator it = std::min_element(shortLived.begin(), shortLived.end());
+			if (it != shortLived.end() && (it->first <= i || builder.GetNumLive() >= i_maxLive))
+			{
+				builder.Free(it->second);
+				*it = shortLived.back();
+				shortLived.pop_back();
+			}
+			else if (builder.GetNumLive() < i_maxLive)
+			{
+				uint32_t slot = builder.Alloc(1 + builder.Random(i_maxSize));
+
+				if (builder.Random(10) == 0 && numLongLived < i_maxLive / 2)
+				{
+					++numLongLived;
+					builder.SetLifetime(AllocationLifetime::Persistent);
+				}
+				else
+				{
+					shortLived.push_back(std::make_pair(i + 1 + builder.Random(maxShortLifetime), slot));
+					builder.SetLifetime(AllocationLifetime::Transient);
+				}
+			}
+		}
+
+		builder.Cleanup();
+		return workload;
+	}
+
+	// buffers of growing containers, a full buffer is replaced by one twice as large
+	inline Workload CreateContainerChurnWorkload(const uint32_t i_seed, const size_t i_numOps, const uint32_t i_maxSize, const size_t i_maxLive)
+	{
+		const uint32_t minCapacity = 16;
+		const uint32_t noBuffer = ~0u;
+
+		Workload workload("container_churn");
+		WorkloadBuilder builder(workload, i_seed);
+
+		// buffer slot, capacity and used size of each container
+		std::vector<uint32_t> buffers(i_maxLive / 2, noBuffer);
+		std::vector<uint32_t> capacities(buffers.size(), 0);
+		std::vector<uint32_t> sizes(buffers.size(), 0);
+
+		for (size_t i = 0; i < i_numOps; ++i)
+		{
+			uint32_t iContainer = builder.Random(static_cast<uint32_t>(buffers.size()));
+			uint32_t size = sizes[iContainer] + 1 + builder.Random(minCapacity);
+
+			if (size > i_maxSize || builder.Random(64) == 0)
+			{
+				// clear
+				if (buffers[iContainer] != noBuffer)
+					builder.Free(buffers[iContainer]);
+
+				buffers[iContainer] = noBuffer;
+				capacities[iContainer] = 0;
+				sizes[iContainer] = 0;
+			}
+			else if (size > capacities[iContainer])
+			{
+				// grow, new buffer is allocated before the old one is freed
+				uint32_t capacity = std::min(std::max(capacities[iContainer] * 2, minCapacity), i_maxSize);
+				capacity = std::max(capacity, size);
+
+				uint32_t slot = builder.Alloc(capacity);
+				if (buffers[iContainer] != noBuffer)
+					builder.Free(buffers[iContainer]);
+
+				buffers[iContainer] = slot;
+				capacities[iContainer] = capacity;
+				sizes[iContainer] = size;
+			}
+			else
+			{
+				sizes[iContainer] = size;
+			}
+		}
+
+		builder.Cleanup();
+		return workload;
+	}
+
+	// replay a trace recorded by HeapManager::StartTrace, in recorded order and without the pauses between events
+	inline bool CreateTraceWorkload(const char* i_pPath, Workload& o_workload)
+	{
+		HeapManagerProxy::AllocationTraceReader reader;
+		if (reader.Open(i_pPath) == false)
+			return false;
+
+		WorkloadBuilder builder(o_workload, 0);
+
+		// slot of each outstanding pointer id
+		std::unordered_map<uint32_t, uint32_t> slots;
+
+		HeapManagerProxy::TraceEvent event;
+		while (reader.Read(event))
+		{
+			switch (event.Type)
+			{
+			case HeapManagerProxy::TraceEventType::Malloc:
+				// failed when recorded, nothing to free later
+				if (event.PointerId)
+					slots[event.PointerId] = builder.Alloc(event.Size, 1u << event.AlignmentLog2, event.Lifetime);
+				break;
+
+			case HeapManagerProxy::TraceEventType::Free:
+			{
+				std::unordered_map<uint32_t, uint32_t>::iterator it = slots.find(event.PointerId);
+				if (it != slots.end())
+				{
+					builder.Free(it->second);
+					slots.erase(it);
+				}
+				break;
+			}
+
+			case HeapManagerProxy::TraceEventType::Collect:
+				builder.Collect(event.Size);
+				break;
+			}
+		}
+
+		// allocations alive at the end of the trace
+		builder.Cleanup();
+		return true;
+	}
+}
\ No newline at end of file
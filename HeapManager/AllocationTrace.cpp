@@ -0,0 +1,173 @@
+#include "AllocationTrace.h"
+
+#include <assert.h>
+#include <string.h>
+#include <Windows.h>
+
+namespace HeapManagerProxy
+{
+	AllocationTraceWriter::AllocationTraceWriter() : m_pFile(nullptr), m_nextPointerId(1), m_numBufferedEvents(0)
+	{
+
+	}
+
+	AllocationTraceWriter::~AllocationTraceWriter()
+	{
+		Close();
+	}
+
+	bool AllocationTraceWriter::Open(const char* i_pPath)
+	{
+		assert(m_pFile == nullptr);
+
+		if (fopen_s(&m_pFile, i_pPath, "wb") != 0 || m_pFile == nullptr)
+		{
+			m_pFile = nullptr;
+			return false;
+		}
+
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+
+		TraceFileHeader header;
+		memcpy(header.Magic, s_TraceMagic, sizeof(header.Magic));
+		header.Version = s_TraceVersion;
+		header.TicksPerSecond = frequency.QuadPart;
+		fwrite(&header, sizeof(header), 1, m_pFile);
+
+		m_nextPointerId = 1;
+		m_numBufferedEvents = 0;
+		return true;
+	}
+
+	void AllocationTraceWriter::Close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_pFile == nullptr)
+			return;
+
+		Flush();
+		fclose(m_pFile);
+		m_pFile = nullptr;
+
+		m_pointerIds.clear();
+	}
+
+	void AllocationTraceWriter::RecordMalloc(const void* i_ptr, const size_t i_size, const unsigned int i_alignment, const AllocationLifetime i_lifetime /*= AllocationLifetime::Default*/)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// failed allocations are recorded too, the replay needs the same requests
+		uint32_t pointerId = 0;
+		if (i_ptr)
+		{
+			pointerId = m_nextPointerId++;
+			m_pointerIds[i_ptr] = pointerId;
+		}
+
+		Record(TraceEventType::Malloc, i_size, i_alignment, pointerId, i_lifetime);
+	}
+
+	void AllocationTraceWriter::RecordFree(const void* i_ptr)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		uint32_t pointerId = 0;
+		std::unordered_map<const void*, uint32_t>::iterator it = m_pointerIds.find(i_ptr);
+		if (it != m_pointerIds.end())
+		{
+			pointerId = it->second;
+			m_pointerIds.erase(it);
+		}
+
+		Record(TraceEventType::Free, 0, 0, pointerId);
+	}
+
+	void AllocationTraceWriter::RecordCollect(const size_t i_maxSteps /*= 0*/)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		Record(TraceEventType::Collect, i_maxSteps < UINT32_MAX ? i_maxSteps : UINT32_MAX, 0, 0);
+	}
+
+	// m_mutex is held by caller
+	void AllocationTraceWriter::Record(const TraceEventType i_type, const size_t i_size, const unsigned int i_alignment, const uint32_t i_pointerId,
+		const AllocationLifetime i_lifetime /*= AllocationLifetime::Default*/)
+	{
+		if (m_pFile == nullptr)
+			return;
+
+		LARGE_INTEGER timestamp;
+		QueryPerformanceCounter(&timestamp);
+
+		uint8_t alignmentLog2 = 0;
+		while ((2u << alignmentLog2) <= i_alignment)
+			++alignmentLog2;
+
+		TraceEvent& event = m_buffer[m_numBufferedEvents];
+		event.Type = i_type;
+		event.AlignmentLog2 = alignmentLog2;
+		event.Lifetime = i_lifetime;
+		event.Reserved = 0;
+		event.Size = static_cast<uint32_t>(i_size);
+		event.PointerId = i_pointerId;
+		event.ThreadId = GetCurrentThreadId();
+		event.Timestamp = timestamp.QuadPart;
+
+		if (++m_numBufferedEvents == s_BufferSize)
+			Flush();
+	}
+
+	void AllocationTraceWriter::Flush()
+	{
+		if (m_numBufferedEvents)
+			fwrite(m_buffer, sizeof(TraceEvent), m_numBufferedEvents, m_pFile);
+
+		m_numBufferedEvents = 0;
+	}
+
+	AllocationTraceReader::AllocationTraceReader() : m_pFile(nullptr)
+	{
+		memset(&m_header, 0, sizeof(m_header));
+	}
+
+	AllocationTraceReader::~AllocationTraceReader()
+	{
+		Close();
+	}
+
+	bool AllocationTraceReader::Open(const char* i_pPath)
+	{
+		assert(m_pFile == nullptr);
+
+		if (fopen_s(&m_pFile, i_pPath, "rb") != 0 || m_pFile == nullptr)
+		{
+			m_pFile = nullptr;
+			return false;
+		}
+
+		if (fread(&m_header, sizeof(m_header), 1, m_pFile) != 1
+			|| memcmp(m_header.Magic, s_TraceMagic, sizeof(m_header.Magic)) != 0
+			|| m_header.Version != s_TraceVersion)
+		{
+			Close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void AllocationTraceReader::Close()
+	{
+		if (m_pFile)
+			fclose(m_pFile);
+
+		m_pFile = nullptr;
+	}
+
+	bool AllocationTraceReader::Read(TraceEvent& o_event)
+	{
+		return m_pFile && fread(&o_event, sizeof(TraceEvent), 1, m_pFile) == 1;
+	}
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+#include <mutex>
+#include <unordered_map>
+
+#include "IAllocator.h"
+
+namespace HeapManagerProxy
+{
+	enum class TraceEventType : uint8_t
+	{
+		Malloc = 0,
+		Free = 1,
+		Collect = 2,
+	};
+
+	// 24 bytes per event, PointerId links a free to its malloc, 0 for pointers allocated before tracing started
+	// Size is the step budget of a Collect event, 0 for a full Collect
+	struct TraceEvent
+	{
+		TraceEventType Type;
+		uint8_t AlignmentLog2;
+		AllocationLifetime Lifetime; // Default in traces written before lifetime hints
+		uint8_t Reserved;
+		uint32_t Size;
+		uint32_t PointerId;
+		uint32_t ThreadId;
+		uint64_t Timestamp; // QueryPerformanceCounter ticks
+	};
+
+	static_assert(sizeof(TraceEvent) == 24, "TraceEvent is written to file as it is");
+
+	struct TraceFileHeader
+	{
+		char Magic[4];
+		uint32_t Version;
+		uint64_t TicksPerSecond;
+	};
+
+	// events are copied into a buffer and written to file when it is full
+	class AllocationTraceWriter
+	{
+	public:
+		AllocationTraceWriter();
+		~AllocationTraceWriter();
+
+		bool Open(const char* i_pPath);
+
+		void Close();
+
+		bool IsOpen() const { return m_pFile != nullptr; }
+
+		void RecordMalloc(const void* i_ptr, const size_t i_size, const unsigned int i_alignment, const AllocationLifetime i_lifetime = AllocationLifetime::Default);
+
+		void RecordFree(const void* i_ptr);
+
+		// i_maxSteps = 0 for a full Collect
+		void RecordCollect(const size_t i_maxSteps = 0);
+
+	private:
+		void Record(const TraceEventType i_type, const size_t i_size, const unsigned int i_alignment, const uint32_t i_pointerId,
+			const AllocationLifetime i_lifetime = AllocationLifetime::Default);
+
+		void Flush();
+
+		FILE* m_pFile;
+
+		// pointer ids of outstanding allocations
+		std::unordered_map<const void*, uint32_t> m_pointerIds;
+		uint32_t m_nextPointerId;
+
+		// threads call malloc and free at the same time
+		std::mutex m_mutex;
+
+		static const size_t s_BufferSize = 64 * 1024 / sizeof(TraceEvent);
+		TraceEvent m_buffer[s_BufferSize];
+		size_t m_numBufferedEvents;
+	};
+
+	// read events one by one, the whole trace is never in memory
+	class AllocationTraceReader
+	{
+	public:
+		AllocationTraceReader();
+		~AllocationTraceReader();
+
+		bool Open(const char* i_pPath);
+
+		void Close();
+
+		bool Read(TraceEvent& o_event);
+
+		uint64_t GetTicksPerSecond() const { return m_header.TicksPerSecond; }
+
+	private:
+		FILE* m_pFile;
+		TraceFileHeader m_header;
+	};
+
+	static const char s_TraceMagic[4] = { 'H', 'M', 'T', 'R' };
+	static const uint32_t s_TraceVersion = 1;
+}
@@ -6,6 +6,12 @@
 
 #include "HeapManager_UnitTest.h"
 #include "MemorySystem_UnitTest.h"
+#include "Compaction_UnitTest.h"
+#include "PersistentHeap_UnitTest.h"
+#include "SharedHeap_UnitTest.h"
+#include "StaticHeapManager_UnitTest.h"
+#include "HeapAllocator_Benchmark.h"
+#include "HeapManager_Benchmark.h"
 
 #ifdef _DEBUG
 #define _CRTDBG_MAP_ALLOC
@@ -17,6 +23,33 @@ int main()
 {
 	//HeapManager_UnitTest();
 	MemorySystem_UnitTest();
+	IncrementalCollect_UnitTest();
+	NumaHeaps_UnitTest();
+	Arenas_UnitTest();
+	Alignment_UnitTest();
+	LargeAlloc_UnitTest();
+	UsableSize_UnitTest();
+	Lifetime_UnitTest();
+	Scavenger_UnitTest();
+	Tracing_UnitTest();
+	Categories_UnitTest();
+	PageMap_UnitTest();
+	Lookaside_UnitTest();
+	TinyObjects_UnitTest();
+	LazyInit_UnitTest();
+	Compaction_UnitTest();
+	PersistentHeap_UnitTest();
+	SharedHeap_UnitTest();
+	StaticHeapManager_UnitTest();
+	//HeapAllocator_Benchmark();
+	//FreeBlockIndex_Benchmark();
+	//LargePages_Benchmark();
+	//HeapProfiler_Benchmark();
+	//RemoteFree_Benchmark();
+	//Arenas_Benchmark();
+	//LargeAlloc_Benchmark();
+	//AllocateAtLeast_Benchmark();
+	//TinyObjects_Benchmark();
 
 #if defined(_DEBUG)
 	_CrtDumpMemoryLeaks();
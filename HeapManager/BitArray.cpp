@@ -39,16 +39,29 @@ namespace HeapManagerProxy
 	{
 		assert(m_pBits);
 		memset(m_pBits, 0, (m_numBits + bitsPerElement) / 8);
+		m_numFilledElements = GetNumElements();
 	}
 
 	void BitArray::SetAll(void) // empty
 	{
 		assert(m_pBits);
-		memset(m_pBits, 0xFF, (m_numBits + bitsPerElement) / 8);
+		m_numFilledElements = 0;
+	}
+
+	void BitArray::FillElements(size_t i_numElements)
+	{
+		if (i_numElements <= m_numFilledElements)
+			return;
+
+		memset(m_pBits + m_numFilledElements, 0xFF, (i_numElements - m_numFilledElements) * sizeof(t_BitData));
+		m_numFilledElements = i_numElements;
 	}
 
 	bool BitArray::AreAllBitsClear(void) const
 	{
+		if (m_numFilledElements < GetNumElements())
+			return false;
+
 		for (size_t iByte = 0; iByte <= m_numBits / bitsPerElement; ++iByte)
 		{
 			unsigned long index;
@@ -69,7 +82,7 @@ namespace HeapManagerProxy
 
 	bool BitArray::AreAllBitsSet(void) const
 	{
-		for (size_t iByte = 0; iByte <= m_numBits / bitsPerElement; ++iByte)
+		for (size_t iByte = 0; iByte < m_numFilledElements; ++iByte)
 		{
 			size_t zero = 0;
 			if (~(m_pBits[iByte] & (~zero)))
@@ -84,7 +97,7 @@ namespace HeapManagerProxy
 		size_t iByte = i_bitNumber / bitsPerElement;
 		size_t iBit = i_bitNumber % bitsPerElement;
 
-		return (m_pBits[iByte] & (size_t(1) << iBit));
+		return iByte >= m_numFilledElements || (m_pBits[iByte] & (size_t(1) << iBit));
 	}
 
 	bool BitArray::IsBitClear(size_t i_bitNumber) const
@@ -92,7 +105,7 @@ namespace HeapManagerProxy
 		size_t iByte = i_bitNumber / bitsPerElement;
 		size_t iBit = i_bitNumber % bitsPerElement;
 
-		return (m_pBits[iByte] & (size_t(1) << iBit));
+		return iByte >= m_numFilledElements || (m_pBits[iByte] & (size_t(1) << iBit));
 	}
 
 	void BitArray::SetBit(size_t i_bitNumber)
@@ -102,6 +115,9 @@ namespace HeapManagerProxy
 		size_t iByte = i_bitNumber / bitsPerElement;
 		size_t iBit = i_bitNumber % bitsPerElement;
 
+		if (iByte >= m_numFilledElements)
+			return;
+
 		t_BitData setHelp = t_BitData(1) << iBit;
 		m_pBits[iByte] = m_pBits[iByte] | setHelp;
 	}
@@ -113,13 +129,15 @@ namespace HeapManagerProxy
 		size_t iByte = i_bitNumber / bitsPerElement;
 		size_t iBit = i_bitNumber % bitsPerElement;
 
+		FillElements(iByte + 1);
+
 		t_BitData setHelp = ~(t_BitData(1) << iBit);
 		m_pBits[iByte] = m_pBits[iByte] & setHelp;
 	}
 
 	bool BitArray::GetFirstClearBit(size_t& o_bitNumber) const
 	{
-		for (size_t iByte = 0; iByte <= m_numBits / bitsPerElement; ++iByte)
+		for (size_t iByte = 0; iByte < m_numFilledElements; ++iByte)
 		{
 			for (size_t iBit = 0; iBit < bitsPerElement; ++iBit)
 			{
@@ -135,7 +153,7 @@ namespace HeapManagerProxy
 
 	bool BitArray::GetFirstSetBit(size_t& o_bitNumber) const
 	{
-		for (size_t iByte = 0; iByte <= m_numBits / bitsPerElement; ++iByte)
+		for (size_t iByte = 0; iByte < m_numFilledElements; ++iByte)
 		{
 			if(m_pBits[iByte] == t_BitData(0))
 				continue;
@@ -149,7 +167,10 @@ namespace HeapManagerProxy
 			o_bitNumber = iByte * bitsPerElement + iBit;
 			return (iBit < m_numBits);
 		}
-		return false;
+
+		// the first element not filled yet is all set
+		o_bitNumber = m_numFilledElements * bitsPerElement;
+		return o_bitNumber < m_numBits;
 	}
 
 	bool BitArray::operator[](size_t i_bitNumber) const
@@ -160,12 +181,12 @@ namespace HeapManagerProxy
 		size_t iBit = i_bitNumber % bitsPerElement;
 
 		t_BitData setHelp = t_BitData(1) << iBit;
-		return (m_pBits[iByte] & setHelp);
+		return iByte >= m_numFilledElements || (m_pBits[iByte] & setHelp);
 	}
 
 	void BitArray::Destroy()
 	{
-		m_pAllocator->free(m_pBits);
+		m_pAllocator->HeapAllocator::free(m_pBits);
 		m_pBits = nullptr;
 	}
 
@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "RelativePtr.h"
+
 namespace HeapManagerProxy
 {
 	class HeapAllocator;
@@ -15,18 +17,24 @@ namespace HeapManagerProxy
 		typedef uint64_t t_BitData;
 #endif
 		size_t m_numBits;
-		t_BitData* m_pBits;
+		RelativePtr<t_BitData> m_pBits;
+
+		// elements below are in m_pBits, the others are all set and not written yet
+		size_t m_numFilledElements;
 
 		static size_t bitsPerElement;
 
-		HeapAllocator* m_pAllocator;
+		RelativePtr<HeapAllocator> m_pAllocator;
 	public:
 		static BitArray* Create(size_t i_numBits, HeapAllocator* i_pAllocator);
 
-		BitArray(size_t i_numBits, t_BitData* i_pBits, HeapAllocator* i_pAllocator) : m_numBits(i_numBits), m_pBits(i_pBits), m_pAllocator(i_pAllocator) {}
+		// all bits are set, m_pBits is filled as the bits are cleared
+		BitArray(size_t i_numBits, t_BitData* i_pBits, HeapAllocator* i_pAllocator) : m_numBits(i_numBits), m_pBits(i_pBits), m_numFilledElements(0), m_pAllocator(i_pAllocator) {}
 		virtual ~BitArray();
 
 		void ClearAll(void);
+
+		// constant time, the elements are filled again when their bits are cleared
 		void SetAll(void);
 
 		bool AreAllBitsClear(void) const;
@@ -47,6 +55,12 @@ namespace HeapManagerProxy
 		bool operator[](size_t i_bitNumber) const;
 
 		void Destroy();
+
+	private:
+		inline size_t GetNumElements() const { return m_numBits / bitsPerElement + 1; }
+
+		// write the set elements up to i_numElements
+		void FillElements(size_t i_numElements);
 	};
 }
 
@@ -0,0 +1,131 @@
+#pragma once
+#include <Windows.h>
+
+#include <assert.h>
+#include <string.h>
+#include <new>
+#include <vector>
+
+#include "HeapAllocator.h"
+
+bool Compaction_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const size_t sizeHeap = 1024 * 1024;
+	const size_t maxHandles = 2048;
+	const size_t compactMicroseconds = 100;
+
+	void* pHeapMemory = VirtualAlloc(NULL, sizeHeap, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	assert(pHeapMemory);
+
+	if (pHeapMemory == nullptr)
+		return false;
+
+	void* pAllocatorMemory = reinterpret_cast<HeapAllocator*>(pHeapMemory) + 1;
+	HeapAllocator* pHeapAllocator = new (pHeapMemory) HeapAllocator(pAllocatorMemory, sizeHeap - sizeof(HeapAllocator));
+
+	bool success = pHeapAllocator->CreateHandleTable(maxHandles);
+	assert(success);
+
+	struct TestBlock
+	{
+		MemoryHandle handle;
+		size_t size;
+		unsigned char pattern;
+	};
+	std::vector<TestBlock> Blocks;
+
+	// fill the heap with relocatable blocks
+	const unsigned int alignments[] = { 4, 8, 16, 32, 64 };
+	while (Blocks.size() < maxHandles)
+	{
+		const size_t sizeAlloc = 1 + (rand() & (1024 - 1));
+		const unsigned int alignment = alignments[rand() % (sizeof(alignments) / sizeof(alignments[0]))];
+
+		MemoryHandle handle = pHeapAllocator->AllocHandle(sizeAlloc, alignment);
+		if (handle.IsValid() == false)
+			break;
+
+		TestBlock block = { handle, sizeAlloc, static_cast<unsigned char>(Blocks.size()) };
+		void* pPtr = pHeapAllocator->Pin(handle);
+		success = success && (reinterpret_cast<uintptr_t>(pPtr) & (alignment - 1)) == 0;
+		assert(success);
+		memset(pPtr, block.pattern, sizeAlloc);
+		pHeapAllocator->Unpin(handle);
+
+		Blocks.push_back(block);
+	}
+
+	// free every other block, no free block can be merged
+	std::vector<TestBlock> LiveBlocks;
+	for (size_t i = 0; i < Blocks.size(); ++i)
+	{
+		if (i % 2)
+		{
+			success = pHeapAllocator->FreeHandle(Blocks[i].handle) && success;
+			assert(success);
+		}
+		else
+		{
+			LiveBlocks.push_back(Blocks[i]);
+		}
+	}
+
+	// a freed handle is no longer valid
+	success = success && pHeapAllocator->Pin(Blocks[1].handle) == nullptr;
+	assert(success);
+
+	size_t largestBeforeCompact = pHeapAllocator->GetLargestFreeBlock();
+
+	// a pinned block stays in place
+	const TestBlock& pinnedBlock = LiveBlocks[LiveBlocks.size() / 2];
+	void* pPinned = pHeapAllocator->Pin(pinnedBlock.handle);
+
+	while (pHeapAllocator->Compact(compactMicroseconds) == false) {}
+
+	void* pPinnedAfterCompact = pHeapAllocator->Pin(pinnedBlock.handle);
+	success = success && pPinnedAfterCompact == pPinned;
+	assert(success);
+
+	pHeapAllocator->Unpin(pinnedBlock.handle);
+	pHeapAllocator->Unpin(pinnedBlock.handle);
+
+	while (pHeapAllocator->Compact(compactMicroseconds) == false) {}
+
+	size_t largestAfterCompact = pHeapAllocator->GetLargestFreeBlock();
+	printf("Largest free block before compaction %zu, after compaction %zu\n", largestBeforeCompact, largestAfterCompact);
+	success = success && largestAfterCompact > largestBeforeCompact;
+	assert(success);
+
+	// moved blocks keep their content
+	for (size_t i = 0; i < LiveBlocks.size(); ++i)
+	{
+		const unsigned char* pPtr = static_cast<const unsigned char*>(pHeapAllocator->Pin(LiveBlocks[i].handle));
+		success = success && pPtr;
+		assert(success);
+
+		for (size_t iByte = 0; pPtr && iByte < LiveBlocks[i].size; ++iByte)
+		{
+			if (pPtr[iByte] != LiveBlocks[i].pattern)
+			{
+				success = false;
+				break;
+			}
+		}
+		assert(success);
+
+		pHeapAllocator->Unpin(LiveBlocks[i].handle);
+		success = pHeapAllocator->FreeHandle(LiveBlocks[i].handle) && success;
+	}
+
+	pHeapAllocator->DestroyHandleTable();
+	pHeapAllocator->Collect();
+	success = success && pHeapAllocator->IsEmpty();
+	assert(success);
+
+	pHeapAllocator->~HeapAllocator();
+	VirtualFree(pHeapMemory, 0, MEM_RELEASE);
+
+	return success;
+}
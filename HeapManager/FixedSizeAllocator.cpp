@@ -8,14 +8,23 @@ namespace HeapManagerProxy
 {
 	FixedSizeAllocator::FixedSizeAllocator(void* i_pAllocatorMemory, void* i_pAvailableBlocks, const size_t sizeBlock, const size_t numBlocks) 
 		: m_pAllocatorMemory(i_pAllocatorMemory),
-		m_initData(sizeBlock, numBlocks)
+		m_initData(sizeBlock, numBlocks),
+		m_numTouchedBlocks(0)
 	{
+		// blocks are not filled up front, a page is first touched by the alloc of its first block
 		m_pAvailableBlocks = static_cast<BitArray*>(i_pAvailableBlocks);
-		memset(m_pAllocatorMemory, _bDeadLandFill, sizeBlock * numBlocks); // initial free all
+		m_pCategories = nullptr;
+
+#ifdef HEAP_TRACING
+		m_allocLatency.Reset();
+		m_freeLatency.Reset();
+#endif
 	}
 
 	void* FixedSizeAllocator::alloc(const size_t sizeAlloc, const unsigned int alignment /*= 4*/)
 	{
+		HEAP_PROBE_SCOPE(ProbePoint::FixedSizeAlloc, m_allocLatency, nullptr, sizeAlloc);
+
 		size_t realAllocSize = GUARD_BAND_SIZE + sizeAlloc + GUARD_BAND_SIZE;
 
 		if (realAllocSize > m_initData.sizeBlocks)
@@ -38,19 +47,27 @@ namespace HeapManagerProxy
 
 			m_pAvailableBlocks->ClearBit(i_firstAvailable);
 
+			// the lowest free block is always taken, so the blocks are touched in order
+			if (i_firstAvailable >= m_numTouchedBlocks)
+				m_numTouchedBlocks = i_firstAvailable + 1;
+
 			memset(pBlockStartAddr, _bAlignLandFill, pUserMemory - pBlockStartAddr);		// align
 			memset(pUserMemory - GUARD_BAND_SIZE, _bNoMansLandFill, GUARD_BAND_SIZE);		// header guard
 			memset(pUserMemory, _bCleanLandFill, sizeAlloc);								// user memory
 			memset(pUserMemory + sizeAlloc, _bNoMansLandFill, GUARD_BAND_SIZE);				// tail guard
-			printf("allocated memory %p from %zuKB fixed-size heap bit id %zu\n", pBlockStartAddr, m_initData.sizeBlocks, i_firstAvailable);
+			// printf("allocated memory %p from %zuKB fixed-size heap bit id %zu\n", pBlockStartAddr, m_initData.sizeBlocks, i_firstAvailable);
 		}
 
+		HEAP_PROBE_RESULT(pUserMemory);
+
 		return pUserMemory;
 	}
 
 	bool FixedSizeAllocator::free(const void* pPtr)
 	{
-		if (!Contains(pPtr))
+		HEAP_PROBE_SCOPE(ProbePoint::FixedSizeFree, m_freeLatency, pPtr, 0);
+
+		if (!FixedSizeAllocator::IsAllocated(pPtr))
 			return false;
 
 		size_t offset = static_cast<char*>(const_cast<void*>(pPtr)) - static_cast<char*>(m_pAllocatorMemory);
@@ -63,6 +80,28 @@ namespace HeapManagerProxy
 		return true;
 	}
 
+	size_t FixedSizeAllocator::GetUsableSize(const void* pPtr) const
+	{
+		size_t offset = static_cast<const char*>(pPtr) - static_cast<const char*>(m_pAllocatorMemory);
+		size_t offsetInBlock = offset % m_initData.sizeBlocks;
+
+		return m_initData.sizeBlocks - offsetInBlock - GUARD_BAND_SIZE;
+	}
+
+	void FixedSizeAllocator::SetCategory(const void* pPtr, const uint8_t i_category)
+	{
+		if (m_pCategories)
+			m_pCategories[(static_cast<const char*>(pPtr) - static_cast<const char*>(m_pAllocatorMemory)) / m_initData.sizeBlocks] = i_category;
+	}
+
+	uint8_t FixedSizeAllocator::GetCategory(const void* pPtr) const
+	{
+		if (m_pCategories == nullptr)
+			return 0;
+
+		return m_pCategories[(static_cast<const char*>(pPtr) - static_cast<const char*>(m_pAllocatorMemory)) / m_initData.sizeBlocks];
+	}
+
 	bool FixedSizeAllocator::Contains(const void* pPtr)
 	{
 		char* m_pMemoryEnd = static_cast<char*>(m_pAllocatorMemory) + m_initData.numBlocks * m_initData.sizeBlocks;
@@ -74,7 +113,12 @@ namespace HeapManagerProxy
 
 	bool FixedSizeAllocator::IsAllocated(const void* pPtr)
 	{
-		return Contains(pPtr);
+		if (!FixedSizeAllocator::Contains(pPtr))
+			return false;
+
+		// a set bit is an available block
+		const size_t offset = static_cast<const char*>(pPtr) - static_cast<const char*>(m_pAllocatorMemory);
+		return (*m_pAvailableBlocks)[offset / m_initData.sizeBlocks] == false;
 	}
 
 	void FixedSizeAllocator::ShowFreeBlocks()
@@ -1,5 +1,8 @@
 #pragma once
+#include <stdint.h>
+#include "HeapProbe.h"
 #include "IAllocator.h"
+#include "RelativePtr.h"
 
 namespace HeapManagerProxy
 {
@@ -26,6 +29,17 @@ namespace HeapManagerProxy
 
 		bool free(const void* pPtr) override;
 
+		// bytes from pPtr to the end of its block, less the tail guard
+		size_t GetUsableSize(const void* pPtr) const;
+
+		// one byte per block for the memory category, the table is not filled, each block is tagged when allocated
+		// without a table every block is untagged
+		void SetCategoryTable(uint8_t* i_pCategories) { m_pCategories = i_pCategories; }
+
+		void SetCategory(const void* pPtr, const uint8_t i_category);
+
+		uint8_t GetCategory(const void* pPtr) const;
+
         void Collect() override {}; // no need collect
 
         bool Contains(const void* pPtr) override;
@@ -42,11 +56,32 @@ namespace HeapManagerProxy
 
         inline const size_t GetNumBlocks() const { return m_initData.numBlocks; }
 
+        inline const size_t GetBlockSize() const { return m_initData.sizeBlocks; }
+
+		// high-water mark, blocks above it were never allocated and their pages never touched
+		inline const size_t GetNumTouchedBlocks() const { return m_numTouchedBlocks; }
+
+#ifdef HEAP_TRACING
+		// time spent in alloc and free, see HeapProbe.h
+		const LatencyHistogram& GetAllocLatency() const { return m_allocLatency; }
+
+		const LatencyHistogram& GetFreeLatency() const { return m_freeLatency; }
+#endif
+
 	protected:
-		void* m_pAllocatorMemory;
+		// relative, the allocator can live in memory that other processes map at other addresses
+		RelativePtr<void> m_pAllocatorMemory;
 
-        BitArray* m_pAvailableBlocks;
+        RelativePtr<BitArray> m_pAvailableBlocks;
+		RelativePtr<uint8_t> m_pCategories;
         FSAInitData m_initData;
+
+		size_t m_numTouchedBlocks;
+
+#ifdef HEAP_TRACING
+		LatencyHistogram m_allocLatency;
+		LatencyHistogram m_freeLatency;
+#endif
     };
 }
 
@@ -0,0 +1,102 @@
+#include "FreeBlockIndex.h"
+
+#include <string.h>
+#include <assert.h>
+
+namespace HeapManagerProxy
+{
+	void FreeBlockIndex::Attach(void* i_pStorage, const size_t i_capacity)
+	{
+		assert(i_capacity >= m_numBlocks);
+
+		size_t* pSizes = static_cast<size_t*>(i_pStorage);
+		ptrdiff_t* pBaseOffsets = reinterpret_cast<ptrdiff_t*>(pSizes + i_capacity);
+
+		// offsets are from the index, not from the storage, they are copied as they are
+		if (m_numBlocks)
+		{
+			memcpy(pSizes, GetSizes(), m_numBlocks * sizeof(size_t));
+			memcpy(pBaseOffsets, GetBaseOffsets(), m_numBlocks * sizeof(ptrdiff_t));
+		}
+
+		m_storageOffset = GetOffset(i_pStorage);
+		m_capacity = i_capacity;
+	}
+
+	size_t FreeBlockIndex::FindFirstNotLess(const size_t i_size, const size_t i_start /*= 0*/) const
+	{
+		const size_t* pSizes = GetSizes();
+		size_t iBlock = i_start;
+
+		// no early exit inside a group, so the compare can be vectorized
+		for (; iBlock + s_ScanGroupSize <= m_numBlocks; iBlock += s_ScanGroupSize)
+		{
+			size_t found = 0;
+			for (size_t i = 0; i < s_ScanGroupSize; ++i)
+				found |= static_cast<size_t>(pSizes[iBlock + i] >= i_size);
+
+			if (found)
+				break;
+		}
+
+		for (; iBlock < m_numBlocks; ++iBlock)
+		{
+			if (pSizes[iBlock] >= i_size)
+				return iBlock;
+		}
+
+		return m_numBlocks;
+	}
+
+	size_t FreeBlockIndex::LowerBound(const void* i_pAddress) const
+	{
+		const ptrdiff_t* pBaseOffsets = GetBaseOffsets();
+		const ptrdiff_t offset = GetOffset(i_pAddress);
+		size_t iLow = 0;
+		size_t iHigh = m_numBlocks;
+
+		while (iLow < iHigh)
+		{
+			size_t iMid = iLow + (iHigh - iLow) / 2;
+			if (pBaseOffsets[iMid] < offset)
+				iLow = iMid + 1;
+			else
+				iHigh = iMid;
+		}
+
+		return iLow;
+	}
+
+	void FreeBlockIndex::Insert(const size_t i_index, void* i_pBaseAddress, const size_t i_size)
+	{
+		assert(m_numBlocks < m_capacity);
+		assert(i_index <= m_numBlocks);
+
+		size_t* pSizes = GetSizes();
+		ptrdiff_t* pBaseOffsets = GetBaseOffsets();
+
+		size_t numMoved = m_numBlocks - i_index;
+		memmove(pSizes + i_index + 1, pSizes + i_index, numMoved * sizeof(size_t));
+		memmove(pBaseOffsets + i_index + 1, pBaseOffsets + i_index, numMoved * sizeof(ptrdiff_t));
+
+		Set(i_index, i_pBaseAddress, i_size);
+		++m_numBlocks;
+	}
+
+	void FreeBlockIndex::Erase(const size_t i_index, const size_t i_count /*= 1*/)
+	{
+		assert(i_index + i_count <= m_numBlocks);
+
+		if (i_count == 0)
+			return;
+
+		size_t* pSizes = GetSizes();
+		ptrdiff_t* pBaseOffsets = GetBaseOffsets();
+
+		size_t numMoved = m_numBlocks - i_index - i_count;
+		memmove(pSizes + i_index, pSizes + i_index + i_count, numMoved * sizeof(size_t));
+		memmove(pBaseOffsets + i_index, pBaseOffsets + i_index + i_count, numMoved * sizeof(ptrdiff_t));
+
+		m_numBlocks -= i_count;
+	}
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "RelativePtr.h"
+
+namespace HeapManagerProxy
+{
+	// free blocks sorted by address
+	// sizes and base addresses are kept in two parallel arrays, the fit search
+	// is a linear scan over contiguous sizes instead of chasing block descriptors
+	// the storage and base addresses are offsets from the index itself, so the heap holding both can be mapped anywhere
+	class FreeBlockIndex
+	{
+	public:
+		FreeBlockIndex() : m_storageOffset(0), m_numBlocks(0), m_capacity(0) {}
+
+		FreeBlockIndex(const FreeBlockIndex&) = delete;
+
+		static size_t GetStorageSize(const size_t i_capacity) { return i_capacity * (sizeof(size_t) + sizeof(ptrdiff_t)); }
+
+		// move all blocks into new storage with room for i_capacity blocks
+		void Attach(void* i_pStorage, const size_t i_capacity);
+
+		// the first block from i_start whose size is not less than i_size, GetCount() if none
+		size_t FindFirstNotLess(const size_t i_size, const size_t i_start = 0) const;
+
+		// the first block whose base address is not less than i_pAddress
+		size_t LowerBound(const void* i_pAddress) const;
+
+		void Insert(const size_t i_index, void* i_pBaseAddress, const size_t i_size);
+
+		void Erase(const size_t i_index, const size_t i_count = 1);
+
+		inline void Set(const size_t i_index, void* i_pBaseAddress, const size_t i_size)
+		{
+			GetBaseOffsets()[i_index] = GetOffset(i_pBaseAddress);
+			GetSizes()[i_index] = i_size;
+		}
+
+		inline void SetSize(const size_t i_index, const size_t i_size) { GetSizes()[i_index] = i_size; }
+
+		inline size_t GetSize(const size_t i_index) const { return GetSizes()[i_index]; }
+
+		inline char* GetBaseAddress(const size_t i_index) const { return GetOrigin() + GetBaseOffsets()[i_index]; }
+
+		inline char* GetEndAddress(const size_t i_index) const { return GetBaseAddress(i_index) + GetSizes()[i_index]; }
+
+		inline size_t GetCount() const { return m_numBlocks; }
+
+		inline size_t GetCapacity() const { return m_capacity; }
+
+	private:
+		inline char* GetOrigin() const { return const_cast<char*>(reinterpret_cast<const char*>(this)); }
+
+		inline ptrdiff_t GetOffset(const void* i_pAddress) const { return static_cast<const char*>(i_pAddress) - GetOrigin(); }
+
+		// sizes first, then the base offsets, only read when the capacity is not 0
+		inline size_t* GetSizes() const { return reinterpret_cast<size_t*>(GetOrigin() + m_storageOffset); }
+
+		inline ptrdiff_t* GetBaseOffsets() const { return reinterpret_cast<ptrdiff_t*>(GetSizes() + m_capacity); }
+
+		ptrdiff_t m_storageOffset;
+
+		size_t m_numBlocks;
+		size_t m_capacity;
+
+		// sizes compared together before looking for the exact one
+		static const size_t s_ScanGroupSize = 16;
+	};
+}
@@ -1,9 +1,12 @@
 #include "HeapAllocator.h"
 #include "string.h"
 #include <assert.h>
+#include <stdint.h>
 #include <new>
+#include <chrono>
 #include "stdio.h"
 #include "Utils.h"
+#include <Windows.h>
 
 namespace HeapManagerProxy
 {
@@ -11,60 +14,125 @@ namespace HeapManagerProxy
 
 	HeapAllocator::HeapAllocator(void* i_pAllocatorMemory, const size_t sizeHeap)
 	{
-		pFreeList = nullptr;
-		pOutstandingAllocations = nullptr;
+		bCoalesceOnFree = true;
 
-		pHeapStartAddress = i_pAllocatorMemory;
-		pHeapEndAddress = static_cast<char*>(pHeapStartAddress) + sizeHeap;
+		pFreeBlockIndexStorage = nullptr;
+		pFreeDescriptors = nullptr;
+		numOutstandingAllocations = 0;
+		iCollectCursor = s_NoCollectCursor;
+		bCollectPending = false;
+		bReleasePending = false;
 
+		bLookaside = true;
+		for (size_t i = 0; i < s_NumLookasideClasses; ++i)
+		{
+			pLookaside[i] = nullptr;
+			LookasideDepth[i] = 0;
+		}
+		numLookasideBlocks = 0;
+		sizeLookaside = 0;
+
+		pHandleTable = nullptr;
+		numHandles = 0;
+		iFirstFreeHandle = 0;
+		pCompactCeiling = nullptr;
+		pCompactBlock = nullptr;
+
+#ifdef HEAP_TRACING
+		AllocLatency.Reset();
+		FreeLatency.Reset();
+		CollectLatency.Reset();
+#endif
+
+		pHeapEndAddress = static_cast<char*>(i_pAllocatorMemory) + sizeHeap;
 		pHeapAllocedEndAddress = pHeapEndAddress;
-		memset(pHeapStartAddress, _bDeadLandFill, sizeHeap);
+
+		// descriptors are carved from the heap start, keep them in whole cache lines
+		pHeapStartAddress = Utils::AlignUpAddress(i_pAllocatorMemory, s_CacheLineSize);
+		assert(pHeapStartAddress <= pHeapEndAddress);
+
+		pDescriptorPool = static_cast<MemoryBlock*>(pHeapStartAddress);
+
+		// untouched heap between the descriptors and pHeapEndAddress is not filled,
+		// its pages are backed when blocks or descriptors are first carved from them
 	}
 
 	HeapAllocator::~HeapAllocator()
 	{
-		assert(pOutstandingAllocations == nullptr);
+		assert(numOutstandingAllocations == 0);
+	}
+
+	HeapAllocator* HeapAllocator::Reopen(void* i_pImage)
+	{
+		static_assert(sizeof(IAllocator) == sizeof(void*), "IAllocator should only hold the virtual table pointer");
+
+		// the virtual table pointer in the image belongs to the process that wrote it, an object constructed
+		// in place gets the one of this process, then the members are copied back over it byte for byte
+		// the bytes go back to the same address, so the relative pointers in them still hold
+		const size_t sizeMembers = sizeof(HeapAllocator) - sizeof(IAllocator);
+		unsigned char members[sizeof(HeapAllocator) - sizeof(IAllocator)];
+		memcpy(members, static_cast<char*>(i_pImage) + sizeof(IAllocator), sizeMembers);
+
+		HeapAllocator* pHeap = new (i_pImage) HeapAllocator(ReopenImage());
+		memcpy(reinterpret_cast<char*>(pHeap) + sizeof(IAllocator), members, sizeMembers);
+
+		return pHeap;
 	}
 
 	void* HeapAllocator::alloc(const size_t sizeAlloc, const unsigned int alignment /*= 4*/)
 	{
-		// GUARD_BAND only exist in _DEBUG
-		MemoryBlock* pBlockDescriptor = FindFirstFittingFreeBlock(GUARD_BAND_SIZE + sizeAlloc + GUARD_BAND_SIZE, alignment);
-		pBlockDescriptor = pBlockDescriptor == nullptr ? GetFreeMemoryBlockDescriptor() : pBlockDescriptor;
-		if (pBlockDescriptor == nullptr)
-			return nullptr;
+		HEAP_PROBE_SCOPE(ProbePoint::HeapAlloc, AllocLatency, nullptr, sizeAlloc);
 
-		size_t maxCapacity = 0;
-		void* pAvailableStart = Utils::AlignUpAddress(static_cast<char*>(pHeapStartAddress) + s_MinumumToLeave + GUARD_BAND_SIZE, alignment);
-		void* pAvailableEnd = pHeapEndAddress;
+		void* pUserMemory = AllocBlock(sizeAlloc, alignment, false);
+		HEAP_PROBE_RESULT(pUserMemory);
 
-		if (pAvailableEnd > pAvailableStart)
-			maxCapacity = static_cast<char*>(pAvailableEnd) - static_cast<char*>(pAvailableStart);
+		return pUserMemory;
+	}
 
-		if (maxCapacity < sizeAlloc + GUARD_BAND_SIZE) // left memory not enough
-		{
-			ReturnMemoryBlockDescriptor(pBlockDescriptor);
+	void* HeapAllocator::AllocLongLived(const size_t sizeAlloc, const unsigned int alignment /*= 4*/)
+	{
+		return AllocBlock(sizeAlloc, alignment, true);
+	}
+
+	void* HeapAllocator::AllocBlock(const size_t sizeAlloc, const unsigned int i_alignment, const bool i_bUntouchedFirst)
+	{
+		const unsigned int alignment = i_alignment < s_MinBlockAlignment ? s_MinBlockAlignment : i_alignment;
+
+		// every outstanding allocation can split the free space once more,
+		// keep room for all free blocks before handing out a new one
+		// kept blocks go back to free blocks too
+		if (numOutstandingAllocations + numLookasideBlocks + 3 > FreeBlocks.GetCapacity() && GrowFreeBlockIndex() == false)
 			return nullptr;
-		}
 
-		// the alignment is for user memory start point
-		char* pBlockStartAddress = static_cast<char*>(Utils::AlignDownAddress(static_cast<char*>(pHeapEndAddress) - GUARD_BAND_SIZE - sizeAlloc, alignment));
+		// long-lived blocks stay away from the blocks freed last
+		MemoryBlock* pBlockDescriptor = i_bUntouchedFirst ? nullptr : PopLookaside(sizeAlloc, alignment);
+		if (pBlockDescriptor == nullptr)
+		{
+			pBlockDescriptor = AllocMemoryBlock(sizeAlloc, alignment, i_bUntouchedFirst);
 
-		pBlockDescriptor->pBaseAddress = pBlockStartAddress - GUARD_BAND_SIZE;
-		pBlockDescriptor->BlockSize = static_cast<char*>(pHeapEndAddress) - (pBlockStartAddress - GUARD_BAND_SIZE);
+			// the kept blocks may merge into one that fits, the full merge is left to Collect
+			// a Collect here could release the index the check above made room in
+			if (pBlockDescriptor == nullptr && numLookasideBlocks)
+			{
+				FlushLookaside();
+				pBlockDescriptor = AllocMemoryBlock(sizeAlloc, alignment, i_bUntouchedFirst);
+			}
 
-		pHeapEndAddress = pBlockDescriptor->pBaseAddress;
+			if (pBlockDescriptor == nullptr)
+				return nullptr;
 
-		assert(pHeapStartAddress <= pHeapEndAddress);
+			TrimAlignmentSlack(pBlockDescriptor, sizeAlloc);
+		}
 
-		pBlockDescriptor->pNextBlock = pOutstandingAllocations;
-		pOutstandingAllocations = pBlockDescriptor;
+		pBlockDescriptor->HandleId = 0;
+		pBlockDescriptor->Category = 0;
+		++numOutstandingAllocations;
 
-		char* pUserMemory = static_cast<char*>(pBlockDescriptor->pBaseAddress) + GUARD_BAND_SIZE;
+		char* pUserMemory = GetUserMemory(pBlockDescriptor);
 		memset(pUserMemory - GUARD_BAND_SIZE, _bNoMansLandFill, GUARD_BAND_SIZE);	// head guard
 		memset(pUserMemory, _bCleanLandFill, sizeAlloc); // user alloc memory
 		memset(pUserMemory + sizeAlloc, _bNoMansLandFill, GUARD_BAND_SIZE); // tail guard
-		memset(pUserMemory + sizeAlloc + GUARD_BAND_SIZE, _bAlignLandFill, pBlockDescriptor->BlockSize - (GUARD_BAND_SIZE + sizeAlloc + GUARD_BAND_SIZE)); // alignment
+		memset(pUserMemory + sizeAlloc + GUARD_BAND_SIZE, _bAlignLandFill, pBlockDescriptor->BlockSize - (s_BlockHeadSize + sizeAlloc + GUARD_BAND_SIZE)); // alignment
 
 		// printf("allocated memory %p\n", pUserMemory - GUARD_BAND_SIZE);
 		return pUserMemory;
@@ -72,8 +140,11 @@ namespace HeapManagerProxy
 
 	bool HeapAllocator::free(const void* pPtr)
 	{
+		HEAP_PROBE_SCOPE(ProbePoint::HeapFree, FreeLatency, pPtr, 0);
+
 		// assert(Contains(pPtr));
-		if (Contains(pPtr) == false)
+		// calls on this are qualified, a heap in shared memory may have the vptr of another process
+		if (HeapAllocator::Contains(pPtr) == false)
 		{
 			printf("Default Heap does not contains %p\n", pPtr);
 			return false;
@@ -81,76 +152,231 @@ namespace HeapManagerProxy
 
 		// printf("start free %p\n", pPtr);
 
-		MemoryBlock* pCurBlock = pOutstandingAllocations;
-		MemoryBlock* pPrevBlock = nullptr;
-		while (pCurBlock)
+		MemoryBlock* pCurBlock = FindOutstandingBlock(pPtr);
+		if (pCurBlock == nullptr)
+			return false;
+
+		--numOutstandingAllocations;
+
+		if (pCurBlock->HandleId)
 		{
-			if (static_cast<char*>(pCurBlock->pBaseAddress) + GUARD_BAND_SIZE == pPtr)
-			{
-				if (pPrevBlock)
-					pPrevBlock->pNextBlock = pCurBlock->pNextBlock;
-				else
-					pOutstandingAllocations = pCurBlock->pNextBlock;
-				pCurBlock->pNextBlock = nullptr;
-				ReturnMemoryBlockDescriptor(pCurBlock);
-				break;
-			}
+			HandleEntry& entry = pHandleTable[pCurBlock->HandleId - 1];
+			entry.pBlock = nullptr;
+			entry.Generation = entry.Generation + 1 == 0 ? 1 : entry.Generation + 1;
+			entry.NextFreeEntry = iFirstFreeHandle;
+			iFirstFreeHandle = pCurBlock->HandleId - 1;
 
-			pPrevBlock = pCurBlock;
-			pCurBlock = pCurBlock->pNextBlock;
+			pCurBlock->HandleId = 0;
 		}
 
-		return (pCurBlock != nullptr);
+		if (PushLookaside(pCurBlock) == false)
+			ReturnMemoryBlockDescriptor(pCurBlock);
+
+		return true;
 	}
 
-	void HeapAllocator::Collect()
+	void HeapAllocator::SetLookaside(bool i_bLookaside)
 	{
-		if (pFreeList == nullptr)
-			return;
+		bLookaside = i_bLookaside;
+
+		if (bLookaside == false)
+			FlushLookaside();
+	}
+
+	bool HeapAllocator::PushLookaside(MemoryBlock* i_pBlock)
+	{
+		const size_t iClass = i_pBlock->BlockSize / s_LookasideGranularity;
+		if (bLookaside == false || iClass >= s_NumLookasideClasses
+			|| LookasideDepth[iClass] >= s_MaxLookasideDepth || sizeLookaside + i_pBlock->BlockSize > s_MaxLookasideSize)
+			return false;
 
-		MemoryBlock* pCurBlock = pFreeList;
-		MemoryBlock* pNextBlock = pCurBlock->pNextBlock;
+		// the descriptor and the block header stay, the block is only marked as kept
+		i_pBlock->HandleId = s_LookasideHandleId;
+		i_pBlock->pNextBlock = pLookaside[iClass];
+		pLookaside[iClass] = i_pBlock;
 
-		while (pCurBlock && pNextBlock)
+		++LookasideDepth[iClass];
+		++numLookasideBlocks;
+		sizeLookaside += i_pBlock->BlockSize;
+
+		return true;
+	}
+
+	MemoryBlock* HeapAllocator::PopLookaside(const size_t sizeAlloc, const unsigned int alignment)
+	{
+		// the class a block of exactly this size falls in, then the next one whose blocks all fit
+		// a block is at most 2 * s_LookasideGranularity - 1 bytes larger than the request
+		const size_t sizeBlock = s_BlockHeadSize + sizeAlloc + GUARD_BAND_SIZE;
+		size_t iClass = sizeBlock / s_LookasideGranularity;
+		MemoryBlock* pBlock = nullptr;
+		for (const size_t iLastClass = iClass + 1; iClass <= iLastClass && iClass < s_NumLookasideClasses; ++iClass)
 		{
-			// ship all empty block descriptor
-			if (pCurBlock->BlockSize > 0)
-			{
-				if (static_cast<char*>(pCurBlock->pBaseAddress) + pCurBlock->BlockSize == pNextBlock->pBaseAddress)
-				{
-					pCurBlock->pNextBlock = pNextBlock->pNextBlock;
-					pCurBlock->BlockSize += pNextBlock->BlockSize;
+			// only the last block freed in the class is tried
+			pBlock = pLookaside[iClass];
+			if (pBlock && pBlock->BlockSize >= sizeBlock && Utils::AlignUpAddress(GetUserMemory(pBlock), alignment) == GetUserMemory(pBlock))
+				break;
 
-					pNextBlock->BlockSize = 0;
-					pNextBlock->pBaseAddress = nullptr;
+			pBlock = nullptr;
+		}
+
+		if (pBlock == nullptr)
+			return nullptr;
+
+		pLookaside[iClass] = pBlock->pNextBlock;
+
+		--LookasideDepth[iClass];
+		--numLookasideBlocks;
+		sizeLookaside -= pBlock->BlockSize;
+
+		pBlock->HandleId = 0;
+
+		return pBlock;
+	}
+
+	void HeapAllocator::FlushLookaside()
+	{
+		for (size_t iClass = 0; iClass < s_NumLookasideClasses && numLookasideBlocks; ++iClass)
+		{
+			// the block is off its list before it goes back, a full index grows without flushing
+			MemoryBlock* pBlock;
+			while ((pBlock = pLookaside[iClass]) != nullptr)
+			{
+				pLookaside[iClass] = pBlock->pNextBlock;
 
-					pNextBlock->pNextBlock = pFreeList;
-					pFreeList = pNextBlock;
+				--LookasideDepth[iClass];
+				--numLookasideBlocks;
+				sizeLookaside -= pBlock->BlockSize;
 
-					// if merged, not move current block point
-					pNextBlock = pCurBlock->pNextBlock;
-				}
+				pBlock->HandleId = 0;
+				ReturnMemoryBlockDescriptor(pBlock);
 			}
-			else
-			{ 
-				pCurBlock = pNextBlock;
-				pNextBlock = pNextBlock->pNextBlock;
+		}
+	}
+
+	MemoryBlock* HeapAllocator::FindOutstandingBlock(const void* pPtr) const
+	{
+		if (pPtr < static_cast<char*>(pHeapStartAddress) + s_BlockHeadSize || pPtr > pHeapAllocedEndAddress)
+			return nullptr;
+
+		MemoryBlock* pBlock = *reinterpret_cast<const RelativePtr<MemoryBlock>*>(static_cast<const char*>(pPtr) - s_BlockHeadSize);
+
+		// the header of any other address is user data, only trust a descriptor of the pool
+		if (pBlock < pDescriptorPool || pBlock >= pHeapStartAddress
+			|| (reinterpret_cast<char*>(pBlock) - reinterpret_cast<char*>(pDescriptorPool.Get())) % sizeof(MemoryBlock) != 0)
+			return nullptr;
+
+		if (IsOutstanding(pBlock) == false || GetUserMemory(pBlock) != pPtr)
+			return nullptr;
+
+		return pBlock;
+	}
+
+	void HeapAllocator::Collect()
+	{
+		// a pass in progress is finished without budget, blocks freed behind its cursor need one more pass
+		if (iCollectCursor != s_NoCollectCursor)
+			Collect(SIZE_MAX);
+
+		// a full pass is an incremental pass from the lowest block without budget
+		Collect(SIZE_MAX);
+	}
+
+	bool HeapAllocator::Collect(const size_t i_maxSteps)
+	{
+		HEAP_PROBE_SCOPE(ProbePoint::HeapCollect, CollectLatency, nullptr, i_maxSteps);
+
+		if (iCollectCursor == s_NoCollectCursor)
+		{
+			// a pass starts with the kept blocks back in the free blocks
+			FlushLookaside();
+			TrimDescriptorPool();
+
+			// nothing freed without merge since the last pass
+			if (bCollectPending == false)
+			{
+				if (numOutstandingAllocations == 0)
+					ReleaseFreeBlockIndex();
+
+				return true;
 			}
+
+			bCollectPending = false;
+			iCollectCursor = 0;
 		}
 
-		// check the last
-		if (pCurBlock)
+		if (MergeFreeBlocks(i_maxSteps) == false)
+			return false;
+
+		// the whole list is merged, give the lowest block back to the untouched heap
+		iCollectCursor = s_NoCollectCursor;
+		ReturnLowestFreeBlockToHeap();
+
+		// the index storage is the last block, do not leave it in the middle of an empty heap
+		// blocks kept since the pass started are not in the index yet, the next pass flushes them first
+		if (numOutstandingAllocations == 0 && numLookasideBlocks == 0)
+			ReleaseFreeBlockIndex();
+
+		return true;
+	}
+
+	// merge the free blocks from the collect cursor on, at most i_maxSteps of them
+	// true when the end of the list is reached, the cursor is left where it stopped otherwise
+	bool HeapAllocator::MergeFreeBlocks(const size_t i_maxSteps)
+	{
+		// neighbors are merged into the block at iWrite, the gap they leave is closed at the end
+		size_t iWrite = iCollectCursor;
+		size_t iRead = iCollectCursor + 1;
+		size_t steps = 0;
+
+		if (iWrite < FreeBlocks.GetCount())
 		{
-			if (static_cast<char*>(pCurBlock->pBaseAddress) + pCurBlock->BlockSize == pHeapStartAddress)
+			while (iRead < FreeBlocks.GetCount() && steps < i_maxSteps)
 			{
-				pHeapStartAddress = pCurBlock->pBaseAddress;
-				pCurBlock->BlockSize = 0;
-				pCurBlock->pBaseAddress = nullptr;
+				if (FreeBlocks.GetEndAddress(iWrite) == FreeBlocks.GetBaseAddress(iRead))
+					FreeBlocks.SetSize(iWrite, FreeBlocks.GetSize(iWrite) + FreeBlocks.GetSize(iRead));
+				else if (++iWrite != iRead)
+					FreeBlocks.Set(iWrite, FreeBlocks.GetBaseAddress(iRead), FreeBlocks.GetSize(iRead));
 
-				pCurBlock->pNextBlock = pFreeList;
-				pFreeList = pCurBlock;
+				++iRead;
+				++steps;
 			}
 		}
+
+		bool finished = iRead >= FreeBlocks.GetCount();
+		if (iRead > iWrite + 1 && iWrite < FreeBlocks.GetCount())
+			FreeBlocks.Erase(iWrite + 1, iRead - iWrite - 1);
+
+		if (finished == false)
+		{
+			// if merged, not move current block point
+			iCollectCursor = iWrite;
+		}
+
+		return finished;
+	}
+
+	size_t HeapAllocator::GetUsableSize(const void* pPtr) const
+	{
+		const MemoryBlock* pBlock = *reinterpret_cast<const RelativePtr<MemoryBlock>*>(static_cast<const char*>(pPtr) - s_BlockHeadSize);
+		assert(GetUserMemory(pBlock) == pPtr);
+
+		return static_cast<char*>(pBlock->pBaseAddress) + pBlock->BlockSize - static_cast<const char*>(pPtr) - GUARD_BAND_SIZE;
+	}
+
+	void HeapAllocator::SetCategory(const void* pPtr, const uint8_t i_category)
+	{
+		MemoryBlock* pBlock = *reinterpret_cast<const RelativePtr<MemoryBlock>*>(static_cast<const char*>(pPtr) - s_BlockHeadSize);
+		assert(GetUserMemory(pBlock) == pPtr);
+
+		pBlock->Category = i_category;
+	}
+
+	uint8_t HeapAllocator::GetCategory(const void* pPtr) const
+	{
+		const MemoryBlock* pBlock = *reinterpret_cast<const RelativePtr<MemoryBlock>*>(static_cast<const char*>(pPtr) - s_BlockHeadSize);
+		assert(GetUserMemory(pBlock) == pPtr);
+
+		return static_cast<uint8_t>(pBlock->Category);
 	}
 
 	bool HeapAllocator::Contains(const void* pPtr)
@@ -160,16 +386,7 @@ namespace HeapManagerProxy
 
 	bool HeapAllocator::IsAllocated(const void* pPtr)
 	{
-		MemoryBlock* pBlock = pOutstandingAllocations;
-		while (pBlock)
-		{
-			if (pBlock->BlockSize > 0 && (static_cast<char*>(pBlock->pBaseAddress) + GUARD_BAND_SIZE == pPtr))
-				break;
-
-			pBlock = pBlock->pNextBlock;
-		}
-
-		return (pBlock != nullptr);
+		return FindOutstandingBlock(pPtr) != nullptr;
 	}
 
 	void HeapAllocator::ShowFreeBlocks()
@@ -177,19 +394,13 @@ namespace HeapManagerProxy
 		printf("Free Blocks:\n");
 		printf("Start\t Address\tEnd\t Address\tSize\t\n");
 		if (pHeapEndAddress > pHeapStartAddress)
-			printf("0x%p\t0x%p\t%zu\n", pHeapStartAddress,
-				pHeapEndAddress, static_cast<char*>(pHeapEndAddress) - static_cast<char*>(pHeapStartAddress));
+			printf("0x%p\t0x%p\t%zu\n", pHeapStartAddress.Get(),
+				pHeapEndAddress.Get(), static_cast<char*>(pHeapEndAddress) - static_cast<char*>(pHeapStartAddress));
 
-		MemoryBlock* pCurBlock = pFreeList;
-		while (pCurBlock)
+		for (size_t iBlock = 0; iBlock < FreeBlocks.GetCount(); ++iBlock)
 		{
-			if (pCurBlock->BlockSize > 0)
-			{
-				void* endPoint = static_cast<char*>(pCurBlock->pBaseAddress) + pCurBlock->BlockSize;
-				printf("0x%p\t0x%p\t%zu\n", pCurBlock->pBaseAddress, endPoint, pCurBlock->BlockSize);
-			}
-
-			pCurBlock = pCurBlock->pNextBlock;
+			void* endPoint = FreeBlocks.GetEndAddress(iBlock);
+			printf("0x%p\t0x%p\t%zu\n", FreeBlocks.GetBaseAddress(iBlock), endPoint, FreeBlocks.GetSize(iBlock));
 		}
 	}
 
@@ -197,147 +408,476 @@ namespace HeapManagerProxy
 	{
 		printf("Allocated Blocks:\n");
 		printf("Start\t Address\tEnd\t Address\tSize\t\n");
-		MemoryBlock* pCurBlock = pOutstandingAllocations;
-		while (pCurBlock)
+		for (MemoryBlock* pCurBlock = pDescriptorPool; pCurBlock < pHeapStartAddress; ++pCurBlock)
+		{
+			if (IsOutstanding(pCurBlock) == false)
+				continue;
+
+			void* endPoint = static_cast<char*>(pCurBlock->pBaseAddress) + pCurBlock->BlockSize;
+			printf("0x%p\t0x%p\t%zu\n", pCurBlock->pBaseAddress.Get(), endPoint, pCurBlock->BlockSize);
+		}
+	}
+
+	void HeapAllocator::Destroy()
+	{
+
+	}
+
+	bool HeapAllocator::CreateHandleTable(const size_t i_maxHandles)
+	{
+		assert(pHandleTable == nullptr);
+
+		if (i_maxHandles > s_MaxHandles)
+			return false;
+
+		pHandleTable = static_cast<HandleEntry*>(HeapAllocator::alloc(sizeof(HandleEntry) * i_maxHandles));
+		if (pHandleTable == nullptr)
+			return false;
+
+		numHandles = i_maxHandles;
+		iFirstFreeHandle = 0;
+		for (size_t i = 0; i < numHandles; ++i)
+		{
+			pHandleTable[i].pBlock = nullptr;
+			pHandleTable[i].Generation = 1;
+			pHandleTable[i].PinCount = 0;
+			pHandleTable[i].Alignment = 0;
+			pHandleTable[i].NextFreeEntry = static_cast<uint32_t>(i + 1);
+		}
+
+		return true;
+	}
+
+	void HeapAllocator::DestroyHandleTable()
+	{
+		if (pHandleTable == nullptr)
+			return;
+
+		// outstanding handle blocks become normal allocations
+		for (size_t i = 0; i < numHandles; ++i)
+		{
+			if (pHandleTable[i].pBlock)
+				pHandleTable[i].pBlock->HandleId = 0;
+		}
+
+		HandleEntry* pTable = pHandleTable;
+		pHandleTable = nullptr;
+		numHandles = 0;
+		iFirstFreeHandle = 0;
+
+		HeapAllocator::free(pTable);
+	}
+
+	MemoryHandle HeapAllocator::AllocHandle(const size_t sizeAlloc, const unsigned int alignment /*= 4*/)
+	{
+		if (pHandleTable == nullptr || iFirstFreeHandle >= numHandles)
+			return MemoryHandle();
+
+		void* pUserMemory = HeapAllocator::alloc(sizeAlloc, alignment);
+		if (pUserMemory == nullptr)
+			return MemoryHandle();
+
+		MemoryBlock* pBlock = FindOutstandingBlock(pUserMemory);
+
+		uint32_t index = iFirstFreeHandle;
+		HandleEntry& entry = pHandleTable[index];
+		iFirstFreeHandle = entry.NextFreeEntry;
+
+		entry.pBlock = pBlock;
+		entry.PinCount = 0;
+		entry.Alignment = alignment < s_MinBlockAlignment ? s_MinBlockAlignment : alignment; // a move keeps the header aligned too
+
+		pBlock->HandleId = index + 1;
+
+		return MemoryHandle(index, entry.Generation);
+	}
+
+	bool HeapAllocator::FreeHandle(const MemoryHandle i_handle)
+	{
+		HandleEntry* pEntry = GetHandleEntry(i_handle);
+		if (pEntry == nullptr)
+			return false;
+
+		assert(pEntry->PinCount == 0);
+
+		return HeapAllocator::free(GetUserMemory(pEntry->pBlock));
+	}
+
+	void* HeapAllocator::Pin(const MemoryHandle i_handle)
+	{
+		HandleEntry* pEntry = GetHandleEntry(i_handle);
+		if (pEntry == nullptr)
+			return nullptr;
+
+		++pEntry->PinCount;
+
+		return GetUserMemory(pEntry->pBlock);
+	}
+
+	void HeapAllocator::Unpin(const MemoryHandle i_handle)
+	{
+		HandleEntry* pEntry = GetHandleEntry(i_handle);
+		if (pEntry == nullptr)
+			return;
+
+		assert(pEntry->PinCount > 0);
+		--pEntry->PinCount;
+	}
+
+	bool HeapAllocator::Compact(const size_t i_maxMicroseconds)
+	{
+		typedef std::chrono::steady_clock Clock;
+		Clock::time_point deadline = Clock::now() + std::chrono::microseconds(i_maxMicroseconds);
+
+		if (pCompactCeiling == nullptr)
+			pCompactCeiling = pHeapAllocedEndAddress;
+
+		// kept blocks would stop the slide like pinned ones
+		FlushLookaside();
+
+		// moved blocks leave free space behind
+		bReleasePending = true;
+
+		do
 		{
-			if (pCurBlock->BlockSize > 0)
+			if (CompactStep() == false)
 			{
-				void* endPoint = static_cast<char*>(pCurBlock->pBaseAddress) + pCurBlock->BlockSize;
-				printf("0x%p\t0x%p\t%zu\n", pCurBlock->pBaseAddress, endPoint, pCurBlock->BlockSize);
+				// next pass starts from the heap end again
+				pCompactCeiling = nullptr;
+				pCompactBlock = nullptr;
+				return true;
 			}
+		} while (Clock::now() < deadline);
 
-			pCurBlock = pCurBlock->pNextBlock;
+		return false;
+	}
+
+	HandleEntry* HeapAllocator::GetHandleEntry(const MemoryHandle i_handle)
+	{
+		if (pHandleTable == nullptr || i_handle.Index >= numHandles)
+			return nullptr;
+
+		HandleEntry* pEntry = pHandleTable + i_handle.Index;
+		if (pEntry->pBlock == nullptr || pEntry->Generation != i_handle.Generation)
+			return nullptr;
+
+		return pEntry;
+	}
+
+	// move the block right below the highest free block under the ceiling
+	// return false when no free block is left under the ceiling
+	bool HeapAllocator::CompactStep()
+	{
+		size_t iFreeBlock = FreeBlocks.LowerBound(pCompactCeiling);
+		if (iFreeBlock == 0)
+			return false;
+
+		// the highest free block under the ceiling
+		--iFreeBlock;
+		char* pFreeBaseAddress = FreeBlocks.GetBaseAddress(iFreeBlock);
+
+		// the last step left the allocation right below the free block in pCompactBlock,
+		// it may have been freed or reused since, then the blocks under the free block are walked again
+		MemoryBlock* pBlock = pCompactBlock;
+		if (pBlock == nullptr || pBlock >= pHeapStartAddress || pBlock->pBaseAddress == nullptr
+			|| static_cast<char*>(pBlock->pBaseAddress) + pBlock->BlockSize != pFreeBaseAddress)
+			pBlock = LinkBlocksBelow(iFreeBlock);
+
+		pCompactBlock = nullptr;
+
+		if (pBlock)
+		{
+			HandleEntry* pEntry = IsOutstanding(pBlock) && pBlock->HandleId ? pHandleTable + (pBlock->HandleId - 1) : nullptr;
+
+			// keep the user memory alignment, the rest of free block becomes padding
+			size_t distance = pEntry ? Utils::AlignDown(FreeBlocks.GetSize(iFreeBlock), pEntry->Alignment) : 0;
+
+			if (pEntry == nullptr || pEntry->PinCount > 0 || distance == 0)
+			{
+				// the blocks above can not be moved in this pass
+				pCompactCeiling = pBlock->pBaseAddress;
+				return true;
+			}
+
+			char* pOldBaseAddress = static_cast<char*>(pBlock->pBaseAddress);
+			size_t slack = FreeBlocks.GetSize(iFreeBlock) - distance;
+
+			memmove(pOldBaseAddress + distance, pOldBaseAddress, pBlock->BlockSize);
+			memset(pOldBaseAddress + distance + pBlock->BlockSize, _bAlignLandFill, slack); // alignment
+
+			pBlock->pBaseAddress = pOldBaseAddress + distance;
+			pBlock->BlockSize += slack;
+
+			// the header is relative to where it is
+			SetBlockHeader(pBlock);
+
+			// the free block keeps its position in address order
+			FreeBlocks.Set(iFreeBlock, pOldBaseAddress, distance);
+
+			// the block below is next
+			pCompactBlock = pBlock->pNextBlock;
+		}
+
+		// merge with the free block below
+		if (iFreeBlock > 0 && FreeBlocks.GetEndAddress(iFreeBlock - 1) == FreeBlocks.GetBaseAddress(iFreeBlock))
+		{
+			FreeBlocks.SetSize(iFreeBlock - 1, FreeBlocks.GetSize(iFreeBlock - 1) + FreeBlocks.GetSize(iFreeBlock));
+			EraseFreeBlock(iFreeBlock);
+		}
+		else if (pBlock == nullptr && pFreeBaseAddress != pHeapEndAddress)
+		{
+			// nothing known below, leave it for this pass
+			pCompactCeiling = pFreeBaseAddress;
 		}
+
+		ReturnLowestFreeBlockToHeap();
+
+		return true;
 	}
 
-	void HeapAllocator::Destroy()
+	// link the blocks between the free block below i_iFreeBlock, or the untouched heap, and i_iFreeBlock
+	// each to the one below it through pNextBlock, Compact flushed the lookaside lists so no list uses it there
+	// return the highest, nullptr when no block is between them
+	MemoryBlock* HeapAllocator::LinkBlocksBelow(const size_t i_iFreeBlock)
 	{
+		char* pAddress = i_iFreeBlock > 0 ? FreeBlocks.GetEndAddress(i_iFreeBlock - 1) : static_cast<char*>(pHeapEndAddress);
+		char* pEndAddress = FreeBlocks.GetBaseAddress(i_iFreeBlock);
+
+		// the blocks there are back to back, each starts with the header of its descriptor
+		MemoryBlock* pBlockBelow = nullptr;
+		while (pAddress < pEndAddress)
+		{
+			MemoryBlock* pBlock = *reinterpret_cast<RelativePtr<MemoryBlock>*>(pAddress);
+			assert(pBlock->pBaseAddress == pAddress);
 
+			pBlock->pNextBlock = pBlockBelow;
+			pBlockBelow = pBlock;
+			pAddress += pBlock->BlockSize;
+		}
+
+		assert(pAddress == pEndAddress);
+
+		return pBlockBelow;
 	}
 
 	// the largest real size for user memory
-	size_t HeapAllocator::GetLargestFreeBlock(const unsigned int alignment /*=4*/)
+	size_t HeapAllocator::GetLargestFreeBlock(const unsigned int i_alignment /*=4*/)
 	{
+		const unsigned int alignment = i_alignment < s_MinBlockAlignment ? s_MinBlockAlignment : i_alignment;
 
 		size_t iMaxCapacity = 0;
 
 		char* pMaxUserMemoryEnd = static_cast<char*>(pHeapEndAddress) - GUARD_BAND_SIZE;
-		char* pMaxUserMemoryStart = static_cast<char*>(Utils::AlignUpAddress(static_cast<char*>(pHeapStartAddress) + s_MinumumToLeave + GUARD_BAND_SIZE, alignment));
+		char* pMaxUserMemoryStart = static_cast<char*>(Utils::AlignUpAddress(static_cast<char*>(pHeapStartAddress) + s_MinumumToLeave + s_BlockHeadSize, alignment));
 
 		if (pMaxUserMemoryStart < pMaxUserMemoryEnd)
 			iMaxCapacity = pMaxUserMemoryEnd - pMaxUserMemoryStart;
 	
-		MemoryBlock* pCurBlock = pFreeList;
-
-		while (pCurBlock)
+		for (size_t iBlock = 0; iBlock < FreeBlocks.GetCount(); ++iBlock)
 		{
+			void* start = Utils::AlignUpAddress(FreeBlocks.GetBaseAddress(iBlock) + s_BlockHeadSize, alignment);
+			void* end = FreeBlocks.GetEndAddress(iBlock);
 
-			if (pCurBlock->BlockSize > 0)
+			if (static_cast<char*>(start) + GUARD_BAND_SIZE < end)
 			{
-				void* start = Utils::AlignUpAddress(static_cast<char*>(pCurBlock->pBaseAddress) + GUARD_BAND_SIZE, alignment);
-				void* end = static_cast<char*>(pCurBlock->pBaseAddress) + pCurBlock->BlockSize;
-
 				size_t capacity = static_cast<char*>(end) - static_cast<char*>(start) - GUARD_BAND_SIZE;
 				iMaxCapacity = capacity > iMaxCapacity ? capacity : iMaxCapacity;
 			}
-
-			pCurBlock = pCurBlock->pNextBlock;
 		}
 
 		return iMaxCapacity;
 	}
 
-	// required size i_size is with header and tail guard band
-	// the real user memory size is i_size - GUARD_BAND_SIZE - GUARD_BAND_SIZE
-	MemoryBlock* HeapAllocator::FindFirstFittingFreeBlock(const size_t i_size, const unsigned int alignment /*= 4*/)
+	size_t HeapAllocator::ReleaseFreePages()
 	{
-		MemoryBlock* pCurBlock = pFreeList;
-		MemoryBlock* pPrevBlock = nullptr;
+		if (bReleasePending == false)
+			return 0;
 
-		char* pCurBlockEndAddress = nullptr;
-		char* pUserMemory = nullptr; // user memory address
+		bReleasePending = false;
 
-		while (pCurBlock)
-		{
-			if (pCurBlock->BlockSize >= i_size) // quick pre-filter
-			{
-				pCurBlockEndAddress = static_cast<char*>(pCurBlock->pBaseAddress) + pCurBlock->BlockSize;
-				// the alignment is for user memory
-				pUserMemory = static_cast<char*>(Utils::AlignDownAddress(static_cast<char*>(pCurBlockEndAddress) - i_size + GUARD_BAND_SIZE, alignment));
+		SYSTEM_INFO SysInfo;
+		GetSystemInfo(&SysInfo);
 
-				// this block is large enough after alignment and guard
-				if (pUserMemory - GUARD_BAND_SIZE >= pCurBlock->pBaseAddress)
-					break;
-			}
+		// the untouched heap may have been used before a compaction or a free gave it back
+		size_t sizeReleased = ReleasePages(pHeapStartAddress, pHeapEndAddress, SysInfo.dwPageSize);
 
-			pPrevBlock = pCurBlock;
-			pCurBlock = pCurBlock->pNextBlock;
-		}
+		for (size_t iBlock = 0; iBlock < FreeBlocks.GetCount(); ++iBlock)
+			sizeReleased += ReleasePages(FreeBlocks.GetBaseAddress(iBlock), FreeBlocks.GetEndAddress(iBlock), SysInfo.dwPageSize);
 
-		if (pCurBlock)
-		{
-			if (pUserMemory - GUARD_BAND_SIZE == pCurBlock->pBaseAddress) // use the whole block
-			{
-				if (pPrevBlock)
-					pPrevBlock->pNextBlock = pCurBlock->pNextBlock;
-				else
-					pFreeList = pCurBlock->pNextBlock;
+		return sizeReleased;
+	}
 
-				// disconnect from free list
-				pCurBlock->pNextBlock = nullptr;
-			}
-			else // split into used and free blocks
-			{
-				MemoryBlock* pNewBlock = GetFreeMemoryBlockDescriptor();
+	size_t HeapAllocator::ReleasePages(void* i_pStart, void* i_pEnd, const size_t i_sizePage)
+	{
+		char* pFirstPage = reinterpret_cast<char*>(Utils::AlignUp(reinterpret_cast<uintptr_t>(i_pStart), i_sizePage));
+		char* pEndPage = reinterpret_cast<char*>(Utils::AlignDown(reinterpret_cast<uintptr_t>(i_pEnd), i_sizePage));
 
-				if (!pNewBlock) // failed to create new memory block descriptor
-					return nullptr;
+		if (pFirstPage >= pEndPage)
+			return 0;
 
-				pNewBlock->pBaseAddress = pCurBlock->pBaseAddress;
-				pNewBlock->BlockSize = pUserMemory - GUARD_BAND_SIZE - static_cast<char*>(pCurBlock->pBaseAddress);
+		// the pages stay committed, the system drops their content instead of writing it to the page file
+		// large pages can not be reset, they are left as they are
+		if (VirtualAlloc(pFirstPage, pEndPage - pFirstPage, MEM_RESET, PAGE_READWRITE) == nullptr)
+			return 0;
 
-				// disconnect from free list
-				pCurBlock->pBaseAddress = pUserMemory - GUARD_BAND_SIZE;
-				pCurBlock->BlockSize = pCurBlock->BlockSize - pNewBlock->BlockSize;
-				pCurBlock->pNextBlock = nullptr;
+		return pEndPage - pFirstPage;
+	}
 
-				ReturnMemoryBlockDescriptor(pNewBlock);
-			}
+	size_t HeapAllocator::GetTotalFreeSize() const
+	{
+		size_t totalSize = static_cast<char*>(pHeapEndAddress) - static_cast<char*>(pHeapStartAddress) + sizeLookaside;
+
+		for (size_t iBlock = 0; iBlock < FreeBlocks.GetCount(); ++iBlock)
+			totalSize += FreeBlocks.GetSize(iBlock);
+
+		return totalSize;
+	}
+
+	MemoryBlock* HeapAllocator::AllocMemoryBlock(const size_t sizeAlloc, const unsigned int alignment, const bool i_bUntouchedFirst /*= false*/)
+	{
+		MemoryBlock* pBlockDescriptor = i_bUntouchedFirst ? AllocUntouchedMemoryBlock(sizeAlloc, alignment) : nullptr;
+
+		// GUARD_BAND only exist in _DEBUG
+		if (pBlockDescriptor == nullptr)
+			pBlockDescriptor = FindFirstFittingFreeBlock(s_BlockHeadSize + sizeAlloc + GUARD_BAND_SIZE, alignment);
+
+		// no free block fits, take it from the end of untouched heap
+		if (pBlockDescriptor == nullptr && i_bUntouchedFirst == false)
+			pBlockDescriptor = AllocUntouchedMemoryBlock(sizeAlloc, alignment);
+
+		if (pBlockDescriptor)
+			SetBlockHeader(pBlockDescriptor);
+
+		return pBlockDescriptor;
+	}
+
+	MemoryBlock* HeapAllocator::AllocUntouchedMemoryBlock(const size_t sizeAlloc, const unsigned int alignment)
+	{
+		MemoryBlock* pBlockDescriptor = GetFreeMemoryBlockDescriptor();
+		if (pBlockDescriptor == nullptr)
+			return nullptr;
+
+		size_t maxCapacity = 0;
+		void* pAvailableStart = Utils::AlignUpAddress(static_cast<char*>(pHeapStartAddress) + s_MinumumToLeave + s_BlockHeadSize, alignment);
+		void* pAvailableEnd = pHeapEndAddress;
+
+		if (pAvailableEnd > pAvailableStart)
+			maxCapacity = static_cast<char*>(pAvailableEnd) - static_cast<char*>(pAvailableStart);
+
+		if (maxCapacity < sizeAlloc + GUARD_BAND_SIZE) // left memory not enough
+		{
+			ReturnMemoryBlockDescriptor(pBlockDescriptor);
+			return nullptr;
 		}
 
-		return pCurBlock;
+		// the alignment is for user memory start point
+		char* pBlockStartAddress = static_cast<char*>(Utils::AlignDownAddress(static_cast<char*>(pHeapEndAddress) - GUARD_BAND_SIZE - sizeAlloc, alignment));
+
+		pBlockDescriptor->pBaseAddress = pBlockStartAddress - s_BlockHeadSize;
+		pBlockDescriptor->BlockSize = static_cast<char*>(pHeapEndAddress) - (pBlockStartAddress - s_BlockHeadSize);
+
+		pHeapEndAddress = pBlockDescriptor->pBaseAddress;
+
+		assert(pHeapStartAddress <= pHeapEndAddress);
+
+		return pBlockDescriptor;
 	}
 
-	MemoryBlock* HeapAllocator::FindBestFittingFreeBlock(const size_t i_size, const unsigned int alignment /*= 4*/)
+	// move free block index to a storage twice as large, both storages are blocks of this heap
+	bool HeapAllocator::GrowFreeBlockIndex()
 	{
-		return nullptr;
+		size_t capacity = FreeBlocks.GetCapacity() ? FreeBlocks.GetCapacity() * 2 : s_MinFreeBlockIndexCapacity;
+
+		MemoryBlock* pStorageBlock = AllocMemoryBlock(FreeBlockIndex::GetStorageSize(capacity), sizeof(size_t));
+		if (pStorageBlock == nullptr)
+			return false;
+
+		FreeBlocks.Attach(GetUserMemory(pStorageBlock), capacity);
+
+		MemoryBlock* pOldStorageBlock = pFreeBlockIndexStorage;
+		pFreeBlockIndexStorage = pStorageBlock;
+
+		if (pOldStorageBlock)
+			ReturnMemoryBlockDescriptor(pOldStorageBlock);
+
+		return true;
 	}
 
-	MemoryBlock* HeapAllocator::GetFreeMemoryBlockDescriptor()
+	// only called when no allocation is outstanding, the heap is the index storage and free blocks around it
+	void HeapAllocator::ReleaseFreeBlockIndex()
+	{
+		if (pFreeBlockIndexStorage == nullptr)
+			return;
+
+		assert(pHeapEndAddress == pFreeBlockIndexStorage->pBaseAddress);
+		assert(FreeBlocks.GetCount() <= 1);
+
+		FreeBlocks.Erase(0, FreeBlocks.GetCount());
+		FreeBlocks.Attach(nullptr, 0);
+
+		pHeapEndAddress = pHeapAllocedEndAddress;
+
+		RecycleMemoryBlockDescriptor(pFreeBlockIndexStorage);
+		pFreeBlockIndexStorage = nullptr;
+
+		// no descriptor is used any more unless blocks are kept in the lookaside lists
+		TrimDescriptorPool();
+	}
+
+	// required size i_size is with block head and tail guard band
+	// the real user memory size is i_size - s_BlockHeadSize - GUARD_BAND_SIZE
+	MemoryBlock* HeapAllocator::FindFirstFittingFreeBlock(const size_t i_size, const unsigned int alignment /*= 4*/)
 	{
-		MemoryBlock* pCurBlock = pFreeList;
-		MemoryBlock* pPrevBlock = nullptr;
+		char* pUserMemory = nullptr; // user memory address
 
-		while (pCurBlock)
+		// quick pre-filter on sizes, then check the alignment
+		size_t iBlock = FreeBlocks.FindFirstNotLess(i_size);
+		while (iBlock < FreeBlocks.GetCount())
 		{
-			if (pCurBlock->BlockSize == 0) // get a free memory block descriptor
-			{
-				if (pPrevBlock)
-					pPrevBlock->pNextBlock = pCurBlock->pNextBlock;
-				else
-					pFreeList = pCurBlock->pNextBlock;
+			// the alignment is for user memory
+			pUserMemory = static_cast<char*>(Utils::AlignDownAddress(FreeBlocks.GetEndAddress(iBlock) - i_size + s_BlockHeadSize, alignment));
 
+			// this block is large enough after alignment and guard
+			if (pUserMemory - s_BlockHeadSize >= FreeBlocks.GetBaseAddress(iBlock))
 				break;
-			}
 
-			pPrevBlock = pCurBlock;
-			pCurBlock = pCurBlock->pNextBlock;
+			iBlock = FreeBlocks.FindFirstNotLess(i_size, iBlock + 1);
 		}
 
-		if (pCurBlock == nullptr)// no free memory block descriptor left
-			pCurBlock = CreateFreeMemoryBlockDescriptor();
+		if (iBlock == FreeBlocks.GetCount())
+			return nullptr;
+
+		MemoryBlock* pUsedBlock = GetFreeMemoryBlockDescriptor();
+		if (!pUsedBlock) // failed to create new memory block descriptor
+			return nullptr;
+
+		pUsedBlock->pBaseAddress = pUserMemory - s_BlockHeadSize;
+		pUsedBlock->BlockSize = FreeBlocks.GetEndAddress(iBlock) - static_cast<char*>(pUsedBlock->pBaseAddress);
+		pUsedBlock->pNextBlock = nullptr;
+
+		if (pUsedBlock->pBaseAddress == FreeBlocks.GetBaseAddress(iBlock)) // use the whole block
+			EraseFreeBlock(iBlock);
+		else // split into used and free blocks, the low part stays in place
+			FreeBlocks.SetSize(iBlock, FreeBlocks.GetSize(iBlock) - pUsedBlock->BlockSize);
+
+		return pUsedBlock;
+	}
+
+	MemoryBlock* HeapAllocator::FindBestFittingFreeBlock(const size_t i_size, const unsigned int alignment /*= 4*/)
+	{
+		return nullptr;
+	}
 
-		return pCurBlock;
+	MemoryBlock* HeapAllocator::GetFreeMemoryBlockDescriptor()
+	{
+		MemoryBlock* pBlock = pFreeDescriptors;
+		if (pBlock == nullptr) // no free memory block descriptor left
+			return CreateFreeMemoryBlockDescriptor();
+
+		pFreeDescriptors = pBlock->pNextBlock;
+		pBlock->pNextBlock = nullptr;
+
+		return pBlock;
 	}
 
 	MemoryBlock* HeapAllocator::CreateFreeMemoryBlockDescriptor()
@@ -354,84 +894,159 @@ namespace HeapManagerProxy
 
 	void HeapAllocator::ReturnMemoryBlockDescriptor(MemoryBlock* i_pFreeBlock)
 	{
-		if (pFreeList == nullptr)
+		char* pBaseAddress = static_cast<char*>(i_pFreeBlock->pBaseAddress);
+		size_t size = i_pFreeBlock->BlockSize;
+
+		// free blocks need no descriptor
+		RecycleMemoryBlockDescriptor(i_pFreeBlock);
+
+		if (size == 0)
+			return;
+
+		bReleasePending = true;
+
+		// the index is only full with unmerged blocks, grow it and leave the merge to Collect
+		// a Collect here would flush the kept blocks into this very insert
+		const bool bIndexFull = FreeBlocks.GetCount() == FreeBlocks.GetCapacity() && GrowFreeBlockIndex() == false;
+
+		// free blocks are sorted by address, find the first block above the returned one
+		size_t iNextBlock = FreeBlocks.LowerBound(pBaseAddress);
+
+		// leave the merge to Collect
+		if (bCoalesceOnFree == false && bIndexFull == false)
+		{
+			InsertFreeBlock(iNextBlock, pBaseAddress, size);
+			bCollectPending = true;
+			return;
+		}
+
+		bool bMergeBelow = iNextBlock > 0 && FreeBlocks.GetEndAddress(iNextBlock - 1) == pBaseAddress;
+		bool bMergeAbove = iNextBlock < FreeBlocks.GetCount() && pBaseAddress + size == FreeBlocks.GetBaseAddress(iNextBlock);
+
+		if (bMergeBelow && bMergeAbove)
+		{
+			FreeBlocks.SetSize(iNextBlock - 1, FreeBlocks.GetSize(iNextBlock - 1) + size + FreeBlocks.GetSize(iNextBlock));
+			EraseFreeBlock(iNextBlock);
+		}
+		else if (bMergeBelow)
 		{
-			pHeapEndAddress = static_cast<char*>(pHeapEndAddress) + i_pFreeBlock->BlockSize;
-			pHeapStartAddress = static_cast<char*>(pHeapStartAddress) - sizeof(MemoryBlock);
+			FreeBlocks.SetSize(iNextBlock - 1, FreeBlocks.GetSize(iNextBlock - 1) + size);
 		}
-		else if (i_pFreeBlock->BlockSize == 0)
+		else if (bMergeAbove)
 		{
-			i_pFreeBlock->pNextBlock = pFreeList;
-			pFreeList = i_pFreeBlock;
+			FreeBlocks.Set(iNextBlock, pBaseAddress, size + FreeBlocks.GetSize(iNextBlock));
+		}
+		else if (bIndexFull == false)
+		{
+			InsertFreeBlock(iNextBlock, pBaseAddress, size);
+		}
+		else if (pBaseAddress == pHeapEndAddress)
+		{
+			// no room to grow the index, the block goes straight back to the untouched heap
+			pHeapEndAddress = pBaseAddress + size;
 		}
 		else
 		{
-			MemoryBlock* pCurBlock = pFreeList;
-			MemoryBlock* pPrevBlock = nullptr;
-			while(pCurBlock)
-			{
-				if (pCurBlock->BlockSize > 0 && static_cast<char*>(i_pFreeBlock->pBaseAddress) + i_pFreeBlock->BlockSize < pCurBlock->pBaseAddress)
-					break;
+			// out of memory with a full index, only a merge of the whole list makes room
+			// the index always fits the blocks merged, a pass in progress is done with it
+			iCollectCursor = 0;
+			MergeFreeBlocks(SIZE_MAX);
+			iCollectCursor = s_NoCollectCursor;
+
+			assert(FreeBlocks.GetCount() < FreeBlocks.GetCapacity());
+			InsertFreeBlock(FreeBlocks.LowerBound(pBaseAddress), pBaseAddress, size);
+		}
 
-				pPrevBlock = pCurBlock;
-				pCurBlock = pCurBlock->pNextBlock;
-			}
+		ReturnLowestFreeBlockToHeap();
+	}
 
-			if (pCurBlock)
-			{
-				// neighbor block. merge
-				if (static_cast<char*>(i_pFreeBlock->pBaseAddress) + i_pFreeBlock->BlockSize == pCurBlock->pBaseAddress)
-				{
-					pCurBlock->BlockSize += i_pFreeBlock->BlockSize;
-					pCurBlock->pBaseAddress = i_pFreeBlock->pBaseAddress;
-
-					i_pFreeBlock->BlockSize = 0;
-					i_pFreeBlock->pBaseAddress = nullptr;
-
-					i_pFreeBlock->pNextBlock = pFreeList;
-					pFreeList = i_pFreeBlock;
-
-					if (pPrevBlock && static_cast<char*>(pPrevBlock->pBaseAddress) + pPrevBlock->BlockSize == pCurBlock->pBaseAddress)
-					{
-						pPrevBlock->BlockSize += pCurBlock->BlockSize;
-						pPrevBlock->pNextBlock = pCurBlock->pNextBlock;
-
-						pCurBlock->BlockSize = 0;
-						pCurBlock->pBaseAddress = nullptr;
-
-						pCurBlock->pNextBlock = pFreeList;
-						pFreeList = pCurBlock;
-					}
-				}
-				else
-				{
-					if (pPrevBlock)
-						pPrevBlock->pNextBlock = i_pFreeBlock;
-					else
-						pFreeList = i_pFreeBlock;
-
-					i_pFreeBlock->pNextBlock = pCurBlock;
-				}
-			}
+	// put a descriptor no longer in any list back to descriptor pool
+	void HeapAllocator::RecycleMemoryBlockDescriptor(MemoryBlock* i_pBlock)
+	{
+		i_pBlock->BlockSize = 0;
+		i_pBlock->pBaseAddress = nullptr;
+		i_pBlock->HandleId = 0;
+
+		// the last carved descriptor goes back to the untouched heap
+		if (i_pBlock + 1 == pHeapStartAddress)
+		{
+			pHeapStartAddress = i_pBlock;
+			return;
+		}
+
+		i_pBlock->pNextBlock = pFreeDescriptors;
+		pFreeDescriptors = i_pBlock;
+	}
+
+	// free blocks often return their descriptors out of order, so unused ones pile up below the last carved one
+	// give the unused run at the top of the pool back to the untouched heap
+	void HeapAllocator::TrimDescriptorPool()
+	{
+		MemoryBlock* pPoolEnd = static_cast<MemoryBlock*>(pHeapStartAddress);
+		while (pPoolEnd > pDescriptorPool && (pPoolEnd - 1)->pBaseAddress == nullptr)
+			--pPoolEnd;
+
+		if (pPoolEnd == pHeapStartAddress)
+			return;
+
+		// take them out of the unused descriptors, the others keep their order
+		RelativePtr<MemoryBlock>* ppLink = &pFreeDescriptors;
+		while (*ppLink != nullptr)
+		{
+			if (*ppLink >= pPoolEnd)
+				*ppLink = (*ppLink)->pNextBlock;
 			else
-			{
-				if (static_cast<char*>(pPrevBlock->pBaseAddress) + pPrevBlock->BlockSize == i_pFreeBlock->pBaseAddress)
-				{
-					pPrevBlock->BlockSize += i_pFreeBlock->BlockSize;
-					pPrevBlock->pNextBlock = nullptr;
-
-					i_pFreeBlock->BlockSize = 0;
-					i_pFreeBlock->pBaseAddress = nullptr;
-
-					i_pFreeBlock->pNextBlock = pFreeList;
-					pFreeList = i_pFreeBlock;
-				}
-				else
-				{
-					pPrevBlock->pNextBlock = i_pFreeBlock;
-					i_pFreeBlock->pNextBlock = nullptr;
-				}
-			}
+				ppLink = &(*ppLink)->pNextBlock;
+		}
+
+		pHeapStartAddress = pPoolEnd;
+	}
+
+	// the user memory is aligned down from the end of the block it is carved from,
+	// a large alignment leaves up to alignment - 1 bytes after it
+	void HeapAllocator::TrimAlignmentSlack(MemoryBlock* i_pBlock, const size_t i_sizeAlloc)
+	{
+		char* pBlockEnd = static_cast<char*>(i_pBlock->pBaseAddress) + i_pBlock->BlockSize;
+		char* pSlackStart = GetUserMemory(i_pBlock) + i_sizeAlloc + GUARD_BAND_SIZE;
+		const size_t slack = pBlockEnd - pSlackStart;
+
+		// a full index only takes blocks after a Collect, keep the padding then
+		if (slack < s_MinAlignmentSlack || FreeBlocks.GetCount() == FreeBlocks.GetCapacity())
+			return;
+
+		i_pBlock->BlockSize -= slack;
+
+		// the block below is the one just allocated, only the block above can touch the slack
+		size_t iNextBlock = FreeBlocks.LowerBound(pSlackStart);
+		if (iNextBlock < FreeBlocks.GetCount() && FreeBlocks.GetBaseAddress(iNextBlock) == pBlockEnd)
+			bCollectPending = true;
+
+		InsertFreeBlock(iNextBlock, pSlackStart, slack);
+	}
+
+	void HeapAllocator::InsertFreeBlock(const size_t i_index, void* i_pBaseAddress, const size_t i_size)
+	{
+		FreeBlocks.Insert(i_index, i_pBaseAddress, i_size);
+
+		if (iCollectCursor != s_NoCollectCursor && iCollectCursor >= i_index)
+			++iCollectCursor;
+	}
+
+	void HeapAllocator::EraseFreeBlock(const size_t i_index)
+	{
+		FreeBlocks.Erase(i_index);
+
+		if (iCollectCursor != s_NoCollectCursor && iCollectCursor > i_index)
+			--iCollectCursor;
+	}
+
+	// allocations grow down from the heap end, so only the lowest free block can touch the untouched heap
+	void HeapAllocator::ReturnLowestFreeBlockToHeap()
+	{
+		if (FreeBlocks.GetCount() && FreeBlocks.GetBaseAddress(0) == pHeapEndAddress)
+		{
+			pHeapEndAddress = FreeBlocks.GetEndAddress(0);
+			EraseFreeBlock(0);
 		}
 	}
 }
\ No newline at end of file
@@ -1,19 +1,52 @@
 #pragma once
+#include <stdint.h>
+#include <new>
 #include "IAllocator.h"
+#include "FreeBlockIndex.h"
+#include "HeapProbe.h"
+#include "RelativePtr.h"
 
 namespace HeapManagerProxy
 {
+	// descriptor of an outstanding allocation
+	// 32 bytes in x64 and 16 bytes in x86, never cross a cache line in descriptor pool
+	// links are relative so the heap can be mapped at another address, see PersistentHeap
 	typedef struct MemoryBlock {
-		void* pBaseAddress;
-		MemoryBlock* pNextBlock;
+		RelativePtr<void> pBaseAddress; // nullptr for an unused descriptor
+		RelativePtr<MemoryBlock> pNextBlock;
 		size_t BlockSize;
+		uint32_t HandleId : 24; // handle table index + 1, 0 for the allocation without handle
+		uint32_t Category : 8; // memory category of the allocation, 0 for untagged
 		
 		MemoryBlock(void* i_pBaseAddress, MemoryBlock* i_pNextBlock, size_t i_BlockSize) :
 			pBaseAddress(i_pBaseAddress),
 			pNextBlock(i_pNextBlock),
-			BlockSize(i_BlockSize) {}
+			BlockSize(i_BlockSize),
+			HandleId(0),
+			Category(0) {}
 	} MemoryBlock;
 
+	static_assert(64 % sizeof(MemoryBlock) == 0, "MemoryBlock should pack in cache line");
+
+	// refer to a relocatable allocation, the address is only stable while pinned
+	typedef struct MemoryHandle {
+		uint32_t Index;
+		uint32_t Generation; // 0 for invalid handle
+
+		MemoryHandle() : Index(0), Generation(0) {}
+		MemoryHandle(uint32_t i_Index, uint32_t i_Generation) : Index(i_Index), Generation(i_Generation) {}
+
+		bool IsValid() const { return Generation != 0; }
+	} MemoryHandle;
+
+	typedef struct HandleEntry {
+		RelativePtr<MemoryBlock> pBlock; // nullptr when the entry is free
+		uint32_t Generation;
+		uint32_t PinCount;
+		uint32_t Alignment;
+		uint32_t NextFreeEntry;
+	} HandleEntry;
+
 	class HeapAllocator: public IAllocator
 	{
 	public:
@@ -21,14 +54,36 @@ namespace HeapManagerProxy
 		HeapAllocator(void* i_pAllocatorMemory, const size_t sizeHeap);
 		virtual ~HeapAllocator();
 
+		// take over the heap a HeapAllocator left at i_pImage, which may have been mapped at another address
+		// by another process, all state is kept as it was, only the virtual table pointer is set again
+		static HeapAllocator* Reopen(void* i_pImage);
+
 		// allocate a block of memory
 		virtual void* alloc(const size_t sizeAlloc, const unsigned int alignment = 4) override;
 
+		// carve from the end of untouched heap so long-lived blocks stay together below the earlier ones
+		// and never fill a hole between short-lived blocks, first fit when untouched heap is too small
+		void* AllocLongLived(const size_t sizeAlloc, const unsigned int alignment = 4);
+
 		virtual bool free(const void* pPtr) override;
 
+		// bytes the user can write at pPtr, the requested size and the padding after it
+		// read from the block header, no search
+		size_t GetUsableSize(const void* pPtr) const;
+
+		// memory category of the outstanding block at pPtr, kept in its descriptor, 0 for a new block
+		void SetCategory(const void* pPtr, const uint8_t i_category);
+
+		uint8_t GetCategory(const void* pPtr) const;
+
 		// garbage collect, merge empty block
 		virtual void Collect() override;
 
+		// incremental garbage collect, merge at most i_maxSteps neighbor blocks
+		// and resume from the same place on the next call
+		// return true when the pass reached the end of free list
+		bool Collect(const size_t i_maxSteps);
+
 		virtual bool Contains(const void* pPtr) override;
 
 		virtual bool IsAllocated(const void* pPtr) override;
@@ -39,20 +94,167 @@ namespace HeapManagerProxy
 
 		virtual void Destroy() override;
 
-		virtual bool IsEmpty() override { return pOutstandingAllocations == nullptr; }
+		virtual bool IsEmpty() override { return numOutstandingAllocations == 0; }
+
+		size_t GetLargestFreeBlock(const unsigned int i_alignment = 4);
+
+		// untouched heap, all free blocks and the lookaside blocks, GetLargestFreeBlock / GetTotalFreeSize shows the fragmentation
+		size_t GetTotalFreeSize() const;
+
+		// give the whole pages of the free blocks and the untouched heap back to the system, their content is lost
+		// only when blocks were freed since the last call, return the bytes released
+		size_t ReleaseFreePages();
+
+		// merge neighbor blocks when they are freed, then Collect never has work to do
+		void SetCoalesceOnFree(bool i_bCoalesceOnFree) { bCoalesceOnFree = i_bCoalesceOnFree; }
+
+		bool IsCoalesceOnFree() const { return bCoalesceOnFree; }
+
+		// keep recently freed blocks under s_MaxLookasideBlockSize by size class and hand them back to the next alloc
+		// of their class without merge or search, Collect gives them back to the free blocks
+		void SetLookaside(bool i_bLookaside);
+
+		bool IsLookaside() const { return bLookaside; }
+
+		size_t GetNumLookasideBlocks() const { return numLookasideBlocks; }
+
+		// handle table is allocated from this heap, relocatable allocations need it
+		bool CreateHandleTable(const size_t i_maxHandles);
 
-		size_t GetLargestFreeBlock(const unsigned int alignment = 4);
+		void DestroyHandleTable();
+
+		// allocate a block the compactor can move, use Pin to get its address
+		MemoryHandle AllocHandle(const size_t sizeAlloc, const unsigned int alignment = 4);
+
+		bool FreeHandle(const MemoryHandle i_handle);
+
+		// the block is not moved until the same number of Unpin
+		void* Pin(const MemoryHandle i_handle);
+
+		void Unpin(const MemoryHandle i_handle);
+
+		// slide unpinned handle blocks up to the heap end so free space gathers into the untouched heap
+		// stop after i_maxMicroseconds and resume from the same place on the next call
+		// return true when no more block can be moved
+		bool Compact(const size_t i_maxMicroseconds);
+
+#ifdef HEAP_TRACING
+		// time spent in alloc, free and Collect(i_maxSteps), AllocLongLived is not probed
+		const LatencyHistogram& GetAllocLatency() const { return AllocLatency; }
+
+		const LatencyHistogram& GetFreeLatency() const { return FreeLatency; }
+
+		const LatencyHistogram& GetCollectLatency() const { return CollectLatency; }
+#endif
 
 		static size_t s_MinumumToLeave;
 
+		static const size_t s_CacheLineSize = 64;
+
+		static const size_t s_MinFreeBlockIndexCapacity = 64;
+
+		// handle ids share a word with the category in the descriptor, the last id marks a block in a lookaside list
+		static const size_t s_MaxHandles = (1 << 24) - 2;
+
+		// padding after the user memory up to this size stays in the block, larger goes back to free blocks
+		static const size_t s_MinAlignmentSlack = s_CacheLineSize;
+
+		// lookaside classes are s_LookasideGranularity bytes of block size apart
+		static const size_t s_LookasideGranularity = 64;
+
+		static const size_t s_NumLookasideClasses = 64;
+
+		static const size_t s_MaxLookasideBlockSize = s_LookasideGranularity * s_NumLookasideClasses;
+
+		// blocks kept in one class and bytes kept in all classes
+		static const size_t s_MaxLookasideDepth = 16;
+
+		static const size_t s_MaxLookasideSize = 64 * 1024;
+
 	private:
-		MemoryBlock* pFreeList = nullptr;
-		MemoryBlock* pOutstandingAllocations = nullptr;
+		// only gives the object the virtual table pointer of this process, Reopen copies the members back over it
+		explicit HeapAllocator(const ReopenImage&) {}
+
+		// every block starts with a relative pointer to its descriptor, then the head guard and the user memory
+		// the user memory is aligned to the pointer at least and the head is a multiple of it, so the pointer is aligned too
+		static const unsigned int s_MinBlockAlignment = alignof(RelativePtr<MemoryBlock>);
+
+		static const size_t s_BlockHeadSize = (sizeof(RelativePtr<MemoryBlock>) + GUARD_BAND_SIZE + s_MinBlockAlignment - 1) / s_MinBlockAlignment * s_MinBlockAlignment;
+
+		static char* GetUserMemory(const MemoryBlock* i_pBlock) { return static_cast<char*>(i_pBlock->pBaseAddress) + s_BlockHeadSize; }
 
-		void* pHeapStartAddress = nullptr;
-		void* pHeapEndAddress = nullptr;
+		static void SetBlockHeader(MemoryBlock* i_pBlock) { new (i_pBlock->pBaseAddress) RelativePtr<MemoryBlock>(i_pBlock); }
 
-		void* pHeapAllocedEndAddress = nullptr;
+		// the constructor sets every member, Reopen copies them from the image
+
+		// free blocks sorted by address, its storage is a block of this heap
+		FreeBlockIndex FreeBlocks;
+		RelativePtr<MemoryBlock> pFreeBlockIndexStorage;
+
+		// descriptors are carved from here up to the heap start, the outstanding ones have a base address
+		// free finds the descriptor from the block header, no list of outstanding allocations is walked
+		RelativePtr<MemoryBlock> pDescriptorPool;
+
+		// unused descriptors, reused in LIFO order
+		RelativePtr<MemoryBlock> pFreeDescriptors;
+
+		size_t numOutstandingAllocations;
+
+		// the free block where the incremental Collect stopped
+		size_t iCollectCursor;
+
+		static const size_t s_NoCollectCursor = SIZE_MAX;
+
+		bool bCoalesceOnFree;
+
+		// blocks were freed without merge since the last pass started
+		bool bCollectPending;
+
+		// blocks were freed since the last ReleaseFreePages
+		bool bReleasePending;
+
+		bool bLookaside;
+
+		// freed blocks kept by size class, linked through pNextBlock, their descriptors keep the block
+		RelativePtr<MemoryBlock> pLookaside[s_NumLookasideClasses];
+		uint8_t LookasideDepth[s_NumLookasideClasses];
+		size_t numLookasideBlocks;
+		size_t sizeLookaside;
+
+		RelativePtr<void> pHeapStartAddress;
+		RelativePtr<void> pHeapEndAddress;
+
+		RelativePtr<void> pHeapAllocedEndAddress;
+
+		RelativePtr<HandleEntry> pHandleTable;
+		size_t numHandles;
+		uint32_t iFirstFreeHandle;
+
+		// blocks above it can not be moved in current compaction pass
+		RelativePtr<void> pCompactCeiling;
+
+		// the allocation the next compaction step moves, the ones below it are linked through pNextBlock
+		RelativePtr<MemoryBlock> pCompactBlock;
+
+#ifdef HEAP_TRACING
+		LatencyHistogram AllocLatency;
+		LatencyHistogram FreeLatency;
+		LatencyHistogram CollectLatency;
+#endif
+
+		void* AllocBlock(const size_t sizeAlloc, const unsigned int i_alignment, const bool i_bUntouchedFirst);
+
+		MemoryBlock* AllocMemoryBlock(const size_t sizeAlloc, const unsigned int alignment, const bool i_bUntouchedFirst = false);
+
+		MemoryBlock* AllocUntouchedMemoryBlock(const size_t sizeAlloc, const unsigned int alignment);
+
+		static size_t ReleasePages(void* i_pStart, void* i_pEnd, const size_t i_sizePage);
+
+		bool GrowFreeBlockIndex();
+
+		void ReleaseFreeBlockIndex();
+
+		bool MergeFreeBlocks(const size_t i_maxSteps);
 
 		MemoryBlock* FindFirstFittingFreeBlock(const size_t i_size,
 			const unsigned int alignment = 4);
@@ -60,11 +262,48 @@ namespace HeapManagerProxy
 		MemoryBlock* FindBestFittingFreeBlock(const size_t i_size,
 			const unsigned int alignment = 4);
 
+		// descriptor of the allocation whose user memory is pPtr, nullptr if pPtr is not one
+		MemoryBlock* FindOutstandingBlock(const void* pPtr) const;
+
+		inline bool IsOutstanding(const MemoryBlock* i_pBlock) const
+		{
+			return i_pBlock->pBaseAddress != nullptr && i_pBlock != pFreeBlockIndexStorage && i_pBlock->HandleId != s_LookasideHandleId;
+		}
+
+		static const uint32_t s_LookasideHandleId = (1 << 24) - 1;
+
+		// false when the block is not kept, it goes back to the free blocks then
+		bool PushLookaside(MemoryBlock* i_pBlock);
+
+		// a kept block of the class of the request if it fits, nullptr otherwise
+		MemoryBlock* PopLookaside(const size_t sizeAlloc, const unsigned int alignment);
+
+		// every kept block back to the free blocks
+		void FlushLookaside();
+
 		MemoryBlock* GetFreeMemoryBlockDescriptor();
 
 		MemoryBlock* CreateFreeMemoryBlockDescriptor();
 
 		void ReturnMemoryBlockDescriptor(MemoryBlock* i_pFreeBlock);
+
+		void RecycleMemoryBlockDescriptor(MemoryBlock* i_pBlock);
+
+		void TrimDescriptorPool();
+
+		void InsertFreeBlock(const size_t i_index, void* i_pBaseAddress, const size_t i_size);
+
+		void EraseFreeBlock(const size_t i_index);
+
+		void TrimAlignmentSlack(MemoryBlock* i_pBlock, const size_t i_sizeAlloc);
+
+		void ReturnLowestFreeBlockToHeap();
+
+		HandleEntry* GetHandleEntry(const MemoryHandle i_handle);
+
+		bool CompactStep();
+
+		MemoryBlock* LinkBlocksBelow(const size_t i_iFreeBlock);
 	};
 }
 
@@ -0,0 +1,193 @@
+#pragma once
+#include <Windows.h>
+
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "HeapAllocator.h"
+
+// measure the worst pause of garbage collection on a fragmented heap
+// full:        free without merge, then one Collect()
+// incremental: free without merge, then Collect(collectStepsPerCall) until the pass ends
+// eager:       merge at free time, Collect() has nothing left to do
+bool HeapAllocator_Benchmark()
+{
+	using namespace HeapManagerProxy;
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const size_t sizeHeap = 16 * 1024 * 1024;
+	const size_t numBlocks = 16 * 1024;
+	const size_t maxTestAllocationSize = 512;
+	const size_t collectStepsPerCall = 256;
+	const unsigned int seed = 20;
+
+	void* pHeapMemory = VirtualAlloc(NULL, sizeHeap, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	assert(pHeapMemory);
+
+	if (pHeapMemory == nullptr)
+		return false;
+
+	const char* modes[] = { "full", "incremental", "eager" };
+
+	printf("Mode\t\tFree max(us)\tCollect calls\tCollect max(us)\tCollect total(us)\n");
+	for (size_t iMode = 0; iMode < sizeof(modes) / sizeof(modes[0]); ++iMode)
+	{
+		void* pAllocatorMemory = reinterpret_cast<HeapAllocator*>(pHeapMemory) + 1;
+		HeapAllocator* pHeapAllocator = new (pHeapMemory) HeapAllocator(pAllocatorMemory, sizeHeap - sizeof(HeapAllocator));
+		pHeapAllocator->SetCoalesceOnFree(iMode == 2);
+
+		std::mt19937 random(seed);
+		std::vector<void*> AllocatedAddresses;
+		AllocatedAddresses.reserve(numBlocks);
+
+		for (size_t i = 0; i < numBlocks; ++i)
+		{
+			void* pPtr = pHeapAllocator->alloc(1 + (random() & (maxTestAllocationSize - 1)));
+			assert(pPtr);
+			AllocatedAddresses.push_back(pPtr);
+		}
+
+		// keep every fourth block alive so the heap stays fragmented after merging
+		std::vector<void*> FreeAddresses;
+		std::vector<void*> LiveAddresses;
+		for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+		{
+			if (i % 4 == 3)
+				LiveAddresses.push_back(AllocatedAddresses[i]);
+			else
+				FreeAddresses.push_back(AllocatedAddresses[i]);
+		}
+		std::shuffle(FreeAddresses.begin(), FreeAddresses.end(), random);
+
+		long long maxFree = 0;
+		for (size_t i = 0; i < FreeAddresses.size(); ++i)
+		{
+			Clock::time_point start = Clock::now();
+			pHeapAllocator->free(FreeAddresses[i]);
+			long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+			maxFree = std::max(maxFree, elapsed);
+		}
+
+		long long maxCollect = 0;
+		long long totalCollect = 0;
+		size_t numCollects = 0;
+		bool finished = false;
+		while (!finished)
+		{
+			Clock::time_point start = Clock::now();
+			if (iMode == 1)
+			{
+				finished = pHeapAllocator->Collect(collectStepsPerCall);
+			}
+			else
+			{
+				pHeapAllocator->Collect();
+				finished = true;
+			}
+			long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+			maxCollect = std::max(maxCollect, elapsed);
+			totalCollect += elapsed;
+			++numCollects;
+		}
+
+		printf("%-12s\t%.2f\t\t%zu\t\t%.2f\t\t%.2f\n", modes[iMode], maxFree / 1000.0, numCollects, maxCollect / 1000.0, totalCollect / 1000.0);
+
+		for (size_t i = 0; i < LiveAddresses.size(); ++i)
+			pHeapAllocator->free(LiveAddresses[i]);
+
+		pHeapAllocator->Collect();
+		pHeapAllocator->~HeapAllocator();
+	}
+
+	VirtualFree(pHeapMemory, 0, MEM_RELEASE);
+
+	return true;
+}
+
+// compare the fit search over free block index with a walk over linked block descriptors
+// no free block is large enough, so both searches visit every block
+bool FreeBlockIndex_Benchmark()
+{
+	using namespace HeapManagerProxy;
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const size_t blockCounts[] = { 1000, 10000, 100000 };
+	const size_t numSearches = 100;
+	const size_t maxTestBlockSize = 512;
+	const unsigned int seed = 20;
+
+	printf("Free blocks\tIndex(us)\tLinked list(us)\n");
+	for (size_t iCount = 0; iCount < sizeof(blockCounts) / sizeof(blockCounts[0]); ++iCount)
+	{
+		const size_t numBlocks = blockCounts[iCount];
+		std::mt19937 random(seed);
+
+		std::vector<char> IndexStorage(FreeBlockIndex::GetStorageSize(numBlocks));
+		FreeBlockIndex Index;
+		Index.Attach(IndexStorage.data(), numBlocks);
+
+		// descriptors are linked in address order but scattered in memory, like a long running heap
+		std::vector<MemoryBlock> Descriptors(numBlocks, MemoryBlock(nullptr, nullptr, 0));
+		std::vector<size_t> Order(numBlocks);
+		for (size_t i = 0; i < numBlocks; ++i)
+			Order[i] = i;
+		std::shuffle(Order.begin(), Order.end(), random);
+
+		char* pBaseAddress = nullptr;
+		MemoryBlock* pPrevBlock = nullptr;
+		MemoryBlock* pFreeList = nullptr;
+		for (size_t i = 0; i < numBlocks; ++i)
+		{
+			size_t size = 1 + (random() & (maxTestBlockSize - 1));
+
+			Index.Insert(i, pBaseAddress, size);
+
+			MemoryBlock* pBlock = &Descriptors[Order[i]];
+			pBlock->pBaseAddress = pBaseAddress;
+			pBlock->BlockSize = size;
+			pBlock->pNextBlock = nullptr;
+
+			if (pPrevBlock)
+				pPrevBlock->pNextBlock = pBlock;
+			else
+				pFreeList = pBlock;
+
+			pPrevBlock = pBlock;
+			pBaseAddress += size * 2;
+		}
+
+		size_t found = 0;
+
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < numSearches; ++i)
+			found += Index.FindFirstNotLess(maxTestBlockSize + 1 + i);
+		long long elapsedIndex = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+		start = Clock::now();
+		for (size_t i = 0; i < numSearches; ++i)
+		{
+			size_t iBlock = 0;
+			MemoryBlock* pCurBlock = pFreeList;
+			while (pCurBlock && pCurBlock->BlockSize < maxTestBlockSize + 1 + i)
+			{
+				pCurBlock = pCurBlock->pNextBlock;
+				++iBlock;
+			}
+
+			found += iBlock;
+		}
+		long long elapsedList = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+		// both searches found nothing
+		if (found != 2 * numSearches * numBlocks)
+			return false;
+
+		printf("%zu\t\t%.2f\t\t%.2f\n", numBlocks, elapsedIndex / 1000.0 / numSearches, elapsedList / 1000.0 / numSearches);
+	}
+
+	return true;
+}
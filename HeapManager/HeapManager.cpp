@@ -1,53 +1,162 @@
 #include "HeapManager.h"
+#include "AllocationTrace.h"
 #include "BitArray.h"
+#include "HeapProfiler.h"
+#include "Utils.h"
 #include <assert.h>
+#include <limits.h>
 #include <Windows.h>
 
 namespace HeapManagerProxy
 {
 
-	HeapManager::HeapManager() : pDefaultHeap(nullptr)
+	// node set by SetThreadNode, s_NoThreadNode to use the node of current processor
+	static thread_local unsigned int t_threadNode = HeapManager::s_NoThreadNode;
+
+	// category of the blocks calling thread allocates without one
+	static thread_local MemoryCategory t_threadCategory = 0;
+
+	// arena preferred by calling thread, s_NoThreadArena until its first allocation from an arena
+	static const unsigned int s_NoThreadArena = ~0u;
+	static thread_local unsigned int t_threadArena = s_NoThreadArena;
+
+	// next arena handed out with ArenaAssignment::RoundRobin
+	static std::atomic<unsigned int> s_nextArena(0);
+
+	HeapManager::HeapManager()
 	{
+		for (size_t i = 0; i < s_NumCategories; ++i)
+		{
+			CategoryCounters& counters = Categories[i];
+			counters.LiveBytes = 0;
+			counters.PeakBytes = 0;
+			counters.NumLiveAllocations = 0;
+			counters.Budget = SIZE_MAX;
+			counters.NumOverBudget = 0;
+			counters.bHardBudget = false;
+			counters.pName = nullptr;
+		}
 
+#ifdef HEAP_TRACING
+		MallocLatency.Reset();
+		FreeLatency.Reset();
+#endif
 	}
 
 	HeapManager::~HeapManager()
 	{
+		StopScavenger();
+	}
+
+	void HeapManager::CreateHeaps(const unsigned int i_numNodes /*= 0*/)
+	{
+		ULONG highestNode = 0;
+		if (GetNumaHighestNodeNumber(&highestNode) == FALSE)
+			highestNode = 0;
 
+		const unsigned int numPhysicalNodes = highestNode + 1;
+		const unsigned int numNodes = i_numNodes ? i_numNodes : numPhysicalNodes;
+
+		for (unsigned int i = 0; i < numNodes; ++i)
+		{
+			NodeHeaps* pNode = new NodeHeaps(i);
+			CreateNodeHeaps(pNode, i % numPhysicalNodes);
+			Nodes.push_back(pNode);
+		}
 	}
 
-	void HeapManager::CreateHeaps()
+	// large pages need SeLockMemoryPrivilege in the process token
+	static bool EnableLockMemoryPrivilege()
 	{
-		std::vector<FSAInitData> FSASizes;
-		FSASizes.push_back(FSAInitData(64, 1024 * 1024 / 64));
-		FSASizes.push_back(FSAInitData(128, 1024 * 1024 / 128));
-		FSASizes.push_back(FSAInitData(256, 1024 * 1024 / 256));
-		// alloc 4MB memory, 1MB for defaultHeap, 1MB for 64KB fixed-size heap
-		// 1MB for 128KB fixed-size heap, 1MB for 256 KB fixed-size heap
-		const size_t sizeHeap = 4 * 1024 * 1024;
+		HANDLE hToken = NULL;
+		if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken) == FALSE)
+			return false;
+
+		TOKEN_PRIVILEGES privileges;
+		privileges.PrivilegeCount = 1;
+		privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+		bool enabled = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) != FALSE
+			&& AdjustTokenPrivileges(hToken, FALSE, &privileges, 0, NULL, NULL) != FALSE
+			&& GetLastError() != ERROR_NOT_ALL_ASSIGNED; // succeeded without the privilege
+
+		CloseHandle(hToken);
+
+		return enabled;
+	}
+
+	void HeapManager::CreateNodeHeaps(NodeHeaps* i_pNode, const unsigned int i_physicalNode)
+	{
+		const size_t numSlots = s_NumHeapSlots + numArenas - 1 + (bUseTransientArena ? 1 : 0);
+		size_t sizeSlot = s_HeapSlotSize;
+		void* pHeapMemory = nullptr;
 
 #ifdef USE_HEAP_ALLOC
-		void* pHeapMemory = HeapAlloc(GetProcessHeap(), 0, sizeHeap);
+		// the page map needs the slots on page boundaries
+		i_pNode->pHeapAllocation = HeapAlloc(GetProcessHeap(), 0, numSlots * sizeSlot + PageMap::s_PageSize);
+		pHeapMemory = i_pNode->pHeapAllocation ? Utils::AlignUpAddress(i_pNode->pHeapAllocation, static_cast<unsigned int>(PageMap::s_PageSize)) : nullptr;
 #else
-		// Get SYSTEM_INFO, which includes the memory page size
-		SYSTEM_INFO SysInfo;
-		GetSystemInfo(&SysInfo);
-		// round our size to a multiple of memory page size
-		assert(SysInfo.dwPageSize > 0);
-		size_t sizeHeapInPageMultiples = SysInfo.dwPageSize * ((sizeHeap + SysInfo.dwPageSize) / SysInfo.dwPageSize);
-
-		assert(sizeHeapInPageMultiples > sizeof(HeapAllocator));
-		void* pHeapMemory = VirtualAlloc(NULL, sizeHeap, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		size_t sizeLargePage = bUseLargePages ? GetLargePageMinimum() : 0;
+		if (sizeLargePage && EnableLockMemoryPrivilege())
+		{
+			// every heap starts on a large page boundary, the region is large page aligned
+			sizeSlot = Utils::AlignUp(s_HeapSlotSize, sizeLargePage);
+			pHeapMemory = VirtualAllocExNuma(GetCurrentProcess(), NULL, numSlots * sizeSlot, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, i_physicalNode);
+			i_pNode->bLargePages = pHeapMemory != nullptr;
+		}
+
+		if (pHeapMemory == nullptr)
+		{
+			// not enough contiguous physical memory or no privilege, use normal pages
+			sizeSlot = s_HeapSlotSize;
+
+			// Get SYSTEM_INFO, which includes the memory page size
+			SYSTEM_INFO SysInfo;
+			GetSystemInfo(&SysInfo);
+			// round our size to a multiple of memory page size
+			assert(SysInfo.dwPageSize > 0);
+			size_t sizeHeapInPageMultiples = SysInfo.dwPageSize * ((numSlots * sizeSlot + SysInfo.dwPageSize) / SysInfo.dwPageSize);
+
+			assert(sizeHeapInPageMultiples > sizeof(HeapAllocator));
+			// physical pages come from the preferred node when the region is first touched
+			pHeapMemory = VirtualAllocExNuma(GetCurrentProcess(), NULL, numSlots * sizeSlot, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, i_physicalNode);
+		}
 #endif
 
 		assert((pHeapMemory != nullptr));
 
+		i_pNode->PhysicalNode = i_physicalNode;
+		std::vector<FSAInitData> FSASizes;
+		FSASizes.push_back(FSAInitData(64, sizeSlot / 64));
+		FSASizes.push_back(FSAInitData(128, sizeSlot / 128));
+		FSASizes.push_back(FSAInitData(256, sizeSlot / 256));
+		// 5 slots of 1MB (or large page size), one for defaultHeap, one for 64KB fixed-size heap
+		// one for 128KB fixed-size heap, one for 256 KB fixed-size heap, one for the tiny heap
+		assert(FSASizes.size() == NodeHeaps::s_NumFixedSizeHeaps && FSASizes.size() + 2 == s_NumHeapSlots);
+
+		i_pNode->pHeapMemory = pHeapMemory;
+		i_pNode->sizeHeapMemory = numSlots * sizeSlot;
+		i_pNode->sizeSlot = sizeSlot;
+
 		void* pAllocatorMemory = reinterpret_cast<HeapAllocator*>(pHeapMemory) + 1;
-		pDefaultHeap = new (pHeapMemory) HeapAllocator(pAllocatorMemory, 1024 * 1024 - sizeof(HeapAllocator));
+		HeapAllocator* pDefaultHeap = new (pHeapMemory) HeapAllocator(pAllocatorMemory, sizeSlot - sizeof(HeapAllocator));
+		i_pNode->pDefaultHeap = pDefaultHeap;
+		i_pNode->Arenas.push_back(new HeapArena(pDefaultHeap));
+
+		// other arenas take the slots after the fixed-size heaps
+		for (size_t iSlot = s_NumHeapSlots; iSlot < numSlots; ++iSlot)
+		{
+			void* pArenaMemory = static_cast<char*>(pHeapMemory) + iSlot * sizeSlot;
+			HeapAllocator* pArenaHeap = new (pArenaMemory) HeapAllocator(reinterpret_cast<HeapAllocator*>(pArenaMemory) + 1, sizeSlot - sizeof(HeapAllocator));
+			i_pNode->Arenas.push_back(new HeapArena(pArenaHeap));
+		}
+
+		if (bUseTransientArena)
+			i_pNode->pTransientArena = i_pNode->Arenas.back();
 
 		for (size_t i = 0; i < FSASizes.size(); ++i)
 		{
-			void* pAllocatorMemory = static_cast<char*>(pHeapMemory) + (i + 1) * 1024 * 1024;
+			void* pAllocatorMemory = static_cast<char*>(pHeapMemory) + (i + 1) * sizeSlot;
 
 			// alloc BitArray and FixedSizeAllocator pointer from default heap
 			void* pFixedSizeHeap = pDefaultHeap->alloc(sizeof(FixedSizeAllocator));
@@ -55,57 +164,447 @@ namespace HeapManagerProxy
 			
 			FixedSizeAllocator* fixedSizeAllocator = new (pFixedSizeHeap) FixedSizeAllocator(pAllocatorMemory, pAvailableBlocks, FSASizes[i].sizeBlocks, FSASizes[i].numBlocks);
 
-			FSAs.push_back(fixedSizeAllocator);
-			BitArrays.push_back(pAvailableBlocks);
+			if (bTrackCategories)
+			{
+				uint8_t* pCategories = static_cast<uint8_t*>(pDefaultHeap->alloc(FSASizes[i].numBlocks));
+				fixedSizeAllocator->SetCategoryTable(pCategories);
+				i_pNode->CategoryTables.push_back(pCategories);
+			}
+
+			i_pNode->FSAs.push_back(fixedSizeAllocator);
+			i_pNode->BitArrays.push_back(pAvailableBlocks);
+		}
+
+		// the run table is carved after the allocator, the runs start on the next page
+		void* pTinyMemory = static_cast<char*>(pHeapMemory) + s_TinyHeapSlot * sizeSlot;
+		i_pNode->pTinyHeap = new (pTinyMemory) TinyObjectAllocator(reinterpret_cast<TinyObjectAllocator*>(pTinyMemory) + 1, sizeSlot - sizeof(TinyObjectAllocator));
+
+		// every slot to its heap, the arena slots follow the fixed-size heaps
+		for (size_t iSlot = 0; iSlot < numSlots; ++iSlot)
+		{
+			PageOwner owner = PageOwner();
+			owner.Node = i_pNode->Node;
+			if (iSlot >= 1 && iSlot < s_TinyHeapSlot)
+			{
+				owner.Kind = PageKind::FixedSize;
+				owner.pOwner = i_pNode;
+				owner.SizeClass = static_cast<uint8_t>(iSlot - 1);
+			}
+			else if (iSlot == s_TinyHeapSlot)
+			{
+				owner.Kind = PageKind::Tiny;
+				owner.pOwner = i_pNode;
+			}
+			else
+			{
+				owner.Kind = PageKind::Arena;
+				owner.pOwner = i_pNode->Arenas[iSlot == 0 ? 0 : iSlot - s_NumHeapSlots + 1];
+			}
+
+			const bool mapped = Pages.Set(static_cast<char*>(pHeapMemory) + iSlot * sizeSlot, sizeSlot, owner);
+			assert(mapped);
 		}
 
-		printf("Default Heap start from %p to %p\n", pHeapMemory, static_cast<char*>(pHeapMemory) + 1 * 1024 * 1024);
-		printf("Fixed-size Heap in  64KB start from %p to %p\n", static_cast<char*>(pHeapMemory) + 1 * 1024 * 1024, static_cast<char*>(pHeapMemory) + 2 * 1024 * 1024);
-		printf("Fixed-size Heap in 128KB start from %p to %p\n", static_cast<char*>(pHeapMemory) + 2 * 1024 * 1024, static_cast<char*>(pHeapMemory) + 3 * 1024 * 1024);
-		printf("Fixed-size Heap in 256KB start from %p to %p\n", static_cast<char*>(pHeapMemory) + 3 * 1024 * 1024, static_cast<char*>(pHeapMemory) + 4 * 1024 * 1024);
+		printf("Node %u on NUMA node %u, %s pages\n", i_pNode->Node, i_physicalNode, i_pNode->bLargePages ? "large" : "normal");
+		printf("Default Heap start from %p to %p\n", pHeapMemory, static_cast<char*>(pHeapMemory) + 1 * sizeSlot);
+		printf("Fixed-size Heap in  64KB start from %p to %p\n", static_cast<char*>(pHeapMemory) + 1 * sizeSlot, static_cast<char*>(pHeapMemory) + 2 * sizeSlot);
+		printf("Fixed-size Heap in 128KB start from %p to %p\n", static_cast<char*>(pHeapMemory) + 2 * sizeSlot, static_cast<char*>(pHeapMemory) + 3 * sizeSlot);
+		printf("Fixed-size Heap in 256KB start from %p to %p\n", static_cast<char*>(pHeapMemory) + 3 * sizeSlot, static_cast<char*>(pHeapMemory) + 4 * sizeSlot);
+		printf("Tiny Heap start from %p to %p\n", static_cast<char*>(pHeapMemory) + 4 * sizeSlot, static_cast<char*>(pHeapMemory) + 5 * sizeSlot);
+		if (numSlots > s_NumHeapSlots)
+			printf("%zu more arenas start from %p to %p\n", numSlots - s_NumHeapSlots, static_cast<char*>(pHeapMemory) + s_NumHeapSlots * sizeSlot, static_cast<char*>(pHeapMemory) + numSlots * sizeSlot);
 	}
 
-	void* HeapManager::malloc(size_t i_size)
+	unsigned int HeapManager::GetNodeOfAddress(const void* i_ptr) const
 	{
+		const PageOwner owner = Pages.Find(i_ptr);
+		if (owner.Kind == PageKind::Arena || owner.Kind == PageKind::FixedSize || owner.Kind == PageKind::Tiny)
+			return owner.Node;
+
+		return GetNumNodes();
+	}
+
+	// slot 0 is arena 0, slots 1 to 3 are the fixed-size heaps, slot 4 the tiny heap, arena i > 0 is in slot i + 4
+	unsigned int HeapManager::GetArenaOfAddress(const unsigned int i_node, const void* i_ptr) const
+	{
+		const NodeHeaps* pNode = Nodes[i_node];
+		const char* pHeapMemory = static_cast<const char*>(pNode->pHeapMemory);
+		const unsigned int numNodeArenas = static_cast<unsigned int>(pNode->Arenas.size());
+
+		if (i_ptr < pHeapMemory || i_ptr >= pHeapMemory + pNode->sizeHeapMemory)
+			return numNodeArenas;
+
+		const size_t iSlot = (static_cast<const char*>(i_ptr) - pHeapMemory) / pNode->sizeSlot;
+		if (iSlot == 0)
+			return 0;
+
+		if (iSlot < s_NumHeapSlots)
+			return numNodeArenas;
+
+		return static_cast<unsigned int>(iSlot - s_NumHeapSlots + 1);
+	}
+
+	unsigned int HeapManager::GetCurrentNode() const
+	{
+		assert(Nodes.empty() == false);
+
+		if (t_threadNode != s_NoThreadNode)
+			return t_threadNode % GetNumNodes();
+
+		PROCESSOR_NUMBER processor;
+		GetCurrentProcessorNumberEx(&processor);
+
+		USHORT node = 0;
+		if (GetNumaProcessorNodeEx(&processor, &node) == FALSE)
+			return 0;
+
+		return node % GetNumNodes();
+	}
+
+	void HeapManager::SetThreadNode(const unsigned int i_node)
+	{
+		t_threadNode = i_node;
+	}
+
+	unsigned int HeapManager::GetThreadArena() const
+	{
+		if (t_threadArena == s_NoThreadArena)
+		{
+			if (arenaAssignment == ArenaAssignment::ThreadId)
+			{
+				// Fibonacci hashing spreads consecutive ids
+				t_threadArena = (GetCurrentThreadId() * 2654435761u) >> 16;
+			}
+			else
+			{
+				t_threadArena = s_nextArena.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		return t_threadArena;
+	}
+
+	// preferred arena first, any free arena when it is locked by another thread
+	// wait only when every arena that could have the memory is locked
+	void* HeapManager::AllocFromArenas(NodeHeaps* i_pNode, const size_t i_size, const unsigned int i_alignment, const bool i_bLongLived)
+	{
+		const unsigned int numNodeArenas = static_cast<unsigned int>(i_pNode->Arenas.size()) - (i_pNode->pTransientArena ? 1 : 0);
+		const unsigned int iPreferred = GetThreadArena() % numNodeArenas;
+
+		bool contended = false;
+		for (unsigned int i = 0; i < numNodeArenas; ++i)
+		{
+			const unsigned int iArena = (iPreferred + i) % numNodeArenas;
+			HeapArena* pArena = i_pNode->Arenas[iArena];
+
+			if (pArena->Lock.try_lock() == false)
+			{
+				contended = true;
+				continue;
+			}
+
+			void* pUserMemory = i_bLongLived ? pArena->pHeap->AllocLongLived(i_size, i_alignment) : pArena->pHeap->alloc(i_size, i_alignment);
+			pArena->Lock.unlock();
+
+			if (pUserMemory)
+			{
+				// stay on the arena that was free next time
+				if (iArena != iPreferred)
+					t_threadArena = iArena;
+
+				return pUserMemory;
+			}
+		}
+
+		for (unsigned int i = 0; contended && i < numNodeArenas; ++i)
+		{
+			HeapArena* pArena = i_pNode->Arenas[(iPreferred + i) % numNodeArenas];
+
+			std::lock_guard<std::mutex> lock(pArena->Lock);
+			void* pUserMemory = i_bLongLived ? pArena->pHeap->AllocLongLived(i_size, i_alignment) : pArena->pHeap->alloc(i_size, i_alignment);
+			if (pUserMemory)
+				return pUserMemory;
+		}
+
+		return nullptr;
+	}
+
+	void* HeapManager::malloc(size_t i_size, const AllocationLifetime i_lifetime /*= AllocationLifetime::Default*/, const MemoryCategory i_category /*= s_ThreadCategory*/)
+	{
+		HEAP_PROBE_SCOPE(ProbePoint::ManagerMalloc, MallocLatency, nullptr, i_size);
+
+		const bool bNatural = Utils::IsPowerOfTwo(i_size) && i_size <= s_MaxNaturalAlignment;
+		const unsigned int alignment = bNatural ? static_cast<unsigned int>(i_size) : s_DefaultAlignment;
+		void* pUserMemory = bTrackCategories ? AllocTagged(i_size, alignment, i_lifetime, i_category) : AllocAligned(i_size, alignment, i_lifetime);
+		HEAP_PROBE_RESULT(pUserMemory);
+
+		if (pTraceWriter)
+			pTraceWriter->RecordMalloc(pUserMemory, i_size, alignment, i_lifetime);
+
+		if (pProfiler)
+			pProfiler->RecordMalloc(pUserMemory, i_size);
+
+		return pUserMemory;
+	}
+
+	void* HeapManager::aligned_alloc(const size_t i_alignment, const size_t i_size, const AllocationLifetime i_lifetime /*= AllocationLifetime::Default*/,
+		const MemoryCategory i_category /*= s_ThreadCategory*/)
+	{
+		HEAP_PROBE_SCOPE(ProbePoint::ManagerMalloc, MallocLatency, nullptr, i_size);
+
+		if (Utils::IsPowerOfTwo(i_alignment) == false || i_alignment > UINT_MAX)
+			return nullptr;
+
+		const unsigned int alignment = static_cast<unsigned int>(i_alignment);
+		void* pUserMemory = bTrackCategories ? AllocTagged(i_size, alignment, i_lifetime, i_category) : AllocAligned(i_size, alignment, i_lifetime);
+		HEAP_PROBE_RESULT(pUserMemory);
+
+		if (pTraceWriter)
+			pTraceWriter->RecordMalloc(pUserMemory, i_size, static_cast<unsigned int>(i_alignment), i_lifetime);
+
+		if (pProfiler)
+			pProfiler->RecordMalloc(pUserMemory, i_size);
+
+		return pUserMemory;
+	}
+
+	void* HeapManager::AllocAligned(size_t i_size, const unsigned int i_alignment, const AllocationLifetime i_lifetime)
+	{
+		NodeHeaps* pNode = Nodes[GetCurrentNode()];
+
+		if (bRemoteFree)
+		{
+			DrainRemoteFrees(pNode);
+
+			// a block on remote free list holds the link
+			i_size = i_size < sizeof(void*) ? sizeof(void*) : i_size;
+		}
+
+		// big blocks would fragment the arenas, they get their own pages
+		if (i_size >= largeAllocThreshold && i_alignment <= LargeAllocator::GetMappingAlignment())
+		{
+			void* pLargeBlock = LargeBlocks.alloc(i_size, pNode->PhysicalNode);
+			if (pLargeBlock == nullptr)
+				return nullptr;
+
+			PageOwner owner = PageOwner();
+			owner.Kind = PageKind::Large;
+			if (Pages.Set(pLargeBlock, LargeBlocks.GetMappedSize(pLargeBlock), owner) == false)
+			{
+				LargeBlocks.free(pLargeBlock);
+				return nullptr;
+			}
+
+			return pLargeBlock;
+		}
+
+		// the tiny heap keeps no category byte for its blocks
 		void* pUserMemory = nullptr;
-		for (size_t i = 0; i < FSAs.size(); ++i)
+		if (bUseTinyHeap && bTrackCategories == false && TinyObjectAllocator::GetBlockSize(i_size, i_alignment))
+		{
+			std::lock_guard<std::mutex> lock(pNode->TinyLock);
+			pUserMemory = pNode->pTinyHeap->alloc(i_size, i_alignment);
+		}
+
+		// fixed-size blocks start at multiples of their size, so the user memory offset in a block
+		// only depends on the guard band and the alignment
+		for (size_t i = 0; pUserMemory == nullptr && i < pNode->FSAs.size(); ++i)
 		{
-			if (i_size <= FSAs[i]->GetNumBlocks())
+			const size_t sizeBlock = pNode->FSAs[i]->GetBlockSize();
+			if (i_alignment <= sizeBlock && Utils::AlignUp(GUARD_BAND_SIZE, i_alignment) + i_size + GUARD_BAND_SIZE <= sizeBlock)
 			{
-				pUserMemory = FSAs[i]->alloc(i_size);
+				std::lock_guard<std::mutex> lock(pNode->FSALocks[i]);
+				pUserMemory = pNode->FSAs[i]->alloc(i_size, i_alignment);
 				break;
 			}
 		}
 
+		// size classes do not fragment, lifetime only matters in the arenas
+		if (pUserMemory == nullptr && pNode->pTransientArena
+			&& (i_lifetime == AllocationLifetime::Transient || i_lifetime == AllocationLifetime::Frame))
+		{
+			std::lock_guard<std::mutex> lock(pNode->pTransientArena->Lock);
+			pUserMemory = pNode->pTransientArena->pHeap->alloc(i_size, i_alignment);
+		}
+
+		// page and larger alignments are carved from an arena, the padding after the block goes back to the arena
 		if (pUserMemory == nullptr)
 		{
-			pUserMemory = pDefaultHeap->alloc(i_size);
+			pUserMemory = AllocFromArenas(pNode, i_size, i_alignment, i_lifetime == AllocationLifetime::Persistent);
 		}
 
 		return pUserMemory;
 	}
 
+	size_t HeapManager::usable_size(const void* i_ptr) const
+	{
+		const PageOwner owner = Pages.Find(i_ptr);
+		switch (owner.Kind)
+		{
+		case PageKind::Arena:
+			return static_cast<const HeapArena*>(owner.pOwner)->pHeap->GetUsableSize(i_ptr);
+		case PageKind::FixedSize:
+			return static_cast<const NodeHeaps*>(owner.pOwner)->FSAs[owner.SizeClass]->GetUsableSize(i_ptr);
+		case PageKind::Tiny:
+			return static_cast<const NodeHeaps*>(owner.pOwner)->pTinyHeap->GetUsableSize(i_ptr);
+		case PageKind::Large:
+			return LargeBlocks.GetMappedSize(i_ptr);
+		default:
+			return 0;
+		}
+	}
+
+	AllocationResult HeapManager::allocate_at_least(const size_t i_size)
+	{
+		AllocationResult result;
+		result.pMemory = malloc(i_size);
+		result.Size = result.pMemory ? usable_size(result.pMemory) : 0;
+
+		return result;
+	}
+
+	// memory goes back to the node it came from, whichever thread frees it
 	bool HeapManager::free(void* i_ptr)
 	{
-		for (size_t i = 0; i < FSAs.size(); ++i)
+		HEAP_PROBE_SCOPE(ProbePoint::ManagerFree, FreeLatency, i_ptr, 0);
+
+		if (pTraceWriter)
+			pTraceWriter->RecordFree(i_ptr);
+
+		if (pProfiler)
+			pProfiler->RecordFree(i_ptr);
+
+		const PageOwner owner = Pages.Find(i_ptr);
+
+		// read before the block goes back, another thread can allocate it right after
+		MemoryCategory category = 0;
+		const size_t sizeBlock = bTrackCategories ? GetBlockCategory(owner, i_ptr, category) : 0;
+
+		if (owner.Kind == PageKind::Large)
+		{
+			// pages go back to the system or the mapping cache right away, they are no longer ours
+			const size_t sizeMapping = LargeBlocks.GetMappedSize(i_ptr);
+			if (sizeMapping)
+			{
+				Pages.Clear(i_ptr, sizeMapping);
+				LargeBlocks.free(i_ptr);
+
+				UntrackBlock(category, sizeBlock);
+				return true;
+			}
+		}
+
+		if (owner.Kind != PageKind::Arena && owner.Kind != PageKind::FixedSize && owner.Kind != PageKind::Tiny)
+		{
+			printf("HeapManager does not contains %p\n", i_ptr);
+			return false;
+		}
+
+		if (bRemoteFree && owner.Node != GetCurrentNode())
+		{
+			NodeHeaps* pNode = Nodes[owner.Node];
+
+			// the owner checks the block when it drains the list
+			void* pHead = pNode->pRemoteFrees.load(std::memory_order_relaxed);
+			do
+			{
+				*static_cast<void**>(i_ptr) = pHead;
+			} while (pNode->pRemoteFrees.compare_exchange_weak(pHead, i_ptr, std::memory_order_release, std::memory_order_relaxed) == false);
+
+			UntrackBlock(category, sizeBlock);
+			return true;
+		}
+
+		if (FreeToOwner(owner, i_ptr) == false)
+			return false;
+
+		UntrackBlock(category, sizeBlock);
+		return true;
+	}
+
+	bool HeapManager::FreeToOwner(const PageOwner& i_owner, void* i_ptr)
+	{
+		if (i_owner.Kind == PageKind::FixedSize)
+		{
+			NodeHeaps* pNode = static_cast<NodeHeaps*>(i_owner.pOwner);
+
+			std::lock_guard<std::mutex> lock(pNode->FSALocks[i_owner.SizeClass]);
+			return pNode->FSAs[i_owner.SizeClass]->free(i_ptr);
+		}
+
+		if (i_owner.Kind == PageKind::Tiny)
 		{
-			if (FSAs[i]->Contains(i_ptr))
-				return FSAs[i]->free(i_ptr);
+			NodeHeaps* pNode = static_cast<NodeHeaps*>(i_owner.pOwner);
+
+			std::lock_guard<std::mutex> lock(pNode->TinyLock);
+			return pNode->pTinyHeap->free(i_ptr);
 		}
 
-		return pDefaultHeap->free(i_ptr);
+		if (i_owner.Kind != PageKind::Arena)
+			return false;
+
+		HeapArena* pArena = static_cast<HeapArena*>(i_owner.pOwner);
+
+		std::lock_guard<std::mutex> lock(pArena->Lock);
+		return pArena->pHeap->free(i_ptr);
+	}
+
+	// owner takes the whole list at once, pushes after the exchange start a new list
+	void HeapManager::DrainRemoteFrees(NodeHeaps* i_pNode)
+	{
+		if (i_pNode->pRemoteFrees.load(std::memory_order_relaxed) == nullptr)
+			return;
+
+		void* pBlock = i_pNode->pRemoteFrees.exchange(nullptr, std::memory_order_acquire);
+		while (pBlock)
+		{
+			void* pNext = *static_cast<void**>(pBlock);
+
+			if (FreeToOwner(Pages.Find(pBlock), pBlock) == false)
+				printf("failed to free remote block %p\n", pBlock);
+
+			pBlock = pNext;
+		}
 	}
 
 	void HeapManager::Destroy()
 	{
-		while (!FSAs.empty())
+		StopScavenger();
+		StopTrace();
+		StopProfiler();
+
+		while (!Nodes.empty())
 		{
-			FixedSizeAllocator* fixedSizeHeap = FSAs.back();
-			FSAs.pop_back();
+			NodeHeaps* pNode = Nodes.back();
+			Nodes.pop_back();
+
+			// no thread uses the heaps any more
+			DrainRemoteFrees(pNode);
+
+			DestroyNodeHeaps(pNode);
+			delete pNode;
+		}
+
+		if (LargeBlocks.IsEmpty() == false)
+			fprintf(stderr, "HeapManager still has outstanding large blocks!");
+
+		LargeBlocks.ReleaseCache();
+	}
+
+	void HeapManager::DestroyNodeHeaps(NodeHeaps* i_pNode)
+	{
+		HeapAllocator* pDefaultHeap = i_pNode->pDefaultHeap;
+
+		Pages.Clear(i_pNode->pHeapMemory, i_pNode->sizeHeapMemory);
+
+		while (!i_pNode->FSAs.empty())
+		{
+			FixedSizeAllocator* fixedSizeHeap = i_pNode->FSAs.back();
+			i_pNode->FSAs.pop_back();
 			fixedSizeHeap->Destroy();
 
-			BitArray* pBitArray = BitArrays.back();
-			BitArrays.pop_back();
+			BitArray* pBitArray = i_pNode->BitArrays.back();
+			i_pNode->BitArrays.pop_back();
 
 			pBitArray->~BitArray();
 			pDefaultHeap->free(pBitArray);
@@ -113,7 +612,49 @@ namespace HeapManagerProxy
 			fixedSizeHeap->~FixedSizeAllocator();
 			pDefaultHeap->free(fixedSizeHeap);
 		}
-		
+
+		while (!i_pNode->CategoryTables.empty())
+		{
+			pDefaultHeap->free(i_pNode->CategoryTables.back());
+			i_pNode->CategoryTables.pop_back();
+		}
+
+		if (i_pNode->pTinyHeap)
+		{
+			if (i_pNode->pTinyHeap->IsEmpty() == false)
+				fprintf(stderr, "HeapManager still has outstanding tiny blocks!");
+
+			i_pNode->pTinyHeap->~TinyObjectAllocator();
+			i_pNode->pTinyHeap = nullptr;
+		}
+
+		// the other arenas live in the same region as the default heap
+		bool outstanding = false;
+		while (i_pNode->Arenas.size() > 1)
+		{
+			HeapArena* pArena = i_pNode->Arenas.back();
+			i_pNode->Arenas.pop_back();
+
+			if (pArena->pHeap->IsEmpty() == false)
+				outstanding = true;
+			else
+				pArena->pHeap->~HeapAllocator();
+
+			delete pArena;
+		}
+
+		if (i_pNode->Arenas.empty() == false)
+		{
+			delete i_pNode->Arenas.back();
+			i_pNode->Arenas.pop_back();
+		}
+
+		if (outstanding)
+		{
+			fprintf(stderr, "HeapManager still has outstanding blocks!");
+			return;
+		}
+
 		if (pDefaultHeap)
 		{
 			if (pDefaultHeap->IsEmpty() == false)
@@ -124,7 +665,7 @@ namespace HeapManagerProxy
 
 			pDefaultHeap->~HeapAllocator();
 #ifdef USE_HEAP_ALLOC
-			HeapFree(GetProcessHeap(), 0, pDefaultHeap);
+			HeapFree(GetProcessHeap(), 0, i_pNode->pHeapAllocation);
 #else
 			VirtualFree(pDefaultHeap, 0, MEM_RELEASE);
 #endif
@@ -134,32 +675,428 @@ namespace HeapManagerProxy
 
 	void HeapManager::Collect()
 	{
-		assert(pDefaultHeap);
+		assert(Nodes.empty() == false);
+
+		if (pTraceWriter)
+			pTraceWriter->RecordCollect();
+
+		for (size_t i = 0; i < Nodes.size(); ++i)
+		{
+			for (size_t iArena = 0; iArena < Nodes[i]->Arenas.size(); ++iArena)
+			{
+				HeapArena* pArena = Nodes[i]->Arenas[iArena];
 
-		pDefaultHeap->Collect();
+				std::lock_guard<std::mutex> lock(pArena->Lock);
+				pArena->pHeap->Collect();
+			}
+		}
 
 		// no need to collect fixed size allocator
 	}
 
+	bool HeapManager::Collect(const size_t i_maxSteps)
+	{
+		assert(Nodes.empty() == false);
+
+		if (pTraceWriter)
+			pTraceWriter->RecordCollect(i_maxSteps);
+
+		// each arena gets the same budget, done when all passes are done
+		bool finished = true;
+		for (size_t i = 0; i < Nodes.size(); ++i)
+		{
+			for (size_t iArena = 0; iArena < Nodes[i]->Arenas.size(); ++iArena)
+			{
+				HeapArena* pArena = Nodes[i]->Arenas[iArena];
+
+				std::lock_guard<std::mutex> lock(pArena->Lock);
+				finished = pArena->pHeap->Collect(i_maxSteps) && finished;
+			}
+		}
+
+		return finished;
+	}
+
+	void HeapManager::StartScavenger(const unsigned int i_intervalMilliseconds /*= 10*/, const unsigned int i_budgetPercent /*= 5*/)
+	{
+		assert(Nodes.empty() == false);
+
+		if (IsScavengerRunning())
+			return;
+
+		SetCoalesceOnFree(false);
+
+		bStopScavenger = false;
+		Scavenger = std::thread(&HeapManager::ScavengerLoop, this, i_intervalMilliseconds, i_budgetPercent);
+	}
+
+	void HeapManager::StopScavenger()
+	{
+		if (IsScavengerRunning() == false)
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(ScavengerLock);
+			bStopScavenger = true;
+		}
+		ScavengerWakeUp.notify_one();
+
+		Scavenger.join();
+
+		// the blocks freed since the last pass are merged before free merges again
+		Collect();
+		SetCoalesceOnFree(true);
+	}
+
+	void HeapManager::SetCoalesceOnFree(const bool i_bCoalesceOnFree)
+	{
+		for (size_t i = 0; i < Nodes.size(); ++i)
+		{
+			for (size_t iArena = 0; iArena < Nodes[i]->Arenas.size(); ++iArena)
+			{
+				HeapArena* pArena = Nodes[i]->Arenas[iArena];
+
+				std::lock_guard<std::mutex> lock(pArena->Lock);
+				pArena->pHeap->SetCoalesceOnFree(i_bCoalesceOnFree);
+			}
+		}
+	}
+
+	void HeapManager::ScavengerLoop(const unsigned int i_intervalMilliseconds, const unsigned int i_budgetPercent)
+	{
+		typedef std::chrono::steady_clock Clock;
+		const Clock::duration interval = std::chrono::milliseconds(i_intervalMilliseconds);
+		const Clock::duration budget = interval * i_budgetPercent / 100;
+
+		std::unique_lock<std::mutex> lock(ScavengerLock);
+		while (bStopScavenger == false)
+		{
+			lock.unlock();
+
+			const Clock::time_point start = Clock::now();
+			ScavengePass(start + budget);
+			numScavengerPasses.fetch_add(1, std::memory_order_relaxed);
+
+			// sleep the rest of the interval, StopScavenger wakes it up
+			lock.lock();
+			ScavengerWakeUp.wait_until(lock, start + interval, [this]() { return bStopScavenger; });
+		}
+	}
+
+	bool HeapManager::ScavengePass(const std::chrono::steady_clock::time_point i_deadline)
+	{
+		typedef std::chrono::steady_clock Clock;
+
+		// Nodes and their arenas do not change while the scavenger runs
+		size_t numArenas = 0;
+		for (size_t i = 0; i < Nodes.size(); ++i)
+			numArenas += Nodes[i]->Arenas.size();
+
+		for (; iScavengeArena < numArenas; ++iScavengeArena)
+		{
+			size_t iArena = iScavengeArena;
+			size_t iNode = 0;
+			while (iArena >= Nodes[iNode]->Arenas.size())
+				iArena -= Nodes[iNode++]->Arenas.size();
+
+			HeapArena* pArena = Nodes[iNode]->Arenas[iArena];
+
+			// a few merge steps at a time, so a thread waiting for the arena never waits long
+			bool bMerged = false;
+			while (bMerged == false)
+			{
+				std::unique_lock<std::mutex> lock(pArena->Lock, std::try_to_lock);
+				if (lock.owns_lock() == false)
+					break;
+
+				bMerged = pArena->pHeap->Collect(s_ScavengeCollectSteps);
+
+				// merged blocks give whole pages back
+				if (bMerged)
+					sizeScavenged.fetch_add(pArena->pHeap->ReleaseFreePages(), std::memory_order_relaxed);
+
+				lock.unlock();
+
+				if (Clock::now() >= i_deadline)
+					return false;
+			}
+		}
+
+		// a full pass, the mappings cached since the last one were not reused in between
+		iScavengeArena = 0;
+		sizeScavenged.fetch_add(LargeBlocks.TrimCache(), std::memory_order_relaxed);
+
+		return true;
+	}
+
 	void HeapManager::ShowFreeBlocks()
 	{
-		assert(pDefaultHeap);
+		assert(Nodes.empty() == false);
+
+		for (size_t iNode = 0; iNode < Nodes.size(); ++iNode)
+		{
+			NodeHeaps* pNode = Nodes[iNode];
+
+			for (size_t i = 0; i < pNode->Arenas.size(); ++i)
+			{
+				pNode->Arenas[i]->pHeap->ShowFreeBlocks();
+			}
+			for (size_t i = 0; i < pNode->FSAs.size(); ++i)
+			{
+				pNode->FSAs[i]->ShowFreeBlocks();
+			}
+			pNode->pTinyHeap->ShowFreeBlocks();
+		}
+	}
+
+	void* HeapManager::AllocTagged(const size_t i_size, const unsigned int i_alignment, const AllocationLifetime i_lifetime, MemoryCategory i_category)
+	{
+		if (i_category == s_ThreadCategory)
+			i_category = t_threadCategory;
+
+		CategoryCounters& counters = Categories[i_category];
+
+		// the requested size is charged first, threads racing for the last bytes of a hard budget can not both get them
+		size_t liveBytes = counters.LiveBytes.fetch_add(i_size, std::memory_order_relaxed) + i_size;
+		if (liveBytes > counters.Budget.load(std::memory_order_relaxed))
+		{
+			counters.NumOverBudget.fetch_add(1, std::memory_order_relaxed);
+
+			if (counters.bHardBudget.load(std::memory_order_relaxed))
+			{
+				counters.LiveBytes.fetch_sub(i_size, std::memory_order_relaxed);
+				return nullptr;
+			}
+		}
+
+		void* pUserMemory = AllocAligned(i_size, i_alignment, i_lifetime);
+		if (pUserMemory == nullptr)
+		{
+			counters.LiveBytes.fetch_sub(i_size, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		// then the rest of the usable size, free takes back the usable size
+		const size_t sizeBlock = TagBlock(Pages.Find(pUserMemory), pUserMemory, i_category);
+		if (sizeBlock > i_size)
+			liveBytes = counters.LiveBytes.fetch_add(sizeBlock - i_size, std::memory_order_relaxed) + sizeBlock - i_size;
+
+		counters.NumLiveAllocations.fetch_add(1, std::memory_order_relaxed);
+
+		size_t peakBytes = counters.PeakBytes.load(std::memory_order_relaxed);
+		while (liveBytes > peakBytes && counters.PeakBytes.compare_exchange_weak(peakBytes, liveBytes, std::memory_order_relaxed) == false)
+		{
+		}
+
+		return pUserMemory;
+	}
+
+	void HeapManager::UntrackBlock(const MemoryCategory i_category, const size_t i_sizeBlock)
+	{
+		if (i_sizeBlock == 0)
+			return;
+
+		CategoryCounters& counters = Categories[i_category];
+		counters.LiveBytes.fetch_sub(i_sizeBlock, std::memory_order_relaxed);
+		counters.NumLiveAllocations.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	size_t HeapManager::TagBlock(const PageOwner& i_owner, const void* i_ptr, const MemoryCategory i_category)
+	{
+		// no lock, the block is only known to calling thread yet
+		switch (i_owner.Kind)
+		{
+		case PageKind::Arena:
+		{
+			HeapAllocator* pHeap = static_cast<HeapArena*>(i_owner.pOwner)->pHeap;
+			pHeap->SetCategory(i_ptr, i_category);
+			return pHeap->GetUsableSize(i_ptr);
+		}
+		case PageKind::FixedSize:
+		{
+			FixedSizeAllocator* pFSA = static_cast<NodeHeaps*>(i_owner.pOwner)->FSAs[i_owner.SizeClass];
+			pFSA->SetCategory(i_ptr, i_category);
+			return pFSA->GetUsableSize(i_ptr);
+		}
+		case PageKind::Large:
+			LargeBlocks.SetCategory(i_ptr, i_category);
+			return LargeBlocks.GetMappedSize(i_ptr);
+		default:
+			return 0;
+		}
+	}
+
+	size_t HeapManager::GetBlockCategory(const PageOwner& i_owner, const void* i_ptr, MemoryCategory& o_category) const
+	{
+		switch (i_owner.Kind)
+		{
+		case PageKind::Arena:
+		{
+			// the header of an address that is not a block is user data
+			HeapAllocator* pHeap = static_cast<const HeapArena*>(i_owner.pOwner)->pHeap;
+			if (pHeap->IsAllocated(i_ptr) == false)
+				return 0;
+
+			o_category = pHeap->GetCategory(i_ptr);
+			return pHeap->GetUsableSize(i_ptr);
+		}
+		case PageKind::FixedSize:
+		{
+			// a block freed twice was uncharged the first time
+			FixedSizeAllocator* pFSA = static_cast<const NodeHeaps*>(i_owner.pOwner)->FSAs[i_owner.SizeClass];
+			if (pFSA->IsAllocated(i_ptr) == false)
+				return 0;
+
+			o_category = pFSA->GetCategory(i_ptr);
+			return pFSA->GetUsableSize(i_ptr);
+		}
+		case PageKind::Large:
+			o_category = LargeBlocks.GetCategory(i_ptr);
+			return LargeBlocks.GetMappedSize(i_ptr);
+		case PageKind::Tiny: // only allocated while categories are not tracked
+		default:
+			return 0;
+		}
+	}
+
+	bool HeapManager::SetTrackCategories(bool i_bTrackCategories)
+	{
+		if (Nodes.empty() == false)
+			return false;
+
+		bTrackCategories = i_bTrackCategories;
+		return true;
+	}
+
+	void HeapManager::SetThreadCategory(const MemoryCategory i_category)
+	{
+		assert(i_category < s_NumCategories);
 
-		pDefaultHeap->ShowFreeBlocks();
-		for (size_t i = 0; i < FSAs.size(); ++i)
+		t_threadCategory = i_category;
+	}
+
+	MemoryCategory HeapManager::GetThreadCategory()
+	{
+		return t_threadCategory;
+	}
+
+	void HeapManager::SetCategoryBudget(const MemoryCategory i_category, const size_t i_budget, const bool i_bHardBudget)
+	{
+		Categories[i_category].Budget = i_budget;
+		Categories[i_category].bHardBudget = i_bHardBudget;
+	}
+
+	MemoryCategoryStats HeapManager::GetCategoryStats(const MemoryCategory i_category) const
+	{
+		const CategoryCounters& counters = Categories[i_category];
+
+		MemoryCategoryStats stats;
+		stats.LiveBytes = counters.LiveBytes.load(std::memory_order_relaxed);
+		stats.PeakBytes = counters.PeakBytes.load(std::memory_order_relaxed);
+		stats.NumLiveAllocations = counters.NumLiveAllocations.load(std::memory_order_relaxed);
+		stats.Budget = counters.Budget.load(std::memory_order_relaxed);
+		stats.NumOverBudget = counters.NumOverBudget.load(std::memory_order_relaxed);
+		stats.bHardBudget = counters.bHardBudget.load(std::memory_order_relaxed);
+
+		return stats;
+	}
+
+	void HeapManager::ShowCategories() const
+	{
+		printf("Category\tLive\tPeak\tAllocations\tBudget\tOver budget\n");
+		for (size_t i = 0; i < s_NumCategories; ++i)
 		{
-			FSAs[i]->ShowFreeBlocks();
+			const MemoryCategoryStats stats = GetCategoryStats(static_cast<MemoryCategory>(i));
+			if (stats.PeakBytes == 0 && stats.Budget == SIZE_MAX)
+				continue;
+
+			const char* pName = Categories[i].pName;
+			if (pName)
+				printf("%s", pName);
+			else
+				printf("%zu", i);
+
+			if (stats.Budget == SIZE_MAX)
+				printf("\t%zu\t%zu\t%zu\tnone\t%zu\n", stats.LiveBytes, stats.PeakBytes, stats.NumLiveAllocations, stats.NumOverBudget);
+			else
+				printf("\t%zu\t%zu\t%zu\t%zu %s\t%zu\n", stats.LiveBytes, stats.PeakBytes, stats.NumLiveAllocations, stats.Budget,
+					stats.bHardBudget ? "hard" : "soft", stats.NumOverBudget);
 		}
 	}
 
+	MemoryCategory HeapManager::GetCategoryOfBlock(const void* i_ptr) const
+	{
+		if (bTrackCategories == false)
+			return 0;
+
+		MemoryCategory category = 0;
+		GetBlockCategory(Pages.Find(i_ptr), i_ptr, category);
+
+		return category;
+	}
+
 	void HeapManager::ShowOutstandingAllocations()
 	{
-		assert(pDefaultHeap);
+		assert(Nodes.empty() == false);
+
+		for (size_t iNode = 0; iNode < Nodes.size(); ++iNode)
+		{
+			NodeHeaps* pNode = Nodes[iNode];
+
+			for (size_t i = 0; i < pNode->Arenas.size(); ++i)
+			{
+				pNode->Arenas[i]->pHeap->ShowOutstandingAllocations();
+			}
+			for (size_t i = 0; i < pNode->FSAs.size(); ++i)
+			{
+				pNode->FSAs[i]->ShowOutstandingAllocations();
+			}
+			pNode->pTinyHeap->ShowOutstandingAllocations();
+		}
+
+		LargeBlocks.ShowOutstandingAllocations();
+	}
+
+	bool HeapManager::StartTrace(const char* i_pPath)
+	{
+		StopTrace();
 
-		pDefaultHeap->ShowOutstandingAllocations();
-		for (size_t i = 0; i < FSAs.size(); ++i)
+		AllocationTraceWriter* pWriter = new AllocationTraceWriter();
+		if (pWriter->Open(i_pPath) == false)
 		{
-			FSAs[i]->ShowOutstandingAllocations();
+			delete pWriter;
+			return false;
 		}
+
+		pTraceWriter = pWriter;
+		return true;
+	}
+
+	void HeapManager::StopTrace()
+	{
+		if (pTraceWriter == nullptr)
+			return;
+
+		pTraceWriter->Close();
+		delete pTraceWriter;
+		pTraceWriter = nullptr;
+	}
+
+	void HeapManager::StartProfiler(const size_t i_sampleInterval)
+	{
+		StopProfiler();
+
+		pProfiler = new HeapProfiler(i_sampleInterval);
+	}
+
+	void HeapManager::StopProfiler()
+	{
+		delete pProfiler;
+		pProfiler = nullptr;
+	}
+
+	bool HeapManager::DumpProfile(const char* i_pPath)
+	{
+		return pProfiler && pProfiler->Dump(i_pPath);
 	}
 }
\ No newline at end of file
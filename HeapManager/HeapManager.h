@@ -1,10 +1,91 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include "HeapAllocator.h"
 #include "FixedSizeAllocator.h"
+#include "LargeAllocator.h"
+#include "PageMap.h"
+#include "TinyObjectAllocator.h"
 
 namespace HeapManagerProxy
 {
+	class AllocationTraceWriter;
+	class HeapProfiler;
+
+	// general-purpose heap with its own lock, threads spread over the arenas of a node
+	struct HeapArena
+	{
+		HeapAllocator* pHeap;
+		std::mutex Lock;
+
+		HeapArena(HeapAllocator* i_pHeap) : pHeap(i_pHeap) {}
+	};
+
+	// default heap, fixed-size heaps and extra arenas in one region bound to a NUMA node
+	struct NodeHeaps
+	{
+		unsigned int Node;
+		unsigned int PhysicalNode;
+		void* pHeapMemory;
+		size_t sizeHeapMemory;
+		size_t sizeSlot;
+		bool bLargePages;
+#ifdef USE_HEAP_ALLOC
+		void* pHeapAllocation; // pHeapMemory is the first page boundary in it
+#endif
+		HeapAllocator* pDefaultHeap;
+		std::vector<FixedSizeAllocator*> FSAs;
+		std::vector<BitArray*> BitArrays;
+
+		// 64, 128 and 256 byte blocks in the slots after the default heap, any thread of the node takes the lock of one
+		static const size_t s_NumFixedSizeHeaps = 3;
+		std::mutex FSALocks[s_NumFixedSizeHeaps];
+
+		// blocks up to 64 bytes, in the slot after the fixed-size heaps, any thread of the node takes the lock
+		TinyObjectAllocator* pTinyHeap;
+		std::mutex TinyLock;
+
+		// category byte of each fixed-size block, empty when categories are not tracked
+		std::vector<uint8_t*> CategoryTables;
+
+		// Arenas[0] is the default heap in the first slot, the others follow the fixed-size heaps
+		std::vector<HeapArena*> Arenas;
+
+		// last of Arenas when transient allocations have their own arena, threads never pick it
+		HeapArena* pTransientArena;
+
+		// blocks freed by other threads, linked through their first pointer-sized bytes
+		// any thread pushes, only the owner takes the whole list
+		std::atomic<void*> pRemoteFrees;
+
+		NodeHeaps(unsigned int i_node) : Node(i_node), PhysicalNode(0), pHeapMemory(nullptr), sizeHeapMemory(0), sizeSlot(0), bLargePages(false), pDefaultHeap(nullptr), pTinyHeap(nullptr), pTransientArena(nullptr), pRemoteFrees(nullptr) {}
+	};
+
+	// subsystem an allocation is charged to, 0 for untagged
+	typedef uint8_t MemoryCategory;
+
+	// counts of a memory category at the time of GetCategoryStats, blocks are counted with their usable size
+	struct MemoryCategoryStats
+	{
+		size_t LiveBytes;
+		size_t PeakBytes;
+		size_t NumLiveAllocations;
+		size_t Budget; // SIZE_MAX for none
+		size_t NumOverBudget; // allocations refused by a hard budget or past a soft one
+		bool bHardBudget;
+	};
+
+	// block of allocate_at_least, Size is at least the requested size
+	struct AllocationResult
+	{
+		void* pMemory;
+		size_t Size;
+	};
+
 	class HeapManager
 	{
 
@@ -12,26 +93,317 @@ namespace HeapManagerProxy
 		HeapManager();
 		~HeapManager();
 
-		void CreateHeaps();
+		// one set of heaps per NUMA node, i_numNodes = 0 creates one for each node of the machine
+		// more nodes than the machine has are simulated, their memory comes from the real nodes in turn
+		void CreateHeaps(const unsigned int i_numNodes = 0);
+
+		// back the regions created after this call with large pages, each heap starts on a large page
+		// fall back to normal pages when large pages are not supported or not permitted
+		void SetUseLargePages(bool i_bUseLargePages) { bUseLargePages = i_bUseLargePages; }
+
+		// number of general-purpose arenas in the regions created after this call, at least one
+		// allocations above the fixed sizes take the arena of calling thread, or another one when it is locked
+		void SetNumArenas(const unsigned int i_numArenas) { numArenas = i_numArenas ? i_numArenas : 1; }
+
+		unsigned int GetNumArenas(const unsigned int i_node) const { return static_cast<unsigned int>(Nodes[i_node]->Arenas.size()); }
+
+		// how a thread gets its arena the first time it allocates
+		enum class ArenaAssignment
+		{
+			RoundRobin,	// next arena for each new thread
+			ThreadId	// hash of thread id
+		};
+
+		void SetArenaAssignment(const ArenaAssignment i_assignment) { arenaAssignment = i_assignment; }
+
+		// allocations of at least i_threshold bytes get their own pages instead of an arena, SIZE_MAX for none
+		// alignments above the mapping alignment still go to the arenas
+		void SetLargeAllocThreshold(const size_t i_threshold) { largeAllocThreshold = i_threshold; }
+
+		size_t GetLargeAllocThreshold() const { return largeAllocThreshold; }
 
-		void* malloc(size_t i_size);
+		static const size_t s_DefaultLargeAllocThreshold = 128 * 1024;
+
+		// allocations that fit a 64 byte block go to the tiny heap, packed 8 bytes apart instead of one 64 byte block each
+		// they take the fixed-size heaps when it is off, and while categories are tracked
+		void SetUseTinyHeap(bool i_bUseTinyHeap) { bUseTinyHeap = i_bUseTinyHeap; }
+
+		TinyObjectAllocator* GetTinyHeap(const unsigned int i_node) const { return Nodes[i_node]->pTinyHeap; }
+
+		// arena of i_node containing i_ptr, GetNumArenas(i_node) if none
+		unsigned int GetArenaOfAddress(const unsigned int i_node, const void* i_ptr) const;
+
+		// one more arena in the regions created after this call, only for transient and frame allocations
+		void SetUseTransientArena(bool i_bUseTransientArena) { bUseTransientArena = i_bUseTransientArena; }
+
+		// the arena heaps of i_node, the default heap is arena 0
+		HeapAllocator* GetArenaHeap(const unsigned int i_node, const unsigned int i_arena) const { return Nodes[i_node]->Arenas[i_arena]->pHeap; }
+
+		// whether the heaps of i_node are really backed by large pages
+		bool IsUsingLargePages(const unsigned int i_node) const { return Nodes[i_node]->bLargePages; }
+
+		// power-of-two sizes up to s_MaxNaturalAlignment are aligned to their size, others to s_DefaultAlignment
+		// i_lifetime keeps blocks above the fixed sizes apart: persistent ones are carved together from
+		// the end of untouched heap, transient and frame ones go to the transient arena, see SetUseTransientArena
+		// i_category is only kept when categories are tracked, s_ThreadCategory takes the one of calling thread
+		void* malloc(size_t i_size, const AllocationLifetime i_lifetime = AllocationLifetime::Default, const MemoryCategory i_category = s_ThreadCategory);
+
+		// i_alignment is a power of two, blocks of the fixed-size heaps are aligned to their size
+		// so small aligned requests go to the first size class with no padding, larger ones to an arena
+		void* aligned_alloc(const size_t i_alignment, const size_t i_size, const AllocationLifetime i_lifetime = AllocationLifetime::Default,
+			const MemoryCategory i_category = s_ThreadCategory);
 
 		bool free(void* i_ptr);
 
-		HeapAllocator* GetDefaultHeap() const { return pDefaultHeap; }
+		// bytes the caller can use at i_ptr, at least the size it was allocated with
+		// constant time for every heap, 0 when HeapManager does not own i_ptr
+		size_t usable_size(const void* i_ptr) const;
+
+		// like std::allocator::allocate_at_least, the block and all bytes of it the caller can use
+		AllocationResult allocate_at_least(const size_t i_size);
+
+		// default heap of the first node
+		HeapAllocator* GetDefaultHeap() const { return Nodes.empty() ? nullptr : Nodes[0]->pDefaultHeap; }
+
+		HeapAllocator* GetDefaultHeap(const unsigned int i_node) const { return Nodes[i_node]->pDefaultHeap; }
+
+		unsigned int GetNumNodes() const { return static_cast<unsigned int>(Nodes.size()); }
+
+		// node of the heaps containing i_ptr, GetNumNodes() if none
+		unsigned int GetNodeOfAddress(const void* i_ptr) const;
+
+		// node whose heaps serve malloc on calling thread
+		unsigned int GetCurrentNode() const;
+
+		// pin calling thread to heaps of i_node, used to simulate NUMA topology
+		// s_NoThreadNode goes back to the node the thread runs on
+		static void SetThreadNode(const unsigned int i_node);
+
+		static const unsigned int s_NoThreadNode = ~0u;
+
+		static const unsigned int s_DefaultAlignment = 4;
+
+		static const size_t s_MaxNaturalAlignment = 4096;
+
+		// each node is owned by the one thread pinned to it with SetThreadNode, only the owner touches its heaps
+		// free from another thread pushes the block to owner's remote free list without a lock,
+		// the owner frees them in one batch on its next malloc
+		void SetRemoteFree(bool i_bRemoteFree) { bRemoteFree = i_bRemoteFree; }
+
+		bool IsRemoteFree() const { return bRemoteFree; }
+
+		// tag every block with a memory category and count the live bytes of each category, with the budgets set
+		// by SetCategoryBudget, in constant time on malloc and free
+		// the category is in the descriptor of an arena block, a byte per block of the fixed-size heaps and in the large mapping
+		// only before CreateHeaps, blocks allocated untracked were never charged, returns false after
+		bool SetTrackCategories(bool i_bTrackCategories);
+
+		bool IsTrackingCategories() const { return bTrackCategories; }
+
+		// category of the blocks calling thread allocates without one, 0 until set, see MemoryCategoryScope
+		static void SetThreadCategory(const MemoryCategory i_category);
+
+		static MemoryCategory GetThreadCategory();
+
+		// an allocation that takes i_category past i_budget bytes fails with a hard budget and is only counted with a soft one
+		// SIZE_MAX for no budget
+		void SetCategoryBudget(const MemoryCategory i_category, const size_t i_budget, const bool i_bHardBudget);
+
+		// i_pName is not copied, it is shown by ShowCategories
+		void SetCategoryName(const MemoryCategory i_category, const char* i_pName) { Categories[i_category].pName = i_pName; }
+
+		MemoryCategoryStats GetCategoryStats(const MemoryCategory i_category) const;
+
+		// the categories with an allocation or a budget
+		void ShowCategories() const;
+
+		// category of the block at i_ptr, 0 when categories are not tracked
+		MemoryCategory GetCategoryOfBlock(const void* i_ptr) const;
+
+		static const MemoryCategory s_ThreadCategory = 0xFF;
+
+		static const size_t s_NumCategories = s_ThreadCategory;
 
 		void Destroy();
 
 		void Collect();
 
+		// incremental collect of every arena, see HeapAllocator::Collect(i_maxSteps)
+		bool Collect(const size_t i_maxSteps);
+
 		void ShowFreeBlocks();
 
 		void ShowOutstandingAllocations();
 
+		// background thread doing the maintenance malloc and free would otherwise pay for, until StopScavenger
+		// every i_intervalMilliseconds it merges the free blocks of the arenas a few steps at a time, gives their
+		// free pages back to the system and releases the large mappings no allocation reused since its last pass
+		// it works at most i_budgetPercent of the time and skips an arena while another thread has it locked,
+		// free leaves the merge to it while it runs
+		void StartScavenger(const unsigned int i_intervalMilliseconds = 10, const unsigned int i_budgetPercent = 5);
+
+		// wait for the scavenger to stop, the arenas are merged and merge on free again
+		void StopScavenger();
+
+		bool IsScavengerRunning() const { return Scavenger.joinable(); }
+
+		// passes the scavenger finished or ran out of budget in
+		size_t GetNumScavengerPasses() const { return numScavengerPasses.load(std::memory_order_relaxed); }
+
+		// bytes of free pages and large mappings the scavenger gave back to the system
+		size_t GetScavengedBytes() const { return sizeScavenged.load(std::memory_order_relaxed); }
+
+		// record malloc, free and Collect to a binary trace file until StopTrace, see AllocationTrace.h
+		bool StartTrace(const char* i_pPath);
+
+		void StopTrace();
+
+		// sample about one allocation every i_sampleInterval bytes with its call stack, see HeapProfiler.h
+		void StartProfiler(const size_t i_sampleInterval);
+
+		void StopProfiler();
+
+		// write live and total sampled bytes of each call stack in pprof heap format
+		bool DumpProfile(const char* i_pPath);
+
+#ifdef HEAP_TRACING
+		// time spent in malloc and aligned_alloc, and in free, with the heaps they go to
+		// each heap has its own, see HeapAllocator::GetAllocLatency and FixedSizeAllocator::GetAllocLatency
+		const LatencyHistogram& GetMallocLatency() const { return MallocLatency; }
+
+		const LatencyHistogram& GetFreeLatency() const { return FreeLatency; }
+#endif
+
 	private:
-		std::vector<FixedSizeAllocator*> FSAs;
-		std::vector<BitArray*> BitArrays;
-		HeapAllocator* pDefaultHeap;
+		void CreateNodeHeaps(NodeHeaps* i_pNode, const unsigned int i_physicalNode);
+
+		void DestroyNodeHeaps(NodeHeaps* i_pNode);
+
+		bool FreeToOwner(const PageOwner& i_owner, void* i_ptr);
+
+		void* AllocAligned(size_t i_size, const unsigned int i_alignment, const AllocationLifetime i_lifetime);
+
+		void* AllocFromArenas(NodeHeaps* i_pNode, const size_t i_size, const unsigned int i_alignment, const bool i_bLongLived);
+
+		unsigned int GetThreadArena() const;
+
+		void DrainRemoteFrees(NodeHeaps* i_pNode);
+
+		void ScavengerLoop(const unsigned int i_intervalMilliseconds, const unsigned int i_budgetPercent);
+
+		// visit the arenas from the one the last pass stopped at, return false when i_deadline came first
+		bool ScavengePass(const std::chrono::steady_clock::time_point i_deadline);
+
+		void SetCoalesceOnFree(const bool i_bCoalesceOnFree);
+
+		// malloc with the budget of i_category checked first and the block tagged and counted
+		void* AllocTagged(const size_t i_size, const unsigned int i_alignment, const AllocationLifetime i_lifetime, MemoryCategory i_category);
+
+		// tag the block at i_ptr of the heap i_owner, return its usable size
+		size_t TagBlock(const PageOwner& i_owner, const void* i_ptr, const MemoryCategory i_category);
+
+		// usable size and category of the block at i_ptr of the heap i_owner, 0 when it is not an outstanding block
+		size_t GetBlockCategory(const PageOwner& i_owner, const void* i_ptr, MemoryCategory& o_category) const;
+
+		// take back the usable size of a freed block, from GetBlockCategory
+		void UntrackBlock(const MemoryCategory i_category, const size_t i_sizeBlock);
+
+		// live counts of a category, padded so threads charging different categories do not share a cache line
+		struct CategoryCounters
+		{
+			std::atomic<size_t> LiveBytes;
+			std::atomic<size_t> PeakBytes;
+			std::atomic<size_t> NumLiveAllocations;
+			std::atomic<size_t> Budget;
+			std::atomic<size_t> NumOverBudget;
+			std::atomic<bool> bHardBudget;
+			const char* pName;
+			char Padding[64 - 5 * sizeof(size_t) - 2 * sizeof(void*)]; // bHardBudget is padded to a pointer
+		};
+
+		static_assert(sizeof(CategoryCounters) == 64, "CategoryCounters should fill a cache line");
+
+		std::vector<NodeHeaps*> Nodes;
+
+		bool bUseLargePages = false;
+
+		bool bUseTransientArena = false;
+
+		bool bUseTinyHeap = true;
+
+		bool bRemoteFree = false;
+
+		bool bTrackCategories = false;
+
+		CategoryCounters Categories[s_NumCategories];
+
+		unsigned int numArenas = 1;
+
+		ArenaAssignment arenaAssignment = ArenaAssignment::RoundRobin;
+
+		size_t largeAllocThreshold = s_DefaultLargeAllocThreshold;
+
+		// allocations above the threshold, shared by all nodes
+		LargeAllocator LargeBlocks;
+
+		// heap of every page of the node regions and of the large mappings
+		// free and usable_size find the heap of a block in the same few loads however many heaps there are
+		PageMap Pages;
+
+		AllocationTraceWriter* pTraceWriter = nullptr;
+
+		HeapProfiler* pProfiler = nullptr;
+
+#ifdef HEAP_TRACING
+		LatencyHistogram MallocLatency;
+		LatencyHistogram FreeLatency;
+#endif
+
+		std::thread Scavenger;
+
+		// guards bStopScavenger, the scavenger waits on ScavengerWakeUp between passes
+		std::mutex ScavengerLock;
+		std::condition_variable ScavengerWakeUp;
+		bool bStopScavenger = false;
+
+		// arena the next pass starts at, counted over all nodes
+		size_t iScavengeArena = 0;
+
+		std::atomic<size_t> numScavengerPasses{ 0 };
+		std::atomic<size_t> sizeScavenged{ 0 };
+
+		// merge steps between two checks of the budget, the arena is unlocked in between
+		static const size_t s_ScavengeCollectSteps = 64;
+
+		// each node has the default heap, three fixed-size heaps and the tiny heap, one slot for each
+		// every arena after the first adds one more slot
+		static const size_t s_NumHeapSlots = 5;
+
+		static const size_t s_TinyHeapSlot = s_NumHeapSlots - 1;
+
+		// size of a slot with normal pages, rounded up to large page size otherwise
+		static const size_t s_HeapSlotSize = 1024 * 1024;
+	};
+
+	// calling thread allocates in i_category until the scope ends, scopes nest
+	class MemoryCategoryScope
+	{
+	public:
+		explicit MemoryCategoryScope(const MemoryCategory i_category) : m_previousCategory(HeapManager::GetThreadCategory())
+		{
+			HeapManager::SetThreadCategory(i_category);
+		}
+
+		~MemoryCategoryScope()
+		{
+			HeapManager::SetThreadCategory(m_previousCategory);
+		}
+
+	private:
+		MemoryCategoryScope(const MemoryCategoryScope&) = delete;
+		MemoryCategoryScope& operator=(const MemoryCategoryScope&) = delete;
+
+		MemoryCategory m_previousCategory;
 	};
 }
 
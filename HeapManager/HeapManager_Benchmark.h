@@ -0,0 +1,558 @@
+#pragma once
+#include <Windows.h>
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "HeapManager.h"
+#include "HeapProfiler.h"
+
+// touch small blocks spread over the heaps of several nodes in random order, like a hot loop over objects
+// with normal pages most touches need a page walk, with large pages the regions fit in the TLB
+// TLB miss counts are not available from user code, read them with a hardware profiler
+// (e.g. VTune or xperf with PMC sources) while the benchmark runs
+bool LargePages_Benchmark()
+{
+	using namespace HeapManagerProxy;
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const unsigned int numNodes = 8;
+	const size_t numBlocksPerNode = 8 * 1024;
+	const size_t allocationSizes[] = { 48, 100, 200 };
+	const size_t numSizes = sizeof(allocationSizes) / sizeof(allocationSizes[0]);
+	const size_t numPasses = 16;
+	const unsigned int seed = 20;
+
+	const char* modes[] = { "normal", "large" };
+
+	printf("Pages\t\tNodes large\tBlocks\t\tAlloc(ns)\tFree(ns)\tTouch(ns)\n");
+	for (size_t iMode = 0; iMode < sizeof(modes) / sizeof(modes[0]); ++iMode)
+	{
+		HeapManager* pHeapManager = new HeapManager();
+		pHeapManager->SetUseLargePages(iMode == 1);
+		pHeapManager->CreateHeaps(numNodes);
+
+		unsigned int numLargePageNodes = 0;
+		for (unsigned int iNode = 0; iNode < numNodes; ++iNode)
+			numLargePageNodes += pHeapManager->IsUsingLargePages(iNode) ? 1 : 0;
+
+		std::mt19937 random(seed);
+		std::vector<void*> AllocatedAddresses;
+		AllocatedAddresses.reserve(numNodes * numBlocksPerNode);
+
+		Clock::time_point start = Clock::now();
+		for (unsigned int iNode = 0; iNode < numNodes; ++iNode)
+		{
+			HeapManager::SetThreadNode(iNode);
+
+			for (size_t i = 0; i < numBlocksPerNode; ++i)
+			{
+				void* pPtr = pHeapManager->malloc(allocationSizes[i % numSizes]);
+				if (pPtr)
+					AllocatedAddresses.push_back(pPtr);
+			}
+		}
+		long long elapsedAlloc = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+		HeapManager::SetThreadNode(HeapManager::s_NoThreadNode);
+
+		std::shuffle(AllocatedAddresses.begin(), AllocatedAddresses.end(), random);
+
+		start = Clock::now();
+		for (size_t iPass = 0; iPass < numPasses; ++iPass)
+		{
+			for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+				++*static_cast<volatile char*>(AllocatedAddresses[i]);
+		}
+		long long elapsedTouch = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+		start = Clock::now();
+		for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+			pHeapManager->free(AllocatedAddresses[i]);
+		long long elapsedFree = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+		size_t numBlocks = AllocatedAddresses.size();
+		printf("%-12s\t%u/%u\t\t%zu\t\t%.2f\t\t%.2f\t\t%.2f\n", modes[iMode], numLargePageNodes, numNodes, numBlocks,
+			static_cast<double>(elapsedAlloc) / numBlocks, static_cast<double>(elapsedFree) / numBlocks,
+			static_cast<double>(elapsedTouch) / (numBlocks * numPasses));
+
+		pHeapManager->Destroy();
+		delete pHeapManager;
+	}
+
+	return true;
+}
+
+// cost of the sampling heap profiler on a malloc/free loop, the same operations with and without it
+bool HeapProfiler_Benchmark()
+{
+	using namespace HeapManagerProxy;
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const size_t numRounds = 256;
+	const size_t numAllocationsPerRound = 1024;
+	const size_t maxTestAllocationSize = 1024;
+	const unsigned int seed = 20;
+
+	// same heaps, only the second one samples
+	HeapManager* pHeapManagers[2];
+	for (size_t iMode = 0; iMode < 2; ++iMode)
+	{
+		pHeapManagers[iMode] = new HeapManager();
+		pHeapManagers[iMode]->CreateHeaps(1);
+	}
+	pHeapManagers[1]->StartProfiler(HeapProfiler::s_DefaultSampleInterval);
+
+	const char* modes[] = { "off", "on" };
+	long long elapsed[2] = { 0, 0 };
+
+	// alternate the modes so both see the same machine state
+	for (size_t iRound = 0; iRound < numRounds * 2; ++iRound)
+	{
+		HeapManager* pHeapManager = pHeapManagers[iRound & 1];
+
+		std::mt19937 random(seed + static_cast<unsigned int>(iRound / 2));
+		std::vector<void*> AllocatedAddresses;
+		AllocatedAddresses.reserve(numAllocationsPerRound);
+
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < numAllocationsPerRound; ++i)
+		{
+			void* pPtr = pHeapManager->malloc(1 + (random() & (maxTestAllocationSize - 1)));
+			if (pPtr)
+				AllocatedAddresses.push_back(pPtr);
+		}
+
+		for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+			pHeapManager->free(AllocatedAddresses[i]);
+		elapsed[iRound & 1] += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+		pHeapManager->Collect();
+	}
+
+	pHeapManagers[1]->DumpProfile("heap_profile.txt");
+
+	printf("Profiler\tTotal(us)\n");
+	for (size_t iMode = 0; iMode < 2; ++iMode)
+		printf("%s\t\t%.2f\n", modes[iMode], elapsed[iMode] / 1000.0);
+	printf("overhead %.2f%%\n", 100.0 * (elapsed[1] - elapsed[0]) / elapsed[0]);
+
+	for (size_t iMode = 0; iMode < 2; ++iMode)
+	{
+		pHeapManagers[iMode]->Destroy();
+		delete pHeapManagers[iMode];
+	}
+
+	return true;
+}
+
+// producers allocate messages and one consumer frees them
+// locked:      all threads share one node, every malloc and free takes the same lock
+// remote free: every thread owns a node, the consumer frees through the remote free lists
+bool RemoteFree_Benchmark()
+{
+	using namespace HeapManagerProxy;
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const unsigned int numProducers = 3;
+	const size_t numMessagesPerProducer = 256 * 1024;
+	const size_t maxMessageSize = 256;
+	const size_t queueSize = 1024;
+
+	// single producer single consumer ring of messages
+	struct MessageQueue
+	{
+		void* Messages[queueSize];
+		std::atomic<size_t> Head;
+		std::atomic<size_t> Tail;
+
+		MessageQueue() : Head(0), Tail(0) {}
+	};
+
+	const char* modes[] = { "locked", "remote free" };
+
+	printf("Mode\t\tMessages/s\n");
+	for (size_t iMode = 0; iMode < sizeof(modes) / sizeof(modes[0]); ++iMode)
+	{
+		const bool bRemoteFree = iMode == 1;
+
+		HeapManager* pHeapManager = new HeapManager();
+		pHeapManager->CreateHeaps(bRemoteFree ? numProducers + 1 : 1);
+		pHeapManager->SetRemoteFree(bRemoteFree);
+
+		std::mutex heapMutex;
+		std::vector<MessageQueue> queues(numProducers);
+		std::vector<std::thread> threads;
+
+		Clock::time_point start = Clock::now();
+		for (unsigned int iProducer = 0; iProducer < numProducers; ++iProducer)
+		{
+			threads.push_back(std::thread([&, iProducer]()
+			{
+				HeapManager::SetThreadNode(bRemoteFree ? iProducer : 0);
+
+				std::mt19937 random(iProducer);
+				MessageQueue& queue = queues[iProducer];
+
+				for (size_t i = 0; i < numMessagesPerProducer; ++i)
+				{
+					size_t size = 16 + random() % (maxMessageSize - 16);
+
+					void* pMessage = nullptr;
+					while (pMessage == nullptr)
+					{
+						if (bRemoteFree)
+						{
+							pMessage = pHeapManager->malloc(size);
+						}
+						else
+						{
+							std::lock_guard<std::mutex> lock(heapMutex);
+							pMessage = pHeapManager->malloc(size);
+						}
+
+						// heap is full of messages the consumer has not freed yet
+						if (pMessage == nullptr)
+							std::this_thread::yield();
+					}
+
+					size_t tail = queue.Tail.load(std::memory_order_relaxed);
+					while (tail - queue.Head.load(std::memory_order_acquire) == queueSize)
+						std::this_thread::yield();
+
+					queue.Messages[tail % queueSize] = pMessage;
+					queue.Tail.store(tail + 1, std::memory_order_release);
+				}
+			}));
+		}
+
+		threads.push_back(std::thread([&]()
+		{
+			HeapManager::SetThreadNode(bRemoteFree ? numProducers : 0);
+
+			size_t numFreed = 0;
+			while (numFreed < numProducers * numMessagesPerProducer)
+			{
+				for (unsigned int iProducer = 0; iProducer < numProducers; ++iProducer)
+				{
+					MessageQueue& queue = queues[iProducer];
+
+					size_t head = queue.Head.load(std::memory_order_relaxed);
+					size_t tail = queue.Tail.load(std::memory_order_acquire);
+					for (; head != tail; ++head, ++numFreed)
+					{
+						void* pMessage = queue.Messages[head % queueSize];
+						if (bRemoteFree)
+						{
+							pHeapManager->free(pMessage);
+						}
+						else
+						{
+							std::lock_guard<std::mutex> lock(heapMutex);
+							pHeapManager->free(pMessage);
+						}
+					}
+
+					queue.Head.store(head, std::memory_order_release);
+				}
+			}
+		}));
+
+		for (size_t i = 0; i < threads.size(); ++i)
+			threads[i].join();
+
+		long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+		printf("%-12s\t%.0f\n", modes[iMode], numProducers * numMessagesPerProducer * 1e9 / elapsed);
+
+		pHeapManager->Destroy();
+		delete pHeapManager;
+	}
+
+	return true;
+}
+
+// threads of one node allocate and free blocks above the fixed sizes
+// one arena: every thread waits for the same lock, one arena per thread: threads rarely meet
+bool Arenas_Benchmark()
+{
+	using namespace HeapManagerProxy;
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const unsigned int numThreads = 4;
+	const size_t numOperationsPerThread = 256 * 1024;
+	const size_t numLiveBlocks = 64;
+	const size_t minBlockSize = 512;
+	const size_t maxBlockSize = 4096;
+
+	const unsigned int arenaCounts[] = { 1, numThreads };
+
+	printf("Arenas\tOperations/s\n");
+	for (size_t iMode = 0; iMode < sizeof(arenaCounts) / sizeof(arenaCounts[0]); ++iMode)
+	{
+		HeapManager* pHeapManager = new HeapManager();
+		pHeapManager->SetNumArenas(arenaCounts[iMode]);
+		pHeapManager->CreateHeaps(1);
+
+		std::atomic<size_t> numFailed(0);
+		std::vector<std::thread> threads;
+
+		Clock::time_point start = Clock::now();
+		for (unsigned int iThread = 0; iThread < numThreads; ++iThread)
+		{
+			threads.push_back(std::thread([&, iThread]()
+			{
+				std::mt19937 random(iThread);
+				std::vector<void*> LiveBlocks(numLiveBlocks, nullptr);
+
+				for (size_t i = 0; i < numOperationsPerThread; ++i)
+				{
+					void*& pBlock = LiveBlocks[random() % numLiveBlocks];
+					if (pBlock)
+					{
+						pHeapManager->free(pBlock);
+						pBlock = nullptr;
+					}
+					else
+					{
+						pBlock = pHeapManager->malloc(minBlockSize + random() % (maxBlockSize - minBlockSize));
+						if (pBlock == nullptr)
+							numFailed.fetch_add(1, std::memory_order_relaxed);
+					}
+				}
+
+				for (size_t i = 0; i < numLiveBlocks; ++i)
+				{
+					if (LiveBlocks[i])
+						pHeapManager->free(LiveBlocks[i]);
+				}
+			}));
+		}
+
+		for (size_t i = 0; i < threads.size(); ++i)
+			threads[i].join();
+
+		long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+		printf("%u\t%.0f\t(%zu failed)\n", arenaCounts[iMode], numThreads * numOperationsPerThread * 1e9 / elapsed, numFailed.load());
+
+		pHeapManager->Collect();
+		pHeapManager->Destroy();
+		delete pHeapManager;
+	}
+
+	return true;
+}
+
+// a few live buffers of 128KB to 768KB replaced one at a time
+// heap only: buffers share the 1MB default heap with everything else, direct mapped: each has its own pages
+bool LargeAlloc_Benchmark()
+{
+	using namespace HeapManagerProxy;
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const size_t numOperations = 64 * 1024;
+	const size_t numLiveBuffers = 4;
+	const size_t minBufferSize = 128 * 1024;
+	const size_t maxBufferSize = 768 * 1024;
+
+	const char* modes[] = { "heap only", "direct mapped" };
+
+	printf("Mode\t\tOperations/s\tFailed\n");
+	for (size_t iMode = 0; iMode < sizeof(modes) / sizeof(modes[0]); ++iMode)
+	{
+		HeapManager* pHeapManager = new HeapManager();
+		pHeapManager->SetLargeAllocThreshold(iMode == 0 ? SIZE_MAX : HeapManager::s_DefaultLargeAllocThreshold);
+		pHeapManager->CreateHeaps(1);
+
+		std::mt19937 random(0);
+		std::vector<void*> LiveBuffers(numLiveBuffers, nullptr);
+		size_t numFailed = 0;
+
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < numOperations; ++i)
+		{
+			void*& pBuffer = LiveBuffers[random() % numLiveBuffers];
+			if (pBuffer)
+				pHeapManager->free(pBuffer);
+
+			size_t size = minBufferSize + random() % (maxBufferSize - minBufferSize);
+			pBuffer = pHeapManager->malloc(size);
+			if (pBuffer == nullptr)
+				++numFailed;
+			else
+				static_cast<char*>(pBuffer)[size - 1] = 0;
+		}
+
+		long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+		printf("%-12s\t%.0f\t\t%zu\n", modes[iMode], numOperations * 1e9 / elapsed, numFailed);
+
+		for (size_t i = 0; i < numLiveBuffers; ++i)
+		{
+			if (LiveBuffers[i])
+				pHeapManager->free(LiveBuffers[i]);
+		}
+
+		pHeapManager->Collect();
+		pHeapManager->Destroy();
+		delete pHeapManager;
+	}
+
+	return true;
+}
+
+// string builders append a few bytes at a time and grow by half when full
+// malloc: capacity is the requested size, allocate_at_least: capacity includes the slack of the block
+bool AllocateAtLeast_Benchmark()
+{
+	using namespace HeapManagerProxy;
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const size_t numBuilders = 4 * 1024;
+	const size_t maxLength = 2000;
+
+	const char* modes[] = { "malloc", "allocate_at_least" };
+
+	printf("Mode\t\t\tReallocations\tBuilders/s\n");
+	for (size_t iMode = 0; iMode < sizeof(modes) / sizeof(modes[0]); ++iMode)
+	{
+		HeapManager* pHeapManager = new HeapManager();
+		pHeapManager->CreateHeaps(1);
+
+		std::mt19937 random(0);
+		size_t numReallocations = 0;
+
+		Clock::time_point start = Clock::now();
+		for (size_t iBuilder = 0; iBuilder < numBuilders; ++iBuilder)
+		{
+			char* pBuffer = nullptr;
+			size_t length = 0;
+			size_t capacity = 0;
+
+			const size_t finalLength = random() % maxLength;
+			while (length < finalLength)
+			{
+				const size_t sizeAppend = 1 + random() % 16;
+				if (length + sizeAppend > capacity)
+				{
+					size_t newCapacity = (length + sizeAppend) * 3 / 2;
+
+					char* pNewBuffer = nullptr;
+					if (iMode == 0)
+					{
+						pNewBuffer = static_cast<char*>(pHeapManager->malloc(newCapacity));
+					}
+					else
+					{
+						AllocationResult result = pHeapManager->allocate_at_least(newCapacity);
+						pNewBuffer = static_cast<char*>(result.pMemory);
+						newCapacity = result.Size;
+					}
+
+					if (pNewBuffer == nullptr)
+						return false;
+
+					if (pBuffer)
+					{
+						memcpy(pNewBuffer, pBuffer, length);
+						pHeapManager->free(pBuffer);
+						++numReallocations;
+					}
+
+					pBuffer = pNewBuffer;
+					capacity = newCapacity;
+				}
+
+				memset(pBuffer + length, 'a', sizeAppend);
+				length += sizeAppend;
+			}
+
+			if (pBuffer)
+				pHeapManager->free(pBuffer);
+		}
+
+		long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+		printf("%-20s\t%zu\t\t%.0f\n", modes[iMode], numReallocations, numBuilders * 1e9 / elapsed);
+
+		pHeapManager->Collect();
+		pHeapManager->Destroy();
+		delete pHeapManager;
+	}
+
+	return true;
+}
+
+// many small objects of the sizes refcounts, list nodes and handles have, with the tiny heap and with the fixed-size heaps
+// the memory is the runs the tiny heap gave to its classes, or the whole fixed-size blocks
+bool TinyObjects_Benchmark()
+{
+	using namespace HeapManagerProxy;
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const size_t numObjects = 12 * 1024;
+	const size_t objectSizes[] = { 8, 8, 8, 16, 16, 16, 24, 24, 32, 48 };
+	const size_t numSizes = sizeof(objectSizes) / sizeof(objectSizes[0]);
+	const unsigned int seed = 50;
+
+	const char* modes[] = { "fixed-size", "tiny" };
+
+	printf("Heap\t\tObjects\tRequested\tMemory\t\tAlloc(ns)\tFree(ns)\n");
+	for (size_t iMode = 0; iMode < sizeof(modes) / sizeof(modes[0]); ++iMode)
+	{
+		HeapManager* pHeapManager = new HeapManager();
+		pHeapManager->SetUseTinyHeap(iMode == 1);
+		pHeapManager->CreateHeaps(1);
+
+		std::mt19937 random(seed);
+		std::vector<void*> AllocatedAddresses;
+		AllocatedAddresses.reserve(numObjects);
+
+		size_t sizeRequested = 0;
+		size_t sizeMemory = 0;
+
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < numObjects; ++i)
+		{
+			const size_t size = objectSizes[random() % numSizes];
+			void* pPtr = pHeapManager->malloc(size);
+			if (pPtr == nullptr)
+				return false;
+
+			AllocatedAddresses.push_back(pPtr);
+			sizeRequested += size;
+		}
+		long long allocElapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+		if (iMode == 1)
+		{
+			sizeMemory = pHeapManager->GetTinyHeap(0)->GetNumUsedRuns() * TinyObjectAllocator::s_RunSize;
+		}
+		else
+		{
+			// the fixed-size block is the usable size and the guard bands
+			for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+				sizeMemory += pHeapManager->usable_size(AllocatedAddresses[i]) + 2 * GUARD_BAND_SIZE;
+		}
+
+		std::shuffle(AllocatedAddresses.begin(), AllocatedAddresses.end(), random);
+
+		start = Clock::now();
+		for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+			pHeapManager->free(AllocatedAddresses[i]);
+		long long freeElapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+		printf("%-12s\t%zu\t%zu\t\t%zu\t\t%.1f\t\t%.1f\n", modes[iMode], numObjects, sizeRequested, sizeMemory,
+			static_cast<double>(allocElapsed) / numObjects, static_cast<double>(freeElapsed) / numObjects);
+
+		pHeapManager->Collect();
+		pHeapManager->Destroy();
+		delete pHeapManager;
+	}
+
+	return true;
+}
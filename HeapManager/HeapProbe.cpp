@@ -0,0 +1,68 @@
+#include "HeapProbe.h"
+
+#include <chrono>
+#include <thread>
+
+namespace HeapManagerProxy
+{
+	std::atomic<ProbeCallback> HeapProbe::s_Callback(nullptr);
+
+	void LatencyHistogram::Reset()
+	{
+		for (unsigned int i = 0; i < s_NumBuckets; ++i)
+			m_Buckets[i].store(0, std::memory_order_relaxed);
+	}
+
+	uint64_t LatencyHistogram::GetTotalCount() const
+	{
+		uint64_t total = 0;
+		for (unsigned int i = 0; i < s_NumBuckets; ++i)
+			total += GetCount(i);
+
+		return total;
+	}
+
+	uint64_t LatencyHistogram::GetPercentile(const double i_percent) const
+	{
+		// one read of each bucket, the counts may move while they are summed
+		uint64_t counts[s_NumBuckets];
+		uint64_t total = 0;
+		for (unsigned int i = 0; i < s_NumBuckets; ++i)
+		{
+			counts[i] = GetCount(i);
+			total += counts[i];
+		}
+
+		if (total == 0)
+			return 0;
+
+		const double rank = total * i_percent / 100.0;
+		uint64_t cumulated = 0;
+		for (unsigned int i = 0; i < s_NumBuckets; ++i)
+		{
+			cumulated += counts[i];
+			if (cumulated >= rank && cumulated > 0)
+				return GetBucketUpperBound(i);
+		}
+
+		return GetBucketUpperBound(s_NumBuckets - 1);
+	}
+
+	uint64_t HeapProbe::GetTicksPerSecond()
+	{
+		static const uint64_t ticksPerSecond = []()
+		{
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			const uint64_t startTicks = GetTicks();
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+			const uint64_t ticks = GetTicks() - startTicks;
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			return static_cast<uint64_t>(ticks / seconds);
+		}();
+
+		return ticksPerSecond;
+	}
+}
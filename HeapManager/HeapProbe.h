@@ -0,0 +1,128 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <intrin.h>
+
+#include <atomic>
+
+// build with HEAP_TRACING to time alloc, free and Collect of every allocator and call the probe callback,
+// without it the probes compile to nothing and the allocators have no histograms
+#ifdef HEAP_TRACING
+#define HEAP_PROBE_SCOPE(i_point, i_histogram, i_ptr, i_size) HeapManagerProxy::HeapProbe heapProbe(i_point, this, i_histogram, i_ptr, i_size)
+#define HEAP_PROBE_RESULT(i_ptr) heapProbe.SetBlock(i_ptr)
+#else
+#define HEAP_PROBE_SCOPE(i_point, i_histogram, i_ptr, i_size)
+#define HEAP_PROBE_RESULT(i_ptr)
+#endif
+
+namespace HeapManagerProxy
+{
+	enum class ProbePoint : uint8_t
+	{
+		HeapAlloc = 0,
+		HeapFree,
+		HeapCollect,		// size is the step budget, SIZE_MAX for a full Collect
+		FixedSizeAlloc,		// fixed-size and tiny heaps
+		FixedSizeFree,
+		ManagerMalloc,		// malloc and aligned_alloc
+		ManagerFree
+	};
+
+	// called on the allocating thread when a probe point returns, i_ptr is the block allocated or freed,
+	// nullptr for a failed alloc, i_ticks the time spent in timestamp counter ticks
+	typedef void (*ProbeCallback)(ProbePoint i_point, const void* i_pAllocator, const void* i_ptr, size_t i_size, uint64_t i_ticks);
+
+	// latencies counted in power-of-two buckets of ticks, any thread records and reads without a lock
+	// trivially constructible so a heap reopened from its image keeps its counts, Reset before first use
+	class LatencyHistogram
+	{
+	public:
+		void Record(const uint64_t i_ticks)
+		{
+			m_Buckets[GetBucket(i_ticks)].fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void Reset();
+
+		uint64_t GetCount(const unsigned int i_bucket) const { return m_Buckets[i_bucket].load(std::memory_order_relaxed); }
+
+		uint64_t GetTotalCount() const;
+
+		// upper bound of the bucket with the i_percent percentile, 0 when nothing was recorded
+		uint64_t GetPercentile(const double i_percent) const;
+
+		// bucket 0 counts 0 tick, bucket i > 0 counts [2^(i-1), 2^i) ticks, the last one everything above
+		static unsigned int GetBucket(const uint64_t i_ticks)
+		{
+			if (i_ticks == 0)
+				return 0;
+
+			unsigned long iHighestBit;
+#if WIN32
+			if (_BitScanReverse(&iHighestBit, static_cast<unsigned long>(i_ticks >> 32)))
+				iHighestBit += 32;
+			else
+				_BitScanReverse(&iHighestBit, static_cast<unsigned long>(i_ticks));
+#else
+			_BitScanReverse64(&iHighestBit, i_ticks);
+#endif
+			return iHighestBit + 1 < s_NumBuckets ? iHighestBit + 1 : s_NumBuckets - 1;
+		}
+
+		static uint64_t GetBucketUpperBound(const unsigned int i_bucket) { return i_bucket ? (uint64_t(1) << i_bucket) - 1 : 0; }
+
+		// the last bucket starts above 4 minutes at 1GHz
+		static const unsigned int s_NumBuckets = 40;
+
+	private:
+		std::atomic<uint64_t> m_Buckets[s_NumBuckets];
+	};
+
+	// times the scope it is declared in, see HEAP_PROBE_SCOPE
+	class HeapProbe
+	{
+	public:
+		HeapProbe(const ProbePoint i_point, const void* i_pAllocator, LatencyHistogram& i_histogram, const void* i_ptr, const size_t i_size) :
+			m_point(i_point),
+			m_pAllocator(i_pAllocator),
+			m_histogram(i_histogram),
+			m_ptr(i_ptr),
+			m_size(i_size),
+			m_start(GetTicks())
+		{
+		}
+
+		~HeapProbe()
+		{
+			const uint64_t ticks = GetTicks() - m_start;
+			m_histogram.Record(ticks);
+
+			const ProbeCallback callback = s_Callback.load(std::memory_order_relaxed);
+			if (callback)
+				callback(m_point, m_pAllocator, m_ptr, m_size, ticks);
+		}
+
+		void SetBlock(const void* i_ptr) { m_ptr = i_ptr; }
+
+		// every probe of the process calls i_callback until it is set again, nullptr for none
+		static void SetCallback(const ProbeCallback i_callback) { s_Callback.store(i_callback, std::memory_order_relaxed); }
+
+		static uint64_t GetTicks() { return __rdtsc(); }
+
+		// measured once against steady_clock on the first call
+		static uint64_t GetTicksPerSecond();
+
+	private:
+		HeapProbe(const HeapProbe&) = delete;
+		HeapProbe& operator=(const HeapProbe&) = delete;
+
+		ProbePoint m_point;
+		const void* m_pAllocator;
+		LatencyHistogram& m_histogram;
+		const void* m_ptr;
+		size_t m_size;
+		uint64_t m_start;
+
+		static std::atomic<ProbeCallback> s_Callback;
+	};
+}
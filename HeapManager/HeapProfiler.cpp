@@ -0,0 +1,171 @@
+#include "HeapProfiler.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <Windows.h>
+#include <Psapi.h>
+
+namespace HeapManagerProxy
+{
+	thread_local size_t HeapProfiler::t_bytesUntilSample = 0;
+	thread_local uint64_t HeapProfiler::t_randomState = 0;
+
+	HeapProfiler::HeapProfiler(const size_t i_sampleInterval) : m_sampleInterval(i_sampleInterval), m_numSampledAllocations(0)
+	{
+		assert(m_sampleInterval > 0);
+	}
+
+	// exponential distribution with mean m_sampleInterval
+	size_t HeapProfiler::PickNextSampleInterval()
+	{
+		const uint64_t randomMask = (1ull << 48) - 1;
+
+		if (t_randomState == 0)
+			t_randomState = (GetCurrentThreadId() * 0x9E3779B97F4A7C15ull) & randomMask;
+
+		t_randomState = (t_randomState * 0x5DEECE66Dull + 0xB) & randomMask;
+
+		// 26 random bits, q in [1, 2^26]
+		double q = static_cast<double>(t_randomState >> (48 - 26)) + 1.0;
+		double interval = (log2(q) - 26) * (-log(2.0) * m_sampleInterval);
+
+		return static_cast<size_t>(interval) + 1;
+	}
+
+	void HeapProfiler::RecordSampledMalloc(const void* i_ptr, const size_t i_size)
+	{
+		if (t_bytesUntilSample == 0)
+		{
+			// first allocation of this thread, start the countdown instead of sampling it
+			t_bytesUntilSample = PickNextSampleInterval();
+			if (t_bytesUntilSample > i_size)
+			{
+				t_bytesUntilSample -= i_size;
+				return;
+			}
+		}
+
+		t_bytesUntilSample = PickNextSampleInterval();
+
+		// skip this function and the allocator entry
+		void* frames[s_MaxStackDepth];
+		ULONG hash = 0;
+		uint32_t depth = CaptureStackBackTrace(2, s_MaxStackDepth, frames, &hash);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		uint32_t iSite = s_NoSite;
+		std::unordered_map<uint32_t, uint32_t>::iterator it = m_siteHashes.find(hash);
+		if (it != m_siteHashes.end())
+		{
+			iSite = it->second;
+			while (iSite != s_NoSite && (m_sites[iSite].Depth != depth || memcmp(m_sites[iSite].Frames, frames, depth * sizeof(void*)) != 0))
+				iSite = m_sites[iSite].NextWithSameHash;
+		}
+
+		if (iSite == s_NoSite)
+		{
+			ProfileSite site;
+			memcpy(site.Frames, frames, depth * sizeof(void*));
+			site.Depth = depth;
+			site.NextWithSameHash = it != m_siteHashes.end() ? it->second : s_NoSite;
+			site.LiveCount = 0;
+			site.LiveBytes = 0;
+			site.AllocCount = 0;
+			site.AllocBytes = 0;
+
+			iSite = static_cast<uint32_t>(m_sites.size());
+			m_sites.push_back(site);
+			m_siteHashes[hash] = iSite;
+		}
+
+		ProfileSite& site = m_sites[iSite];
+		++site.LiveCount;
+		site.LiveBytes += i_size;
+		++site.AllocCount;
+		site.AllocBytes += i_size;
+
+		SampledAllocation& sampled = m_sampledAllocations[i_ptr];
+		sampled.Site = iSite;
+		sampled.Size = i_size;
+		m_numSampledAllocations = m_sampledAllocations.size();
+	}
+
+	void HeapProfiler::RecordFree(const void* i_ptr)
+	{
+		if (m_numSampledAllocations == 0)
+			return;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		std::unordered_map<const void*, SampledAllocation>::iterator it = m_sampledAllocations.find(i_ptr);
+		if (it == m_sampledAllocations.end())
+			return;
+
+		ProfileSite& site = m_sites[it->second.Site];
+		--site.LiveCount;
+		site.LiveBytes -= it->second.Size;
+
+		m_sampledAllocations.erase(it);
+		m_numSampledAllocations = m_sampledAllocations.size();
+	}
+
+	bool HeapProfiler::Dump(const char* i_pPath)
+	{
+		FILE* pFile = nullptr;
+		if (fopen_s(&pFile, i_pPath, "w") != 0 || pFile == nullptr)
+			return false;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		size_t totalLiveCount = 0;
+		size_t totalLiveBytes = 0;
+		size_t totalAllocCount = 0;
+		size_t totalAllocBytes = 0;
+		for (size_t i = 0; i < m_sites.size(); ++i)
+		{
+			totalLiveCount += m_sites[i].LiveCount;
+			totalLiveBytes += m_sites[i].LiveBytes;
+			totalAllocCount += m_sites[i].AllocCount;
+			totalAllocBytes += m_sites[i].AllocBytes;
+		}
+
+		fprintf(pFile, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", totalLiveCount, totalLiveBytes, totalAllocCount, totalAllocBytes, m_sampleInterval);
+
+		for (size_t i = 0; i < m_sites.size(); ++i)
+		{
+			const ProfileSite& site = m_sites[i];
+
+			fprintf(pFile, "%zu: %zu [%zu: %zu] @", site.LiveCount, site.LiveBytes, site.AllocCount, site.AllocBytes);
+			for (uint32_t iFrame = 0; iFrame < site.Depth; ++iFrame)
+				fprintf(pFile, " 0x%llx", static_cast<unsigned long long>(reinterpret_cast<uintptr_t>(site.Frames[iFrame])));
+			fprintf(pFile, "\n");
+		}
+
+		// address ranges of modules in the format of /proc/self/maps
+		fprintf(pFile, "\nMAPPED_LIBRARIES:\n");
+
+		HMODULE modules[1024];
+		DWORD sizeNeeded = 0;
+		if (EnumProcessModules(GetCurrentProcess(), modules, sizeof(modules), &sizeNeeded))
+		{
+			size_t numModules = sizeNeeded / sizeof(HMODULE) < 1024 ? sizeNeeded / sizeof(HMODULE) : 1024;
+			for (size_t i = 0; i < numModules; ++i)
+			{
+				MODULEINFO info;
+				char path[MAX_PATH];
+				if (GetModuleInformation(GetCurrentProcess(), modules[i], &info, sizeof(info)) == FALSE
+					|| GetModuleFileNameA(modules[i], path, MAX_PATH) == 0)
+					continue;
+
+				uintptr_t start = reinterpret_cast<uintptr_t>(info.lpBaseOfDll);
+				fprintf(pFile, "%llx-%llx r-xp 00000000 00:00 0 %s\n", static_cast<unsigned long long>(start),
+					static_cast<unsigned long long>(start + info.SizeOfImage), path);
+			}
+		}
+
+		fclose(pFile);
+		return true;
+	}
+}
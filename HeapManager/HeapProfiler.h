@@ -0,0 +1,95 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace HeapManagerProxy
+{
+	// statistical heap profiler, samples about one allocation every SampleInterval bytes
+	// sample points are drawn from an exponential distribution so every byte has the same chance,
+	// the pprof tool unsamples the counts with the rate written in the profile
+	class HeapProfiler
+	{
+	public:
+		HeapProfiler(const size_t i_sampleInterval);
+
+		// cheap when the allocation is not sampled, only a thread local counter is touched
+		inline void RecordMalloc(const void* i_ptr, const size_t i_size)
+		{
+			if (i_ptr == nullptr)
+				return;
+
+			if (t_bytesUntilSample > i_size)
+			{
+				t_bytesUntilSample -= i_size;
+				return;
+			}
+
+			RecordSampledMalloc(i_ptr, i_size);
+		}
+
+		void RecordFree(const void* i_ptr);
+
+		// legacy pprof heap profile (heap_v2), with the loaded modules for symbolization
+		bool Dump(const char* i_pPath);
+
+		size_t GetSampleInterval() const { return m_sampleInterval; }
+
+		size_t GetNumSites() const { return m_sites.size(); }
+
+		static const size_t s_DefaultSampleInterval = 512 * 1024;
+
+	private:
+		void RecordSampledMalloc(const void* i_ptr, const size_t i_size);
+
+		size_t PickNextSampleInterval();
+
+		static const size_t s_MaxStackDepth = 32;
+
+		// allocations from the same call stack
+		struct ProfileSite
+		{
+			void* Frames[s_MaxStackDepth];
+			uint32_t Depth;
+			uint32_t NextWithSameHash;
+
+			size_t LiveCount;
+			size_t LiveBytes;
+			size_t AllocCount;
+			size_t AllocBytes;
+		};
+
+		struct SampledAllocation
+		{
+			uint32_t Site;
+			size_t Size;
+		};
+
+		size_t m_sampleInterval;
+
+		std::mutex m_mutex;
+
+		std::vector<ProfileSite> m_sites;
+
+		// first site of each stack hash, sites with the same hash are chained by NextWithSameHash
+		std::unordered_map<uint32_t, uint32_t> m_siteHashes;
+
+		std::unordered_map<const void*, SampledAllocation> m_sampledAllocations;
+
+		// free takes no lock while nothing sampled is alive
+		std::atomic<size_t> m_numSampledAllocations;
+
+		static const uint32_t s_NoSite = ~0u;
+
+		// bytes the calling thread can allocate before next sample, 0 before its first allocation
+		static thread_local size_t t_bytesUntilSample;
+
+		// 48-bit linear congruential generator of the calling thread
+		static thread_local uint64_t t_randomState;
+	};
+}
@@ -9,6 +9,15 @@ namespace HeapManagerProxy
 #define GUARD_BAND_SIZE 0
 #endif
 
+	// how long an allocation is expected to live, allocators keep blocks of different lifetimes apart
+	enum class AllocationLifetime : unsigned char
+	{
+		Default = 0,	// unknown
+		Transient,		// freed within a few allocations
+		Frame,			// freed at the end of current frame
+		Persistent		// lives until shutdown or a level change
+	};
+
 	class IAllocator
 	{
 	public:
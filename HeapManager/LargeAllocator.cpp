@@ -0,0 +1,297 @@
+#include "LargeAllocator.h"
+#include "Utils.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <Windows.h>
+
+namespace HeapManagerProxy
+{
+	LargeAllocator::LargeAllocator() : m_pTable(nullptr), m_tableCapacity(0), m_numMappings(0), m_numCached(0), m_cachedBytes(0), m_cacheEpoch(0)
+	{
+	}
+
+	LargeAllocator::~LargeAllocator()
+	{
+		ReleaseCache();
+
+		if (m_numMappings)
+			fprintf(stderr, "LargeAllocator still has %zu outstanding mappings!\n", m_numMappings);
+
+		if (m_pTable)
+			UnmapPages(m_pTable);
+	}
+
+	size_t LargeAllocator::GetMappingAlignment()
+	{
+		SYSTEM_INFO SysInfo;
+		GetSystemInfo(&SysInfo);
+
+		return SysInfo.dwAllocationGranularity;
+	}
+
+	void* LargeAllocator::MapPages(const size_t i_size, const unsigned int i_physicalNode)
+	{
+		return VirtualAllocExNuma(GetCurrentProcess(), NULL, i_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, i_physicalNode);
+	}
+
+	void LargeAllocator::UnmapPages(void* i_pBaseAddress)
+	{
+		VirtualFree(i_pBaseAddress, 0, MEM_RELEASE);
+	}
+
+	void* LargeAllocator::alloc(const size_t i_size, const unsigned int i_physicalNode)
+	{
+		SYSTEM_INFO SysInfo;
+		GetSystemInfo(&SysInfo);
+
+		const size_t sizeMapping = Utils::AlignUp(i_size, SysInfo.dwPageSize);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// the table is at most half full
+		if ((m_numMappings + 1) * 2 > m_tableCapacity && GrowTable() == false)
+			return nullptr;
+
+		// smallest cached mapping of the same node that is not more than twice as large
+		size_t iBestCached = m_numCached;
+		for (size_t i = 0; i < m_numCached; ++i)
+		{
+			const Mapping& cached = m_cache[i];
+			if (cached.PhysicalNode == i_physicalNode && cached.Size >= sizeMapping && cached.Size / 2 <= sizeMapping
+				&& (iBestCached == m_numCached || cached.Size < m_cache[iBestCached].Size))
+				iBestCached = i;
+		}
+
+		Mapping mapping;
+		if (iBestCached < m_numCached)
+		{
+			mapping = m_cache[iBestCached];
+			m_cachedBytes -= mapping.Size;
+
+			memmove(m_cache + iBestCached, m_cache + iBestCached + 1, (m_numCached - iBestCached - 1) * sizeof(Mapping));
+			--m_numCached;
+		}
+		else
+		{
+			// fresh pages are zero, they are not touched until the user writes them
+			mapping.pBaseAddress = MapPages(sizeMapping, i_physicalNode);
+			mapping.Size = sizeMapping;
+			mapping.PhysicalNode = i_physicalNode;
+
+			if (mapping.pBaseAddress == nullptr)
+				return nullptr;
+		}
+
+		size_t iSlot = FindSlot(mapping.pBaseAddress);
+		assert(m_pTable[iSlot].pBaseAddress == nullptr);
+
+		mapping.Category = 0;
+		m_pTable[iSlot] = mapping;
+		++m_numMappings;
+
+		return mapping.pBaseAddress;
+	}
+
+	bool LargeAllocator::free(const void* i_ptr)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_pTable == nullptr)
+			return false;
+
+		size_t iSlot = FindSlot(i_ptr);
+		if (m_pTable[iSlot].pBaseAddress == nullptr)
+			return false;
+
+		Mapping mapping = m_pTable[iSlot];
+		EraseSlot(iSlot);
+		--m_numMappings;
+
+		if (mapping.Size > s_MaxCachedBytes)
+		{
+			UnmapPages(mapping.pBaseAddress);
+			return true;
+		}
+
+		// make room, the oldest mappings go first
+		size_t numEvicted = 0;
+		while (numEvicted < m_numCached && (m_numCached - numEvicted == s_MaxCachedMappings || m_cachedBytes + mapping.Size > s_MaxCachedBytes))
+		{
+			UnmapPages(m_cache[numEvicted].pBaseAddress);
+			m_cachedBytes -= m_cache[numEvicted].Size;
+			++numEvicted;
+		}
+
+		memmove(m_cache, m_cache + numEvicted, (m_numCached - numEvicted) * sizeof(Mapping));
+		m_numCached -= numEvicted;
+
+		mapping.CacheEpoch = m_cacheEpoch;
+		m_cache[m_numCached++] = mapping;
+		m_cachedBytes += mapping.Size;
+
+		return true;
+	}
+
+	bool LargeAllocator::Contains(const void* i_ptr)
+	{
+		return GetMappedSize(i_ptr) != 0;
+	}
+
+	size_t LargeAllocator::GetMappedSize(const void* i_ptr) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_pTable == nullptr)
+			return 0;
+
+		return m_pTable[FindSlot(i_ptr)].Size;
+	}
+
+	void LargeAllocator::SetCategory(const void* i_ptr, const unsigned char i_category)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_pTable == nullptr)
+			return;
+
+		Mapping& mapping = m_pTable[FindSlot(i_ptr)];
+		if (mapping.pBaseAddress)
+			mapping.Category = i_category;
+	}
+
+	unsigned char LargeAllocator::GetCategory(const void* i_ptr) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_pTable == nullptr)
+			return 0;
+
+		const Mapping& mapping = m_pTable[FindSlot(i_ptr)];
+		return mapping.pBaseAddress ? mapping.Category : 0;
+	}
+
+	void LargeAllocator::ReleaseCache()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		for (size_t i = 0; i < m_numCached; ++i)
+			UnmapPages(m_cache[i].pBaseAddress);
+
+		m_numCached = 0;
+		m_cachedBytes = 0;
+	}
+
+	size_t LargeAllocator::TrimCache()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// oldest first, the stale mappings are at the front
+		size_t numStale = 0;
+		size_t sizeReleased = 0;
+		while (numStale < m_numCached && m_cache[numStale].CacheEpoch != m_cacheEpoch)
+		{
+			UnmapPages(m_cache[numStale].pBaseAddress);
+			sizeReleased += m_cache[numStale].Size;
+			++numStale;
+		}
+
+		memmove(m_cache, m_cache + numStale, (m_numCached - numStale) * sizeof(Mapping));
+		m_numCached -= numStale;
+		m_cachedBytes -= sizeReleased;
+
+		++m_cacheEpoch;
+
+		return sizeReleased;
+	}
+
+	void LargeAllocator::ShowOutstandingAllocations()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		printf("Allocated large blocks:\n");
+		printf("Start\tEnd\tSize\tStatus\n");
+		for (size_t i = 0; i < m_tableCapacity; ++i)
+		{
+			const Mapping& mapping = m_pTable[i];
+			if (mapping.pBaseAddress)
+				printf("%p\t%p\t%zu\tAllocated\n", mapping.pBaseAddress, static_cast<char*>(mapping.pBaseAddress) + mapping.Size, mapping.Size);
+		}
+	}
+
+	bool LargeAllocator::IsEmpty()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		return m_numMappings == 0;
+	}
+
+	// mappings are aligned to the allocation granularity, the low 16 bits carry nothing
+	size_t LargeAllocator::GetHomeSlot(const void* i_ptr) const
+	{
+		const uint64_t key = reinterpret_cast<uintptr_t>(i_ptr) >> 16;
+		return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & (m_tableCapacity - 1);
+	}
+
+	size_t LargeAllocator::FindSlot(const void* i_ptr) const
+	{
+		size_t iSlot = GetHomeSlot(i_ptr);
+
+		while (m_pTable[iSlot].pBaseAddress && m_pTable[iSlot].pBaseAddress != i_ptr)
+			iSlot = (iSlot + 1) & (m_tableCapacity - 1);
+
+		return iSlot;
+	}
+
+	bool LargeAllocator::GrowTable()
+	{
+		const size_t newCapacity = m_tableCapacity ? m_tableCapacity * 2 : s_MinTableCapacity;
+
+		Mapping* pNewTable = static_cast<Mapping*>(MapPages(newCapacity * sizeof(Mapping), 0));
+		if (pNewTable == nullptr)
+			return false;
+
+		Mapping* pOldTable = m_pTable;
+		const size_t oldCapacity = m_tableCapacity;
+
+		// committed pages are zero, every slot starts empty
+		m_pTable = pNewTable;
+		m_tableCapacity = newCapacity;
+
+		for (size_t i = 0; i < oldCapacity; ++i)
+		{
+			if (pOldTable[i].pBaseAddress)
+				m_pTable[FindSlot(pOldTable[i].pBaseAddress)] = pOldTable[i];
+		}
+
+		if (pOldTable)
+			UnmapPages(pOldTable);
+
+		return true;
+	}
+
+	// shift the following entries back so no probe sequence has a hole
+	void LargeAllocator::EraseSlot(size_t i_slot)
+	{
+		const size_t mask = m_tableCapacity - 1;
+
+		size_t iNext = (i_slot + 1) & mask;
+		while (m_pTable[iNext].pBaseAddress)
+		{
+			const size_t iHome = GetHomeSlot(m_pTable[iNext].pBaseAddress);
+
+			// the entry can move to the hole when the hole lies between its home slot and its slot
+			if (((iNext - iHome) & mask) >= ((iNext - i_slot) & mask))
+			{
+				m_pTable[i_slot] = m_pTable[iNext];
+				i_slot = iNext;
+			}
+
+			iNext = (iNext + 1) & mask;
+		}
+
+		m_pTable[i_slot].pBaseAddress = nullptr;
+		m_pTable[i_slot].Size = 0;
+	}
+}
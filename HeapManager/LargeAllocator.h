@@ -0,0 +1,90 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+
+namespace HeapManagerProxy
+{
+	// every allocation has its own pages, mapped on alloc and released on free
+	// the few most recently released mappings are kept committed for reuse, up to s_MaxCachedBytes
+	class LargeAllocator
+	{
+	public:
+		LargeAllocator();
+		~LargeAllocator();
+
+		// user memory starts at the mapping, aligned to the allocation granularity
+		void* alloc(const size_t i_size, const unsigned int i_physicalNode);
+
+		bool free(const void* i_ptr);
+
+		bool Contains(const void* i_ptr);
+
+		// bytes mapped for the allocation at i_ptr, 0 if it is not one
+		size_t GetMappedSize(const void* i_ptr) const;
+
+		// memory category of the allocation at i_ptr, 0 for a new one
+		void SetCategory(const void* i_ptr, const unsigned char i_category);
+
+		unsigned char GetCategory(const void* i_ptr) const;
+
+		// release all cached mappings to the system
+		void ReleaseCache();
+
+		// release the mappings already cached at the last call, none of them was reused since
+		// return the bytes released
+		size_t TrimCache();
+
+		void ShowOutstandingAllocations();
+
+		bool IsEmpty();
+
+		size_t GetCachedBytes() const { return m_cachedBytes; }
+
+		// alignment of every mapping, 64KB on Windows
+		static size_t GetMappingAlignment();
+
+		static const size_t s_MaxCachedMappings = 8;
+
+		static const size_t s_MaxCachedBytes = 32 * 1024 * 1024;
+
+	private:
+		struct Mapping
+		{
+			void* pBaseAddress; // nullptr for an empty slot
+			size_t Size;
+			unsigned int PhysicalNode;
+			unsigned int CacheEpoch; // TrimCache calls before it was cached
+			unsigned char Category;
+		};
+
+		// open addressing with linear probing, the slot of i_ptr or the empty slot where it would go
+		size_t FindSlot(const void* i_ptr) const;
+
+		size_t GetHomeSlot(const void* i_ptr) const;
+
+		bool GrowTable();
+
+		void EraseSlot(size_t i_slot);
+
+		static void* MapPages(const size_t i_size, const unsigned int i_physicalNode);
+
+		static void UnmapPages(void* i_pBaseAddress);
+
+		// outstanding mappings, the table itself is mapped with MapPages
+		Mapping* m_pTable;
+		size_t m_tableCapacity;
+		size_t m_numMappings;
+
+		// released mappings, oldest first
+		Mapping m_cache[s_MaxCachedMappings];
+		size_t m_numCached;
+		size_t m_cachedBytes;
+		unsigned int m_cacheEpoch;
+
+		mutable std::mutex m_mutex;
+
+		static const size_t s_MinTableCapacity = 64;
+	};
+}
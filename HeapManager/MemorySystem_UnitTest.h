@@ -1,6 +1,12 @@
 #pragma once
+#include <Windows.h>
 #include "HeapManager.h"
+#include "BitArray.h"
 #include <algorithm>  
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 bool MemorySystem_UnitTest()
 {
@@ -121,3 +127,1049 @@ bool MemorySystem_UnitTest()
 	// we succeeded
 	return true;
 }
+
+// bounded Collect passes mixed with full ones while blocks are freed without merge
+// a full Collect finishes the pass in progress, every neighbor block ends up merged
+bool IncrementalCollect_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const size_t maxAllocations = 10 * 1024;
+	const size_t collectStepsPerCall = 64;
+	const size_t sizeAlloc = 1000;
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->CreateHeaps(1);
+
+	HeapAllocator* pHeap = pHeapManager->GetDefaultHeap();
+	pHeap->SetCoalesceOnFree(false);
+
+	// adjacent blocks freed behind a pass that has started
+	std::vector<void*> AllocatedAddresses;
+	for (size_t i = 0; i < 8; ++i)
+		AllocatedAddresses.push_back(pHeap->alloc(sizeAlloc));
+
+	for (size_t i = 0; i < 7; ++i)
+		pHeap->free(AllocatedAddresses[i]);
+
+	pHeap->Collect(1);
+	pHeap->Collect();
+
+	// first fit finds the merged block above the last one before the untouched heap
+	void* pMerged = pHeap->alloc(6 * sizeAlloc);
+	bool success = pMerged > AllocatedAddresses[7];
+
+	success = pHeap->free(pMerged) && success;
+	success = pHeap->free(AllocatedAddresses[7]) && success;
+	AllocatedAddresses.clear();
+
+	// random frees, bounded and full passes in any order
+	AllocatedAddresses.reserve(maxAllocations);
+	for (size_t i = 0; i < maxAllocations; ++i)
+	{
+		void* pPtr = pHeapManager->malloc(1 + (rand() & 1023));
+		if (pPtr == nullptr)
+		{
+			pHeapManager->Collect();
+			pPtr = pHeapManager->malloc(1 + (rand() & 1023));
+			if (pPtr == nullptr)
+				break;
+		}
+
+		AllocatedAddresses.push_back(pPtr);
+
+		if ((rand() % 3) == 0)
+		{
+			const size_t iFree = rand() % AllocatedAddresses.size();
+			success = pHeapManager->free(AllocatedAddresses[iFree]) && success;
+			AllocatedAddresses[iFree] = AllocatedAddresses.back();
+			AllocatedAddresses.pop_back();
+		}
+
+		if ((rand() % 7) == 0)
+			pHeapManager->Collect(collectStepsPerCall);
+		else if ((rand() % 61) == 0)
+			pHeapManager->Collect();
+	}
+
+	// a pass is left half done before the last frees
+	pHeapManager->Collect(1);
+
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+		success = pHeapManager->free(AllocatedAddresses[i]) && success;
+
+	pHeapManager->Collect(1);
+	pHeapManager->Collect();
+
+	// only the free block index storage and the fixed-size heap objects split the free space
+	void* pLarge = pHeap->alloc(pHeap->GetTotalFreeSize() / 2);
+	success = success && pLarge && pHeap->free(pLarge);
+
+	pHeap->SetCoalesceOnFree(true);
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	return success;
+}
+
+// two simulated NUMA nodes on any machine
+// allocations come from the node of calling thread, frees go back to the owning node
+bool NumaHeaps_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const unsigned int numNodes = 2;
+	const size_t allocationSizes[] = { 16, 100, 200, 1000, 4000 };
+	const size_t numSizes = sizeof(allocationSizes) / sizeof(allocationSizes[0]);
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->CreateHeaps(numNodes);
+
+	bool success = pHeapManager->GetNumNodes() == numNodes;
+
+	std::vector<void*> AllocatedAddresses[numNodes];
+	for (unsigned int iNode = 0; iNode < numNodes; ++iNode)
+	{
+		HeapManager::SetThreadNode(iNode);
+		success = success && pHeapManager->GetCurrentNode() == iNode;
+
+		for (size_t i = 0; i < numSizes; ++i)
+		{
+			void* pPtr = pHeapManager->malloc(allocationSizes[i]);
+			if (pPtr == nullptr || pHeapManager->GetNodeOfAddress(pPtr) != iNode)
+				success = false;
+
+			AllocatedAddresses[iNode].push_back(pPtr);
+		}
+	}
+
+	// free from the other node
+	for (unsigned int iNode = 0; iNode < numNodes; ++iNode)
+	{
+		HeapManager::SetThreadNode(numNodes - 1 - iNode);
+
+		for (size_t i = 0; i < AllocatedAddresses[iNode].size(); ++i)
+		{
+			if (pHeapManager->free(AllocatedAddresses[iNode][i]) == false)
+				success = false;
+		}
+	}
+
+	HeapManager::SetThreadNode(HeapManager::s_NoThreadNode);
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	return success;
+}
+
+// threads of one node spread over four arenas, frees find the arena of each block
+bool Arenas_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const unsigned int numArenas = 4;
+	const unsigned int numThreads = 4;
+	const size_t numAllocationsPerThread = 256;
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->SetNumArenas(numArenas);
+	pHeapManager->CreateHeaps(1);
+
+	bool success = pHeapManager->GetNumArenas(0) == numArenas;
+
+	std::vector<void*> AllocatedAddresses[numThreads];
+	std::vector<std::thread> threads;
+	for (unsigned int iThread = 0; iThread < numThreads; ++iThread)
+	{
+		threads.push_back(std::thread([&, iThread]()
+		{
+			for (size_t i = 0; i < numAllocationsPerThread; ++i)
+				AllocatedAddresses[iThread].push_back(pHeapManager->malloc(300 + (i * 37) % 2000));
+		}));
+	}
+
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+
+	// free from main thread, every block goes back to its own arena
+	for (unsigned int iThread = 0; iThread < numThreads; ++iThread)
+	{
+		for (size_t i = 0; i < AllocatedAddresses[iThread].size(); ++i)
+		{
+			void* pPtr = AllocatedAddresses[iThread][i];
+			if (pPtr == nullptr || pHeapManager->GetArenaOfAddress(0, pPtr) >= numArenas)
+				success = false;
+
+			if (pHeapManager->free(pPtr) == false)
+				success = false;
+		}
+	}
+
+	pHeapManager->Collect();
+
+	// the threads of a node share its fixed-size heaps too, a block is never handed out twice
+	const size_t numFixedSizeAllocationsPerThread = 4000;
+	const size_t sizePattern = 64;
+	std::vector<void*> FixedSizeAddresses[numThreads];
+	std::atomic<bool> bOverlap(false);
+	std::atomic<unsigned int> numStarted(0);
+	threads.clear();
+	for (unsigned int iThread = 0; iThread < numThreads; ++iThread)
+	{
+		threads.push_back(std::thread([&, iThread]()
+		{
+			// all threads start together
+			++numStarted;
+			while (numStarted < numThreads) {}
+
+			std::vector<void*>& Addresses = FixedSizeAddresses[iThread];
+			for (size_t i = 0; i < numFixedSizeAllocationsPerThread; ++i)
+			{
+				void* pPtr = pHeapManager->malloc(sizePattern + 1 + (i * 13) % 192);
+				if (pPtr == nullptr)
+					continue;
+
+				memset(pPtr, iThread + 1, sizePattern);
+				Addresses.push_back(pPtr);
+
+				// free every other block, its pattern is still the one this thread wrote
+				if (i % 2)
+				{
+					unsigned char* pFree = static_cast<unsigned char*>(Addresses[Addresses.size() / 2]);
+					Addresses[Addresses.size() / 2] = Addresses.back();
+					Addresses.pop_back();
+
+					if (pFree[0] != iThread + 1 || pFree[sizePattern - 1] != iThread + 1)
+						bOverlap = true;
+
+					pHeapManager->free(pFree);
+				}
+			}
+		}));
+	}
+
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+
+	success = success && bOverlap == false;
+
+	for (unsigned int iThread = 0; iThread < numThreads; ++iThread)
+	{
+		for (size_t i = 0; i < FixedSizeAddresses[iThread].size(); ++i)
+		{
+			const unsigned char* pPtr = static_cast<const unsigned char*>(FixedSizeAddresses[iThread][i]);
+			success = success && pPtr[0] == iThread + 1 && pPtr[sizePattern - 1] == iThread + 1;
+			success = pHeapManager->free(FixedSizeAddresses[iThread][i]) && success;
+		}
+	}
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	return success;
+}
+
+// every power-of-two alignment is honored, power-of-two sizes are naturally aligned
+// and page aligned blocks give the padding after them back to the heap
+bool Alignment_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const size_t alignments[] = { 4, 8, 16, 32, 64, 128, 256, 4096, 8192 };
+	const size_t sizes[] = { 8, 48, 64, 100, 200, 1000, 5000 };
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->CreateHeaps(1);
+
+	bool success = pHeapManager->aligned_alloc(3, 16) == nullptr;
+
+	std::vector<void*> AllocatedAddresses;
+	for (size_t iAlignment = 0; iAlignment < sizeof(alignments) / sizeof(alignments[0]); ++iAlignment)
+	{
+		for (size_t iSize = 0; iSize < sizeof(sizes) / sizeof(sizes[0]); ++iSize)
+		{
+			void* pPtr = pHeapManager->aligned_alloc(alignments[iAlignment], sizes[iSize]);
+			if (pPtr == nullptr || reinterpret_cast<uintptr_t>(pPtr) % alignments[iAlignment] != 0)
+				success = false;
+
+			AllocatedAddresses.push_back(pPtr);
+		}
+	}
+
+	for (size_t size = 8; size <= HeapManager::s_MaxNaturalAlignment; size *= 2)
+	{
+		void* pPtr = pHeapManager->malloc(size);
+		if (pPtr == nullptr || reinterpret_cast<uintptr_t>(pPtr) % size != 0)
+			success = false;
+
+		AllocatedAddresses.push_back(pPtr);
+	}
+
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+	{
+		if (pHeapManager->free(AllocatedAddresses[i]) == false)
+			success = false;
+	}
+	AllocatedAddresses.clear();
+
+	pHeapManager->Collect();
+
+	// without trimming, every block would keep 4096 - 3000 bytes of padding
+	const size_t numPageAligned = 64;
+	const size_t sizePageAligned = 3000;
+
+	HeapAllocator* pDefaultHeap = pHeapManager->GetDefaultHeap();
+	size_t freeBefore = pDefaultHeap->GetTotalFreeSize();
+
+	for (size_t i = 0; i < numPageAligned; ++i)
+		AllocatedAddresses.push_back(pHeapManager->aligned_alloc(4096, sizePageAligned));
+
+	size_t used = freeBefore - pDefaultHeap->GetTotalFreeSize();
+	if (used > numPageAligned * (sizePageAligned + HeapAllocator::s_MinAlignmentSlack + sizeof(MemoryBlock)) + 4096)
+		success = false;
+
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+	{
+		if (pHeapManager->free(AllocatedAddresses[i]) == false)
+			success = false;
+	}
+
+	pHeapManager->Collect();
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	return success;
+}
+
+// blocks above the threshold get their own pages, even when they are larger than a heap
+// a freed mapping is reused by the next allocation of the same size
+bool LargeAlloc_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const size_t sizeHuge = 4 * 1024 * 1024;
+	const size_t numLarge = 64;
+	const size_t sizeLarge = 200 * 1024;
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->CreateHeaps(1);
+
+	void* pHuge = pHeapManager->malloc(sizeHuge);
+	bool success = pHuge != nullptr && pHeapManager->GetNodeOfAddress(pHuge) == pHeapManager->GetNumNodes();
+
+	if (pHuge)
+		memset(pHuge, _bCleanLandFill, sizeHuge);
+
+	success = pHeapManager->free(pHuge) && success;
+	success = pHeapManager->free(pHuge) == false && success;
+
+	success = pHeapManager->malloc(sizeHuge) == pHuge && success;
+	success = pHeapManager->free(pHuge) && success;
+
+	// more than all heaps of the node together
+	std::vector<void*> AllocatedAddresses;
+	for (size_t i = 0; i < numLarge; ++i)
+	{
+		void* pPtr = pHeapManager->malloc(sizeLarge);
+		if (pPtr == nullptr)
+			success = false;
+
+		AllocatedAddresses.push_back(pPtr);
+	}
+
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+	{
+		if (pHeapManager->free(AllocatedAddresses[i]) == false)
+			success = false;
+	}
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	return success;
+}
+
+// the whole usable size of a block can be written without touching its neighbors
+bool UsableSize_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const size_t sizes[] = { 1, 10, 60, 100, 200, 300, 1000, 5000, 300 * 1024 };
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->CreateHeaps(1);
+
+	bool success = pHeapManager->usable_size(&success) == 0;
+
+	std::vector<void*> AllocatedAddresses;
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+	{
+		// two blocks of the same size are neighbors in the same heap
+		for (int iBlock = 0; iBlock < 2; ++iBlock)
+		{
+			AllocationResult result = pHeapManager->allocate_at_least(sizes[i]);
+			if (result.pMemory == nullptr || result.Size < sizes[i] || pHeapManager->usable_size(result.pMemory) != result.Size)
+			{
+				success = false;
+				continue;
+			}
+
+			memset(result.pMemory, _bCleanLandFill, result.Size);
+			AllocatedAddresses.push_back(result.pMemory);
+		}
+	}
+
+	// a small block has the rest of its tiny block, 8 byte classes
+	void* pSmall = pHeapManager->malloc(10);
+	success = pHeapManager->usable_size(pSmall) == TinyObjectAllocator::GetBlockSize(10, 4) - 2 * GUARD_BAND_SIZE && success;
+	AllocatedAddresses.push_back(pSmall);
+
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+	{
+		if (pHeapManager->free(AllocatedAddresses[i]) == false)
+			success = false;
+	}
+
+	pHeapManager->Collect();
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	return success;
+}
+
+// persistent blocks are carved one below the other, transient blocks go to their own arena
+bool Lifetime_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const size_t numAllocations = 32;
+	const size_t sizeAlloc = 1000;
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->SetUseTransientArena(true);
+	pHeapManager->CreateHeaps(1);
+
+	const unsigned int iTransientArena = pHeapManager->GetNumArenas(0) - 1;
+	bool success = iTransientArena == 1;
+
+	std::vector<void*> PersistentAddresses;
+	std::vector<void*> TransientAddresses;
+	for (size_t i = 0; i < numAllocations; ++i)
+	{
+		TransientAddresses.push_back(pHeapManager->malloc(sizeAlloc, AllocationLifetime::Transient));
+		PersistentAddresses.push_back(pHeapManager->malloc(sizeAlloc, AllocationLifetime::Persistent));
+
+		success = success && pHeapManager->GetArenaOfAddress(0, TransientAddresses.back()) == iTransientArena;
+		success = success && pHeapManager->GetArenaOfAddress(0, PersistentAddresses.back()) == 0;
+	}
+
+	// a hole in the default heap is left to other allocations
+	void* pHole = pHeapManager->malloc(sizeAlloc);
+	void* pDefault = pHeapManager->malloc(sizeAlloc);
+	pHeapManager->free(pHole);
+
+	void* pPersistent = pHeapManager->malloc(sizeAlloc, AllocationLifetime::Persistent);
+	success = success && pPersistent < pDefault;
+	PersistentAddresses.push_back(pPersistent);
+
+	// every persistent block is right below the one before, only the block head is in between
+	for (size_t i = 1; i < numAllocations; ++i)
+	{
+		size_t distance = static_cast<char*>(PersistentAddresses[i - 1]) - static_cast<char*>(PersistentAddresses[i]);
+		success = success && distance < sizeAlloc + 64;
+	}
+
+	for (size_t i = 0; i < numAllocations; ++i)
+	{
+		success = pHeapManager->free(TransientAddresses[i]) && success;
+		success = pHeapManager->free(PersistentAddresses[i]) && success;
+	}
+	success = pHeapManager->free(pPersistent) && success;
+	success = pHeapManager->free(pDefault) && success;
+
+	pHeapManager->Collect();
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	return success;
+}
+
+// the blocks freed between two outstanding ones are merged without any Collect from the caller
+bool Scavenger_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const size_t numAllocations = 200;
+	const size_t sizeAlloc = 1000;
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->CreateHeaps(1);
+	pHeapManager->StartScavenger(1, 50);
+
+	bool success = pHeapManager->IsScavengerRunning() && pHeapManager->GetDefaultHeap()->IsCoalesceOnFree() == false;
+
+	// blocks are carved down from the heap end, the freed ones are between pTop and pBottom
+	void* pTop = pHeapManager->malloc(sizeAlloc);
+	std::vector<void*> AllocatedAddresses;
+	for (size_t i = 0; i < numAllocations; ++i)
+		AllocatedAddresses.push_back(pHeapManager->malloc(sizeAlloc));
+	void* pBottom = pHeapManager->malloc(sizeAlloc);
+
+	for (size_t i = 0; i < numAllocations; ++i)
+		success = pHeapManager->free(AllocatedAddresses[i]) && success;
+
+	// cached after free, released when no allocation reused it for a whole pass
+	void* pLarge = pHeapManager->malloc(pHeapManager->GetLargeAllocThreshold());
+	success = pHeapManager->free(pLarge) && success;
+
+	const size_t numPasses = pHeapManager->GetNumScavengerPasses();
+	for (int i = 0; i < 2000 && pHeapManager->GetNumScavengerPasses() < numPasses + 5; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	success = success && pHeapManager->GetNumScavengerPasses() >= numPasses + 5;
+	success = success && pHeapManager->GetScavengedBytes() >= pHeapManager->GetLargeAllocThreshold() + 64 * 1024;
+
+	// first fit finds the merged block before the untouched heap
+	void* pMerged = pHeapManager->malloc(numAllocations / 2 * sizeAlloc);
+	success = success && pMerged > pBottom && pMerged < pTop;
+
+	success = pHeapManager->free(pMerged) && success;
+	success = pHeapManager->free(pTop) && success;
+	success = pHeapManager->free(pBottom) && success;
+
+	pHeapManager->StopScavenger();
+	success = success && pHeapManager->IsScavengerRunning() == false && pHeapManager->GetDefaultHeap()->IsCoalesceOnFree();
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	return success;
+}
+
+#ifdef HEAP_TRACING
+// calls of the probe callback at each probe point
+static std::atomic<size_t> s_NumProbeCalls[static_cast<size_t>(HeapManagerProxy::ProbePoint::ManagerFree) + 1];
+
+static void CountProbeCall(HeapManagerProxy::ProbePoint i_point, const void* i_pAllocator, const void* i_ptr, size_t i_size, uint64_t i_ticks)
+{
+	s_NumProbeCalls[static_cast<size_t>(i_point)].fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
+// every malloc and free is timed in HeapManager and again in the heap it goes to
+bool Tracing_UnitTest()
+{
+#ifdef HEAP_TRACING
+	using namespace HeapManagerProxy;
+
+	bool success = LatencyHistogram::GetBucket(0) == 0 && LatencyHistogram::GetBucket(1) == 1 && LatencyHistogram::GetBucket(3) == 2
+		&& LatencyHistogram::GetBucket(4) == 3 && LatencyHistogram::GetBucket(UINT64_MAX) == LatencyHistogram::s_NumBuckets - 1;
+
+	for (size_t i = 0; i < sizeof(s_NumProbeCalls) / sizeof(s_NumProbeCalls[0]); ++i)
+		s_NumProbeCalls[i] = 0;
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->CreateHeaps(1);
+
+	HeapAllocator* pDefaultHeap = pHeapManager->GetDefaultHeap();
+	const uint64_t numHeapAllocs = pDefaultHeap->GetAllocLatency().GetTotalCount();
+
+	HeapProbe::SetCallback(CountProbeCall);
+
+	// fixed-size blocks and arena blocks
+	const size_t numAllocations = 1000;
+	std::vector<void*> AllocatedAddresses;
+	for (size_t i = 0; i < numAllocations; ++i)
+		AllocatedAddresses.push_back(pHeapManager->malloc(i % 2 ? 40 : 1000));
+
+	for (size_t i = 0; i < numAllocations; ++i)
+		success = pHeapManager->free(AllocatedAddresses[i]) && success;
+
+	pHeapManager->Collect();
+
+	HeapProbe::SetCallback(nullptr);
+
+	const LatencyHistogram& MallocLatency = pHeapManager->GetMallocLatency();
+	success = success && MallocLatency.GetTotalCount() == numAllocations && pHeapManager->GetFreeLatency().GetTotalCount() == numAllocations;
+	success = success && MallocLatency.GetPercentile(50) > 0 && MallocLatency.GetPercentile(50) <= MallocLatency.GetPercentile(99);
+
+	success = success && pDefaultHeap->GetAllocLatency().GetTotalCount() == numHeapAllocs + numAllocations / 2;
+	success = success && pDefaultHeap->GetFreeLatency().GetTotalCount() >= numAllocations / 2 && pDefaultHeap->GetCollectLatency().GetTotalCount() > 0;
+
+	success = success && s_NumProbeCalls[static_cast<size_t>(ProbePoint::ManagerMalloc)] == numAllocations
+		&& s_NumProbeCalls[static_cast<size_t>(ProbePoint::ManagerFree)] == numAllocations;
+	success = success && s_NumProbeCalls[static_cast<size_t>(ProbePoint::FixedSizeAlloc)] == numAllocations / 2
+		&& s_NumProbeCalls[static_cast<size_t>(ProbePoint::FixedSizeFree)] == numAllocations / 2;
+	success = success && s_NumProbeCalls[static_cast<size_t>(ProbePoint::HeapAlloc)] == numAllocations / 2;
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	success = success && HeapProbe::GetTicksPerSecond() > 0;
+
+	return success;
+#else
+	return true;
+#endif
+}
+
+// blocks are charged to the category of the call or of the thread scope and given back on free
+bool Categories_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const MemoryCategory renderer = 1;
+	const MemoryCategory network = 2;
+	const MemoryCategory textures = 3;
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->SetTrackCategories(true);
+	pHeapManager->CreateHeaps(1);
+
+	pHeapManager->SetCategoryName(renderer, "Renderer");
+	pHeapManager->SetCategoryName(network, "Network");
+	pHeapManager->SetCategoryName(textures, "Textures");
+	pHeapManager->SetCategoryBudget(renderer, 64 * 1024, true);
+	pHeapManager->SetCategoryBudget(network, 1024, false);
+
+	bool success = HeapManager::GetThreadCategory() == 0;
+
+	std::vector<void*> AllocatedAddresses;
+	size_t sizeRenderer = 0;
+	{
+		MemoryCategoryScope scope(renderer);
+		{
+			MemoryCategoryScope innerScope(network);
+			success = success && HeapManager::GetThreadCategory() == network;
+		}
+		success = success && HeapManager::GetThreadCategory() == renderer;
+
+		// fixed-size blocks and arena blocks
+		for (size_t i = 0; i < 120; ++i)
+		{
+			void* pBlock = pHeapManager->malloc(i % 6 ? 40 : 1000);
+			success = success && pBlock && pHeapManager->GetCategoryOfBlock(pBlock) == renderer;
+			sizeRenderer += pHeapManager->usable_size(pBlock);
+			AllocatedAddresses.push_back(pBlock);
+		}
+
+		// past the hard budget
+		success = success && pHeapManager->malloc(64 * 1024) == nullptr;
+	}
+	success = success && HeapManager::GetThreadCategory() == 0;
+
+	const MemoryCategoryStats rendererStats = pHeapManager->GetCategoryStats(renderer);
+	success = success && rendererStats.LiveBytes == sizeRenderer && rendererStats.PeakBytes == sizeRenderer
+		&& rendererStats.NumLiveAllocations == 120 && rendererStats.NumOverBudget == 1 && rendererStats.bHardBudget;
+
+	// past a soft budget the allocations are only counted
+	for (size_t i = 0; i < 2; ++i)
+		AllocatedAddresses.push_back(pHeapManager->malloc(2000, AllocationLifetime::Default, network));
+
+	const MemoryCategoryStats networkStats = pHeapManager->GetCategoryStats(network);
+	success = success && AllocatedAddresses.back() && networkStats.NumLiveAllocations == 2 && networkStats.NumOverBudget == 2;
+
+	void* pLarge = pHeapManager->malloc(pHeapManager->GetLargeAllocThreshold(), AllocationLifetime::Default, textures);
+	success = success && pHeapManager->GetCategoryOfBlock(pLarge) == textures && pHeapManager->GetCategoryStats(textures).LiveBytes == pHeapManager->usable_size(pLarge);
+	AllocatedAddresses.push_back(pLarge);
+
+	pHeapManager->ShowCategories();
+
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+		success = pHeapManager->free(AllocatedAddresses[i]) && success;
+
+	// a fixed-size block freed twice is uncharged once
+	success = success && pHeapManager->free(AllocatedAddresses[1]) == false;
+
+	// blocks allocated before tracking were never charged
+	success = success && pHeapManager->SetTrackCategories(false) == false && pHeapManager->IsTrackingCategories();
+
+	for (MemoryCategory category = 0; category <= textures; ++category)
+	{
+		const MemoryCategoryStats stats = pHeapManager->GetCategoryStats(category);
+		success = success && stats.LiveBytes == 0 && stats.NumLiveAllocations == 0;
+	}
+	success = success && pHeapManager->GetCategoryStats(renderer).PeakBytes == sizeRenderer && pHeapManager->GetCategoryStats(0).PeakBytes == 0;
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	return success;
+}
+
+// the heap of a block is found from its page, whatever the number of nodes and arenas
+bool PageMap_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	// a range across two leaves
+	PageMap* pPageMap = new PageMap();
+	const uintptr_t leafSize = uintptr_t(16) * 1024 * 1024;
+	const char* pRangeStart = reinterpret_cast<const char*>(5 * leafSize - PageMap::s_PageSize);
+
+	PageOwner owner = PageOwner();
+	owner.pOwner = pPageMap;
+	owner.Node = 3;
+	owner.Kind = PageKind::FixedSize;
+	owner.SizeClass = 2;
+
+	bool success = pPageMap->Set(pRangeStart, 3 * PageMap::s_PageSize, owner);
+	for (size_t i = 0; i < 3 * PageMap::s_PageSize; i += PageMap::s_PageSize / 2)
+	{
+		const PageOwner found = pPageMap->Find(pRangeStart + i);
+		success = success && found.pOwner == pPageMap && found.Node == 3 && found.Kind == PageKind::FixedSize && found.SizeClass == 2;
+	}
+	success = success && pPageMap->Find(pRangeStart - 1).Kind == PageKind::None && pPageMap->Find(pRangeStart + 3 * PageMap::s_PageSize).Kind == PageKind::None;
+	success = success && pPageMap->Find(reinterpret_cast<const void*>(~uintptr_t(0))).Kind == PageKind::None;
+
+	pPageMap->Clear(pRangeStart, 3 * PageMap::s_PageSize);
+	success = success && pPageMap->Find(pRangeStart).Kind == PageKind::None && pPageMap->Find(pRangeStart + 2 * PageMap::s_PageSize).Kind == PageKind::None;
+	delete pPageMap;
+
+	const unsigned int numNodes = 2;
+	const unsigned int numArenas = 8;
+	const size_t sizes[] = { 40, 100, 200, 1000, 128 * 1024 };
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->SetNumArenas(numArenas);
+	pHeapManager->CreateHeaps(numNodes);
+
+	std::vector<void*> AllocatedAddresses;
+	for (unsigned int iNode = 0; iNode < numNodes; ++iNode)
+	{
+		HeapManager::SetThreadNode(iNode);
+
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+		{
+			void* pPtr = pHeapManager->malloc(sizes[i]);
+			const bool bLarge = sizes[i] >= pHeapManager->GetLargeAllocThreshold();
+
+			success = success && pPtr && pHeapManager->usable_size(pPtr) >= sizes[i];
+			success = success && pHeapManager->GetNodeOfAddress(pPtr) == (bLarge ? numNodes : iNode);
+			AllocatedAddresses.push_back(pPtr);
+		}
+	}
+	HeapManager::SetThreadNode(HeapManager::s_NoThreadNode);
+
+	// not a block of any heap
+	int notOwned = 0;
+	success = success && pHeapManager->usable_size(&notOwned) == 0 && pHeapManager->GetNodeOfAddress(&notOwned) == numNodes;
+	success = success && pHeapManager->free(&notOwned) == false;
+
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+		success = pHeapManager->free(AllocatedAddresses[i]) && success;
+
+	// a large mapping is no longer ours once freed
+	success = success && pHeapManager->free(AllocatedAddresses.back()) == false;
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	return success;
+}
+
+// a freed mid-size block comes back to the next alloc of its class, Collect merges the kept blocks
+bool Lookaside_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const size_t sizeHeap = 1024 * 1024;
+	const size_t sizeAlloc = 1000;
+
+	void* pMemory = VirtualAlloc(NULL, sizeHeap, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (pMemory == nullptr)
+		return false;
+
+	HeapAllocator* pHeap = new (pMemory) HeapAllocator(static_cast<HeapAllocator*>(pMemory) + 1, sizeHeap - sizeof(HeapAllocator));
+	const size_t freeBefore = pHeap->GetTotalFreeSize();
+
+	std::vector<void*> AllocatedAddresses;
+	for (size_t i = 0; i < 8; ++i)
+		AllocatedAddresses.push_back(pHeap->alloc(sizeAlloc));
+
+	bool success = pHeap->IsLookaside() && pHeap->GetNumLookasideBlocks() == 0;
+
+	// kept, not outstanding and counted as free
+	void* pFreed = AllocatedAddresses[3];
+	success = pHeap->free(pFreed) && success;
+	success = success && pHeap->GetNumLookasideBlocks() == 1 && pHeap->IsAllocated(pFreed) == false && pHeap->free(pFreed) == false;
+
+	// a size in the same class, the last freed block first
+	void* pReused = pHeap->alloc(sizeAlloc - 8);
+	success = success && pReused == pFreed && pHeap->GetNumLookasideBlocks() == 0 && pHeap->IsAllocated(pReused);
+	AllocatedAddresses[3] = pReused;
+
+	// a stricter alignment than the kept block has is not served from it
+	success = pHeap->free(pReused) && success;
+	void* pAligned = pHeap->alloc(sizeAlloc, 4096);
+	success = success && pAligned != pReused && reinterpret_cast<uintptr_t>(pAligned) % 4096 == 0 && pHeap->GetNumLookasideBlocks() == 1;
+	success = pHeap->free(pAligned) && success;
+	AllocatedAddresses.erase(AllocatedAddresses.begin() + 3);
+
+	// a class keeps at most s_MaxLookasideDepth blocks
+	for (size_t i = 0; i < HeapAllocator::s_MaxLookasideDepth + 4; ++i)
+		AllocatedAddresses.push_back(pHeap->alloc(sizeAlloc));
+
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+		success = pHeap->free(AllocatedAddresses[i]) && success;
+
+	success = success && pHeap->GetNumLookasideBlocks() <= HeapAllocator::s_MaxLookasideDepth + 1 && pHeap->IsEmpty();
+
+	// blocks above s_MaxLookasideBlockSize are never kept
+	void* pLarge = pHeap->alloc(HeapAllocator::s_MaxLookasideBlockSize);
+	const size_t numKept = pHeap->GetNumLookasideBlocks();
+	success = pHeap->free(pLarge) && success;
+	success = success && pHeap->GetNumLookasideBlocks() == numKept;
+
+	// everything merged back, the unused descriptors too
+	pHeap->Collect();
+	const size_t freeCollected = pHeap->GetTotalFreeSize();
+	success = success && pHeap->GetNumLookasideBlocks() == 0 && pHeap->GetLargestFreeBlock() + 1024 > freeCollected && freeCollected == freeBefore;
+
+	// a block kept while a bounded pass runs is not handed out again with the untouched heap
+	pHeap->SetCoalesceOnFree(false);
+	AllocatedAddresses.clear();
+	for (size_t i = 0; i < 3; ++i)
+		AllocatedAddresses.push_back(pHeap->alloc(5 * sizeAlloc));
+
+	char* pKept = static_cast<char*>(pHeap->alloc(100));
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+		success = pHeap->free(AllocatedAddresses[i]) && success;
+
+	success = success && pHeap->Collect(1) == false;
+	success = pHeap->free(pKept) && success && pHeap->GetNumLookasideBlocks() == 1;
+
+	while (pHeap->Collect(1) == false)
+		;
+
+	success = success && pHeap->alloc(100) == pKept;
+	AllocatedAddresses.clear();
+	for (size_t i = 0; i < 8; ++i)
+	{
+		char* pPtr = static_cast<char*>(pHeap->alloc(5 * sizeAlloc));
+		success = success && pPtr && (pPtr + 5 * sizeAlloc <= pKept || pPtr >= pKept + 100);
+		AllocatedAddresses.push_back(pPtr);
+	}
+
+	AllocatedAddresses.push_back(pKept);
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+		success = pHeap->free(AllocatedAddresses[i]) && success;
+
+	pHeap->SetCoalesceOnFree(true);
+	pHeap->Collect();
+
+	// the alignment slack of each block is a free block too, with some counts the index is full
+	// while the kept blocks are flushed back, they are merged in place without flushing again
+	pHeap->SetCoalesceOnFree(false);
+	for (size_t numBlocks = 120; numBlocks < 140; ++numBlocks)
+	{
+		AllocatedAddresses.clear();
+		for (size_t i = 0; i < numBlocks; ++i)
+			AllocatedAddresses.push_back(pHeap->alloc(100, 4096));
+
+		for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+			success = pHeap->free(AllocatedAddresses[i]) && success;
+
+		pHeap->Collect();
+		success = success && pHeap->GetNumLookasideBlocks() == 0 && pHeap->GetTotalFreeSize() == freeBefore;
+	}
+
+	pHeap->SetCoalesceOnFree(true);
+
+	// without lookaside a freed block merges right away
+	pHeap->SetLookaside(false);
+	void* pPtr = pHeap->alloc(sizeAlloc);
+	success = pHeap->free(pPtr) && success;
+	success = success && pHeap->GetNumLookasideBlocks() == 0 && pHeap->GetLargestFreeBlock() + 1024 > pHeap->GetTotalFreeSize();
+
+	pHeap->~HeapAllocator();
+	VirtualFree(pMemory, 0, MEM_RELEASE);
+
+	// a nearly full heap, flushing the kept blocks for a request that does not fit keeps the index
+	const size_t sizeSmallHeap = 64 * 1024;
+	pMemory = VirtualAlloc(NULL, sizeSmallHeap, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (pMemory == nullptr)
+		return false;
+
+	pHeap = new (pMemory) HeapAllocator(static_cast<HeapAllocator*>(pMemory) + 1, sizeSmallHeap - sizeof(HeapAllocator));
+	const size_t freeSmallHeap = pHeap->GetTotalFreeSize();
+
+	for (size_t size = freeSmallHeap - 2048; size < freeSmallHeap; size += 16)
+	{
+		success = pHeap->free(pHeap->alloc(100)) && success;
+
+		void* pNearlyAll = pHeap->alloc(size);
+		success = (pNearlyAll == nullptr || pHeap->free(pNearlyAll)) && success;
+	}
+
+	pHeap->Collect();
+	success = success && pHeap->GetTotalFreeSize() == freeSmallHeap;
+
+	// the alignment slack fills the index with the heap full, a free that can not grow it merges the block
+	pHeap->SetCoalesceOnFree(false);
+	AllocatedAddresses.clear();
+	void* pAligned256;
+	while ((pAligned256 = pHeap->alloc(100, 256)) != nullptr)
+		AllocatedAddresses.push_back(pAligned256);
+
+	for (size_t i = 0; i < AllocatedAddresses.size(); i += 2)
+		success = pHeap->free(AllocatedAddresses[i]) && success;
+
+	for (size_t i = 1; i < AllocatedAddresses.size(); i += 2)
+		success = pHeap->free(AllocatedAddresses[i]) && success;
+
+	pHeap->SetCoalesceOnFree(true);
+	pHeap->Collect();
+	success = success && pHeap->GetNumLookasideBlocks() == 0 && pHeap->GetTotalFreeSize() == freeSmallHeap;
+
+	pHeap->~HeapAllocator();
+	VirtualFree(pMemory, 0, MEM_RELEASE);
+
+	return success;
+}
+
+// tiny blocks are packed by size class in page-sized runs, HeapManager sends requests up to 64 bytes to them
+bool TinyObjects_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const size_t sizeHeap = 64 * 1024;
+
+	void* pMemory = VirtualAlloc(NULL, sizeHeap, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (pMemory == nullptr)
+		return false;
+
+	TinyObjectAllocator* pTinyHeap = new (pMemory) TinyObjectAllocator(static_cast<TinyObjectAllocator*>(pMemory) + 1, sizeHeap - sizeof(TinyObjectAllocator));
+
+	// the run table takes the first page
+	bool success = pTinyHeap->IsEmpty() && pTinyHeap->GetNumRuns() == sizeHeap / TinyObjectAllocator::s_RunSize - 1 && pTinyHeap->GetNumTouchedRuns() == 0;
+	success = success && TinyObjectAllocator::GetBlockSize(TinyObjectAllocator::s_MaxBlockSize + 1, 4) == 0 && TinyObjectAllocator::GetBlockSize(8, 128) == 0;
+
+	// blocks of one class are packed with no header, a run holds all that fit in a page
+	std::vector<void*> AllocatedAddresses;
+	const size_t sizeBlock = TinyObjectAllocator::GetBlockSize(8, 8);
+	const size_t numBlocksPerRun = TinyObjectAllocator::s_RunSize / sizeBlock;
+	for (size_t i = 0; i < 2 * numBlocksPerRun; ++i)
+		AllocatedAddresses.push_back(pTinyHeap->alloc(8, 8));
+
+	success = success && pTinyHeap->GetNumUsedRuns() == 2;
+	success = success && static_cast<char*>(AllocatedAddresses[1]) - static_cast<char*>(AllocatedAddresses[0]) == static_cast<ptrdiff_t>(sizeBlock);
+
+	// until the last run is taken
+	void* pPtr;
+	while ((pPtr = pTinyHeap->alloc(8, 8)) != nullptr)
+		AllocatedAddresses.push_back(pPtr);
+
+	success = success && pTinyHeap->GetNumTouchedRuns() == pTinyHeap->GetNumRuns() && AllocatedAddresses.size() == pTinyHeap->GetNumRuns() * numBlocksPerRun;
+
+	// emptied runs go back but the last one of the class
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+		success = pTinyHeap->free(AllocatedAddresses[i]) && success;
+
+	success = success && pTinyHeap->GetNumUsedRuns() == 1 && pTinyHeap->IsEmpty();
+	AllocatedAddresses.clear();
+
+	// every size up to the largest class, then a class that keeps the alignment
+	for (size_t size = 1; TinyObjectAllocator::GetBlockSize(size, 4); ++size)
+	{
+		pPtr = pTinyHeap->alloc(size, 4);
+
+		success = success && pPtr && reinterpret_cast<uintptr_t>(pPtr) % 4 == 0 && pTinyHeap->IsAllocated(pPtr);
+		success = success && pTinyHeap->GetUsableSize(pPtr) >= size && pTinyHeap->GetUsableSize(pPtr) < size + TinyObjectAllocator::s_Granularity;
+		AllocatedAddresses.push_back(pPtr);
+	}
+
+	for (int i = 0; i < 4; ++i)
+	{
+		pPtr = pTinyHeap->alloc(20, 16);
+		success = success && pPtr && reinterpret_cast<uintptr_t>(pPtr) % 16 == 0 && pTinyHeap->GetUsableSize(pPtr) >= 20;
+		AllocatedAddresses.push_back(pPtr);
+	}
+
+	for (size_t i = 0; i < AllocatedAddresses.size(); ++i)
+		success = pTinyHeap->free(AllocatedAddresses[i]) && success;
+
+	success = success && pTinyHeap->IsEmpty() && pTinyHeap->free(AllocatedAddresses[0]) == false && pTinyHeap->IsAllocated(AllocatedAddresses[0]) == false;
+
+	pTinyHeap->~TinyObjectAllocator();
+	VirtualFree(pMemory, 0, MEM_RELEASE);
+
+	HeapManager* pHeapManager = new HeapManager();
+	pHeapManager->CreateHeaps(1);
+
+	// the tiny heap takes the small sizes, the fixed-size heaps take them when it is off
+	void* pTiny = pHeapManager->malloc(24);
+	success = success && pHeapManager->GetTinyHeap(0)->IsAllocated(pTiny) && pHeapManager->usable_size(pTiny) >= 24;
+
+	pHeapManager->SetUseTinyHeap(false);
+	void* pFixedSize = pHeapManager->malloc(24);
+	success = success && pHeapManager->GetTinyHeap(0)->IsAllocated(pFixedSize) == false && pHeapManager->usable_size(pFixedSize) >= 24;
+
+	success = pHeapManager->free(pTiny) && pHeapManager->free(pFixedSize) && success;
+	success = success && pHeapManager->GetTinyHeap(0)->IsEmpty();
+
+	pHeapManager->Destroy();
+	delete pHeapManager;
+
+	return success;
+}
+
+// fixed-size blocks and their bits are only written when they are first allocated
+bool LazyInit_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const size_t sizeSlot = 1024 * 1024;
+	const size_t sizeBlock = 64;
+	const size_t numBlocks = sizeSlot / sizeBlock;
+
+	void* pMemory = VirtualAlloc(NULL, 2 * sizeSlot, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (pMemory == nullptr)
+		return false;
+
+	HeapAllocator* pHeap = new (pMemory) HeapAllocator(static_cast<HeapAllocator*>(pMemory) + 1, sizeSlot - sizeof(HeapAllocator));
+	BitArray* pAvailableBlocks = BitArray::Create(numBlocks, pHeap);
+	FixedSizeAllocator* pFSA = new (pHeap->alloc(sizeof(FixedSizeAllocator))) FixedSizeAllocator(static_cast<char*>(pMemory) + sizeSlot, pAvailableBlocks, sizeBlock, numBlocks);
+
+	bool success = pFSA->IsEmpty() && pFSA->GetNumTouchedBlocks() == 0;
+
+	void* pBlocks[3];
+	for (int i = 0; i < 3; ++i)
+		pBlocks[i] = pFSA->alloc(10);
+
+	success = success && pFSA->GetNumTouchedBlocks() == 3 && pFSA->IsEmpty() == false;
+
+	// a freed block is reused before the high-water mark moves
+	success = pFSA->free(pBlocks[1]) && success;
+	success = success && pFSA->alloc(10) == pBlocks[1] && pFSA->GetNumTouchedBlocks() == 3;
+
+	for (int i = 0; i < 3; ++i)
+		success = pFSA->free(pBlocks[i]) && success;
+
+	success = success && pFSA->IsEmpty() && pFSA->GetNumTouchedBlocks() == 3;
+
+	// clearing the last bit fills the elements before it, the others stay set
+	pAvailableBlocks->ClearBit(numBlocks - 1);
+	size_t iFirstSet = numBlocks;
+	success = success && pAvailableBlocks->AreAllBitsSet() == false && pAvailableBlocks->GetFirstSetBit(iFirstSet) && iFirstSet == 0;
+	pAvailableBlocks->SetBit(numBlocks - 1);
+	success = success && pAvailableBlocks->AreAllBitsSet();
+
+	pFSA->Destroy();
+	pAvailableBlocks->~BitArray();
+	pHeap->free(pAvailableBlocks);
+	pFSA->~FixedSizeAllocator();
+	pHeap->free(pFSA);
+
+	success = success && pHeap->IsEmpty();
+	pHeap->~HeapAllocator();
+
+	VirtualFree(pMemory, 0, MEM_RELEASE);
+
+	return success;
+}
@@ -0,0 +1,106 @@
+#include "PageMap.h"
+
+#include <assert.h>
+#include <Windows.h>
+
+namespace HeapManagerProxy
+{
+	PageMap::PageMap()
+	{
+		for (size_t i = 0; i < (size_t(1) << s_RootBits); ++i)
+			m_Root[i].store(nullptr, std::memory_order_relaxed);
+	}
+
+	PageMap::~PageMap()
+	{
+		for (size_t i = 0; i < (size_t(1) << s_RootBits); ++i)
+		{
+			MidLevel* pMid = m_Root[i].load(std::memory_order_relaxed);
+			if (pMid == nullptr)
+				continue;
+
+			for (size_t j = 0; j < (size_t(1) << s_MidBits); ++j)
+			{
+				LeafLevel* pLeaf = pMid->Leaves[j].load(std::memory_order_relaxed);
+				if (pLeaf)
+					VirtualFree(pLeaf, 0, MEM_RELEASE);
+			}
+
+			VirtualFree(pMid, 0, MEM_RELEASE);
+		}
+	}
+
+	void* PageMap::MapLevel(const size_t i_size)
+	{
+		return VirtualAlloc(NULL, i_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+
+	PageMap::LeafLevel* PageMap::GetOrCreateLeaf(const uintptr_t i_page)
+	{
+		std::atomic<MidLevel*>& root = m_Root[i_page >> (s_MidBits + s_LeafBits)];
+		MidLevel* pMid = root.load(std::memory_order_relaxed);
+		if (pMid == nullptr)
+		{
+			pMid = static_cast<MidLevel*>(MapLevel(sizeof(MidLevel)));
+			if (pMid == nullptr)
+				return nullptr;
+
+			// readers see the level after its zero pages
+			root.store(pMid, std::memory_order_release);
+		}
+
+		std::atomic<LeafLevel*>& mid = pMid->Leaves[(i_page >> s_LeafBits) & ((1 << s_MidBits) - 1)];
+		LeafLevel* pLeaf = mid.load(std::memory_order_relaxed);
+		if (pLeaf == nullptr)
+		{
+			pLeaf = static_cast<LeafLevel*>(MapLevel(sizeof(LeafLevel)));
+			if (pLeaf == nullptr)
+				return nullptr;
+
+			mid.store(pLeaf, std::memory_order_release);
+		}
+
+		return pLeaf;
+	}
+
+	bool PageMap::Set(const void* i_pStart, const size_t i_size, const PageOwner& i_owner)
+	{
+		const uintptr_t firstPage = reinterpret_cast<uintptr_t>(i_pStart) >> s_PageShift;
+		const uintptr_t endPage = (reinterpret_cast<uintptr_t>(i_pStart) + i_size + s_PageSize - 1) >> s_PageShift;
+		assert((reinterpret_cast<uintptr_t>(i_pStart) & (s_PageSize - 1)) == 0);
+		assert((endPage - 1) >> (s_RootBits + s_MidBits + s_LeafBits) == 0);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		uintptr_t page = firstPage;
+		while (page < endPage)
+		{
+			LeafLevel* pLeaf = GetOrCreateLeaf(page);
+			if (pLeaf == nullptr)
+				return false;
+
+			// the rest of the range in this leaf
+			const uintptr_t leafEndPage = ((page >> s_LeafBits) + 1) << s_LeafBits;
+			for (; page < endPage && page < leafEndPage; ++page)
+				pLeaf->Owners[page & ((1 << s_LeafBits) - 1)] = i_owner;
+		}
+
+		return true;
+	}
+
+	void PageMap::Clear(const void* i_pStart, const size_t i_size)
+	{
+		const uintptr_t firstPage = reinterpret_cast<uintptr_t>(i_pStart) >> s_PageShift;
+		const uintptr_t endPage = (reinterpret_cast<uintptr_t>(i_pStart) + i_size + s_PageSize - 1) >> s_PageShift;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		for (uintptr_t page = firstPage; page < endPage; ++page)
+		{
+			const MidLevel* pMid = m_Root[page >> (s_MidBits + s_LeafBits)].load(std::memory_order_relaxed);
+			LeafLevel* pLeaf = pMid ? pMid->Leaves[(page >> s_LeafBits) & ((1 << s_MidBits) - 1)].load(std::memory_order_relaxed) : nullptr;
+			if (pLeaf)
+				pLeaf->Owners[page & ((1 << s_LeafBits) - 1)] = PageOwner();
+		}
+	}
+}
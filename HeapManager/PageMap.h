@@ -0,0 +1,95 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+
+namespace HeapManagerProxy
+{
+	enum class PageKind : uint8_t
+	{
+		None = 0,	// no heap owns the page
+		Arena,
+		FixedSize,
+		Tiny,
+		Large
+	};
+
+	// what a page belongs to, all zero for a page no heap owns
+	struct PageOwner
+	{
+		void* pOwner; // HeapArena, or the NodeHeaps of a fixed-size or the tiny heap, nullptr for a large mapping
+		uint32_t Node;
+		PageKind Kind;
+		uint8_t SizeClass; // index of the fixed-size heap in its node
+	};
+
+	// three-level radix tree on the page number, any address to the owner of its page in three loads
+	// levels are mapped when a range is first set and kept until the map is destroyed, lookups take no lock
+	class PageMap
+	{
+	public:
+		PageMap();
+		~PageMap();
+
+		// every page of [i_pStart, i_pStart + i_size) to i_owner, false when a level can not be mapped
+		bool Set(const void* i_pStart, const size_t i_size, const PageOwner& i_owner);
+
+		void Clear(const void* i_pStart, const size_t i_size);
+
+		inline PageOwner Find(const void* i_ptr) const
+		{
+			const uintptr_t page = reinterpret_cast<uintptr_t>(i_ptr) >> s_PageShift;
+			if (page >> (s_RootBits + s_MidBits + s_LeafBits))
+				return PageOwner();
+
+			const MidLevel* pMid = m_Root[page >> (s_MidBits + s_LeafBits)].load(std::memory_order_acquire);
+			if (pMid == nullptr)
+				return PageOwner();
+
+			const LeafLevel* pLeaf = pMid->Leaves[(page >> s_LeafBits) & ((1 << s_MidBits) - 1)].load(std::memory_order_acquire);
+			if (pLeaf == nullptr)
+				return PageOwner();
+
+			return pLeaf->Owners[page & ((1 << s_LeafBits) - 1)];
+		}
+
+		static const size_t s_PageShift = 12;
+
+		static const size_t s_PageSize = size_t(1) << s_PageShift;
+
+	private:
+		PageMap(const PageMap&) = delete;
+		PageMap& operator=(const PageMap&) = delete;
+
+		// user addresses of x64 fit in 48 bits
+		static const size_t s_AddressBits = sizeof(void*) == 8 ? 48 : 32;
+
+		// a leaf covers 16MB, the upper page bits are split between the root and the middle level
+		static const size_t s_LeafBits = 12;
+		static const size_t s_RootBits = (s_AddressBits - s_PageShift - s_LeafBits + 1) / 2;
+		static const size_t s_MidBits = s_AddressBits - s_PageShift - s_LeafBits - s_RootBits;
+
+		struct LeafLevel
+		{
+			PageOwner Owners[1 << s_LeafBits];
+		};
+
+		struct MidLevel
+		{
+			std::atomic<LeafLevel*> Leaves[1 << s_MidBits];
+		};
+
+		// leaf of i_page, mapped if there is none yet, under m_mutex
+		LeafLevel* GetOrCreateLeaf(const uintptr_t i_page);
+
+		// levels are mapped zero, an empty owner or a null level
+		static void* MapLevel(const size_t i_size);
+
+		std::atomic<MidLevel*> m_Root[1 << s_RootBits];
+
+		// Set and Clear of different ranges
+		std::mutex m_mutex;
+	};
+}
@@ -0,0 +1,168 @@
+#include "PersistentHeap.h"
+#include "HeapAllocator.h"
+#include "RelativePtr.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <new>
+#include <Windows.h>
+
+namespace HeapManagerProxy
+{
+	// first bytes of the file, an image is only reopened by the build that wrote it
+	struct PersistentHeap::ImageHeader
+	{
+		uint32_t Magic;
+		uint16_t PointerSize;
+		uint16_t GuardBandSize;
+		uint32_t HeapAllocatorSize;
+		uint32_t bOpen; // set while a process has the image mapped
+		uint64_t ImageSize;
+		RelativePtr<void> pRoot;
+	};
+
+	static const uint32_t s_ImageMagic = 0x50484D31; // "PHM1"
+
+	PersistentHeap::PersistentHeap(void* i_hFile, void* i_hMapping, ImageHeader* i_pImage, HeapAllocator* i_pHeap, const bool i_bReopened) :
+		m_hFile(i_hFile),
+		m_hMapping(i_hMapping),
+		m_pImage(i_pImage),
+		m_pHeap(i_pHeap),
+		m_bReopened(i_bReopened)
+	{
+	}
+
+	PersistentHeap* PersistentHeap::Open(const char* i_pPath, const size_t i_size)
+	{
+		static_assert(sizeof(ImageHeader) <= s_HeaderSize, "ImageHeader should fit in the header");
+
+		HANDLE hFile = CreateFileA(i_pPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return nullptr;
+
+		const bool bExisting = GetLastError() == ERROR_ALREADY_EXISTS;
+
+		LARGE_INTEGER sizeFile;
+		if (GetFileSizeEx(hFile, &sizeFile) == FALSE)
+		{
+			CloseHandle(hFile);
+			return nullptr;
+		}
+
+		// an empty file is left by an Open that failed before mapping, make a new heap in it
+		const bool bReopened = bExisting && sizeFile.QuadPart > 0;
+		const uint64_t sizeImage = bReopened ? static_cast<uint64_t>(sizeFile.QuadPart) : i_size;
+
+		if (sizeImage < s_MinImageSize || sizeImage > SIZE_MAX)
+		{
+			printf("%s can not be a persistent heap of %llu bytes\n", i_pPath, static_cast<unsigned long long>(sizeImage));
+			CloseHandle(hFile);
+			return nullptr;
+		}
+
+		// the mapping grows a new file to the image size
+		HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READWRITE, static_cast<DWORD>(sizeImage >> 32), static_cast<DWORD>(sizeImage), NULL);
+		if (hMapping == NULL)
+		{
+			CloseHandle(hFile);
+			return nullptr;
+		}
+
+		ImageHeader* pImage = static_cast<ImageHeader*>(MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<size_t>(sizeImage)));
+		if (pImage == nullptr)
+		{
+			CloseImage(hFile, hMapping, nullptr);
+			return nullptr;
+		}
+
+		void* pHeapImage = reinterpret_cast<char*>(pImage) + s_HeaderSize;
+		HeapAllocator* pHeap = nullptr;
+
+		if (bReopened)
+		{
+			if (pImage->Magic != s_ImageMagic || pImage->PointerSize != sizeof(void*) || pImage->GuardBandSize != GUARD_BAND_SIZE
+				|| pImage->HeapAllocatorSize != sizeof(HeapAllocator) || pImage->ImageSize != sizeImage)
+			{
+				printf("%s is not a persistent heap of this build\n", i_pPath);
+				CloseImage(hFile, hMapping, pImage);
+				return nullptr;
+			}
+
+			// metadata may be half updated when the last process stopped without Close
+			if (pImage->bOpen)
+			{
+				printf("%s was not closed, the heap may be inconsistent\n", i_pPath);
+				CloseImage(hFile, hMapping, pImage);
+				return nullptr;
+			}
+
+			pHeap = HeapAllocator::Reopen(pHeapImage);
+		}
+		else
+		{
+			void* pAllocatorMemory = static_cast<HeapAllocator*>(pHeapImage) + 1;
+			pHeap = new (pHeapImage) HeapAllocator(pAllocatorMemory, static_cast<size_t>(sizeImage) - s_HeaderSize - sizeof(HeapAllocator));
+
+			pImage->PointerSize = sizeof(void*);
+			pImage->GuardBandSize = GUARD_BAND_SIZE;
+			pImage->HeapAllocatorSize = sizeof(HeapAllocator);
+			pImage->ImageSize = sizeImage;
+			pImage->pRoot = nullptr;
+
+			// the image is only recognized once it is complete
+			pImage->Magic = s_ImageMagic;
+		}
+
+		pImage->bOpen = 1;
+		FlushViewOfFile(pImage, sizeof(ImageHeader));
+
+		return new PersistentHeap(hFile, hMapping, pImage, pHeap, bReopened);
+	}
+
+	void PersistentHeap::Close()
+	{
+		// the heap keeps its allocations, the HeapAllocator is not destroyed
+		m_pImage->bOpen = 0;
+		Flush();
+
+		CloseImage(m_hFile, m_hMapping, m_pImage);
+
+		delete this;
+	}
+
+	void PersistentHeap::CloseImage(void* i_hFile, void* i_hMapping, ImageHeader* i_pImage)
+	{
+		if (i_pImage)
+			UnmapViewOfFile(i_pImage);
+
+		CloseHandle(i_hMapping);
+		CloseHandle(i_hFile);
+	}
+
+	void* PersistentHeap::alloc(const size_t i_size, const unsigned int i_alignment /*= 4*/)
+	{
+		return m_pHeap->alloc(i_size, i_alignment);
+	}
+
+	bool PersistentHeap::free(const void* i_ptr)
+	{
+		return m_pHeap->free(i_ptr);
+	}
+
+	void* PersistentHeap::GetRoot() const
+	{
+		return m_pImage->pRoot;
+	}
+
+	void PersistentHeap::SetRoot(void* i_pRoot)
+	{
+		assert(i_pRoot == nullptr || m_pHeap->Contains(i_pRoot));
+
+		m_pImage->pRoot = i_pRoot;
+	}
+
+	bool PersistentHeap::Flush()
+	{
+		return FlushViewOfFile(m_pImage, 0) != FALSE && FlushFileBuffers(m_hFile) != FALSE;
+	}
+}
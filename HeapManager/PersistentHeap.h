@@ -0,0 +1,63 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace HeapManagerProxy
+{
+	class HeapAllocator;
+
+	// general heap in a mapped file, the next process opening the file finds every allocation in place
+	// at whatever address the file is mapped, objects in the heap should link each other with RelativePtr
+	// one process at a time and not thread safe, like HeapAllocator
+	class PersistentHeap
+	{
+	public:
+		// map the heap in i_pPath, a new file gets an empty heap of i_size bytes
+		// nullptr when the file is not a heap of this build, or the last process did not Close it
+		static PersistentHeap* Open(const char* i_pPath, const size_t i_size);
+
+		// write the heap to the file and unmap it, the object is deleted
+		// outstanding allocations stay in the file for the next Open
+		void Close();
+
+		void* alloc(const size_t i_size, const unsigned int i_alignment = 4);
+
+		bool free(const void* i_ptr);
+
+		// where the objects in the heap are found again after Open, nullptr in a new heap
+		void* GetRoot() const;
+
+		void SetRoot(void* i_pRoot);
+
+		// write the dirty pages to the file, the image is consistent when no alloc or free is running
+		bool Flush();
+
+		// false when this Open created the heap
+		bool IsReopened() const { return m_bReopened; }
+
+		HeapAllocator* GetHeap() const { return m_pHeap; }
+
+		// start of the mapping, changes from one Open to the next
+		void* GetBaseAddress() const { return m_pImage; }
+
+		static const size_t s_MinImageSize = 64 * 1024;
+
+	private:
+		struct ImageHeader;
+
+		PersistentHeap(void* i_hFile, void* i_hMapping, ImageHeader* i_pImage, HeapAllocator* i_pHeap, const bool i_bReopened);
+
+		~PersistentHeap() {}
+
+		static void CloseImage(void* i_hFile, void* i_hMapping, ImageHeader* i_pImage);
+
+		void* m_hFile;
+		void* m_hMapping;
+		ImageHeader* m_pImage;
+		HeapAllocator* m_pHeap;
+		bool m_bReopened;
+
+		// the header takes the first cache line, the HeapAllocator and its heap follow
+		static const size_t s_HeaderSize = 64;
+	};
+}
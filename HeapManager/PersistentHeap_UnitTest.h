@@ -0,0 +1,102 @@
+#pragma once
+#include <Windows.h>
+
+#include <assert.h>
+#include <string.h>
+#include <new>
+#include <vector>
+
+#include "HeapAllocator.h"
+#include "PersistentHeap.h"
+#include "RelativePtr.h"
+
+bool PersistentHeap_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const char* pPath = "PersistentHeap_UnitTest.heap";
+	const size_t sizeImage = 4 * 1024 * 1024;
+	const int numNodes = 2000;
+
+	struct ListNode
+	{
+		RelativePtr<ListNode> pNext;
+		int Value;
+		unsigned char Payload[52];
+	};
+
+	DeleteFileA(pPath);
+
+	PersistentHeap* pHeap = PersistentHeap::Open(pPath, sizeImage);
+	assert(pHeap);
+
+	if (pHeap == nullptr)
+		return false;
+
+	bool success = pHeap->IsReopened() == false && pHeap->GetRoot() == nullptr;
+
+	// blocks of other sizes are freed between the nodes, so the free blocks are in the image too
+	std::vector<void*> Gaps;
+	ListNode* pHead = nullptr;
+	for (int i = 0; i < numNodes; ++i)
+	{
+		Gaps.push_back(pHeap->alloc(16 + (i % 7) * 24));
+
+		ListNode* pNode = new (pHeap->alloc(sizeof(ListNode), 8)) ListNode();
+		pNode->pNext = pHead;
+		pNode->Value = i;
+		memset(pNode->Payload, i & 0xFF, sizeof(pNode->Payload));
+		pHead = pNode;
+	}
+
+	for (size_t i = 0; i < Gaps.size(); i += 2)
+		success = pHeap->free(Gaps[i]) && success;
+
+	pHeap->SetRoot(pHead);
+
+	void* pOldBaseAddress = pHeap->GetBaseAddress();
+	pHeap->Close();
+
+	// take the old address so the image is mapped somewhere else
+	void* pBlocker = VirtualAlloc(pOldBaseAddress, sizeImage, MEM_RESERVE, PAGE_READWRITE);
+
+	pHeap = PersistentHeap::Open(pPath, 0);
+	assert(pHeap);
+
+	if (pHeap == nullptr)
+		return false;
+
+	success = success && pHeap->IsReopened();
+	success = success && (pBlocker == nullptr || pHeap->GetBaseAddress() != pOldBaseAddress);
+
+	// the list is found from the root, every node as it was written
+	int expected = numNodes - 1;
+	for (ListNode* pNode = static_cast<ListNode*>(pHeap->GetRoot()); pNode; pNode = pNode->pNext)
+	{
+		success = success && pNode->Value == expected && pNode->Payload[0] == (expected & 0xFF) && pNode->Payload[sizeof(pNode->Payload) - 1] == (expected & 0xFF);
+		--expected;
+	}
+	success = success && expected == -1;
+
+	// the heap goes on from where it was left
+	for (int i = 0; i < numNodes; ++i)
+		success = pHeap->alloc(16 + (i % 7) * 24) != nullptr && success;
+
+	ListNode* pNode = static_cast<ListNode*>(pHeap->GetRoot());
+	while (pNode)
+	{
+		ListNode* pNext = pNode->pNext;
+		success = pHeap->free(pNode) && success;
+		pNode = pNext;
+	}
+
+	pHeap->SetRoot(nullptr);
+	pHeap->Close();
+
+	if (pBlocker)
+		VirtualFree(pBlocker, 0, MEM_RELEASE);
+
+	DeleteFileA(pPath);
+
+	return success;
+}
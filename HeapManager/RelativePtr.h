@@ -0,0 +1,50 @@
+#pragma once
+#include <stddef.h>
+
+namespace HeapManagerProxy
+{
+	// pointer stored as the distance from itself, still valid after the memory holding both ends is mapped at another address
+	// offset 0 is nullptr, so it can not point to itself
+	// copying re-computes the distance, memcpy of it to another address does not
+	template <typename T>
+	class RelativePtr
+	{
+	public:
+		RelativePtr() : m_offset(0) {}
+
+		RelativePtr(std::nullptr_t) : m_offset(0) {}
+
+		RelativePtr(T* i_ptr) { Set(i_ptr); }
+
+		RelativePtr(const RelativePtr& i_other) { Set(i_other.Get()); }
+
+		RelativePtr& operator=(const RelativePtr& i_other) { Set(i_other.Get()); return *this; }
+
+		RelativePtr& operator=(T* i_ptr) { Set(i_ptr); return *this; }
+
+		inline T* Get() const
+		{
+			return m_offset ? reinterpret_cast<T*>(const_cast<char*>(reinterpret_cast<const char*>(this)) + m_offset) : nullptr;
+		}
+
+		inline operator T*() const { return Get(); }
+
+		// static_cast to other pointer types, like the raw pointer
+		template <typename U>
+		inline explicit operator U*() const { return static_cast<U*>(Get()); }
+
+		inline T* operator->() const { return Get(); }
+
+	private:
+		inline void Set(T* i_ptr)
+		{
+			m_offset = i_ptr ? reinterpret_cast<const char*>(i_ptr) - reinterpret_cast<const char*>(this) : 0;
+		}
+
+		ptrdiff_t m_offset;
+	};
+
+	// constructor argument of the classes living in a mapped image, the object only gets its virtual table pointer
+	// and the members are copied back from the image, see HeapAllocator::Reopen
+	struct ReopenImage {};
+}
@@ -0,0 +1,264 @@
+#include "SharedHeap.h"
+#include "BitArray.h"
+#include "FixedSizeAllocator.h"
+#include "HeapAllocator.h"
+#include "RelativePtr.h"
+#include "Utils.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <new>
+#include <Windows.h>
+
+namespace HeapManagerProxy
+{
+	static const unsigned int s_NumFixedSizeHeaps = 3;
+
+	// first bytes of the region, the heaps are found from here in every process
+	// the objects in the region are only called non-virtually, their vptr is the one of the creating process
+	struct SharedHeap::RegionHeader
+	{
+		uint32_t Magic;
+		uint16_t PointerSize;
+		uint16_t GuardBandSize;
+		uint32_t HeapAllocatorSize;
+		uint32_t bDamaged; // set when a process died holding a heap lock
+		uint64_t SlotSize;
+		RelativePtr<HeapAllocator> pDefaultHeap;
+		RelativePtr<FixedSizeAllocator> pFSAs[s_NumFixedSizeHeaps];
+	};
+
+	static const uint32_t s_RegionMagic = 0x53484D31; // "SHM1"
+
+	SharedHeap::SharedHeap(void* i_hMapping, RegionHeader* i_pRegion, void* const* i_phLocks, const bool i_bCreator) :
+		m_hMapping(i_hMapping),
+		m_pRegion(i_pRegion),
+		m_bCreator(i_bCreator)
+	{
+		for (unsigned int i = 0; i < s_NumHeapSlots; ++i)
+			m_hLocks[i] = i_phLocks[i];
+	}
+
+	SharedHeap* SharedHeap::Open(const char* i_pName, const size_t i_sizeSlot /*= s_DefaultSlotSize*/)
+	{
+		static_assert(sizeof(RegionHeader) <= s_HeaderSize, "RegionHeader should fit in the header");
+		static_assert(s_NumFixedSizeHeaps + 1 == s_NumHeapSlots, "one slot for the default heap and one for each fixed-size heap");
+
+		HANDLE hLocks[s_NumHeapSlots] = {};
+		for (unsigned int i = 0; i < s_NumHeapSlots; ++i)
+		{
+			char lockName[256];
+			snprintf(lockName, sizeof(lockName), "%s.heap%u", i_pName, i);
+
+			hLocks[i] = CreateMutexA(NULL, FALSE, lockName);
+			if (hLocks[i] == NULL)
+			{
+				CloseHandles(NULL, nullptr, hLocks);
+				return nullptr;
+			}
+		}
+
+		// the region is created and checked under the lock of the default heap, no process sees it half built
+		const DWORD lockResult = WaitForSingleObject(hLocks[0], INFINITE);
+		if (lockResult != WAIT_OBJECT_0 && lockResult != WAIT_ABANDONED)
+		{
+			CloseHandles(NULL, nullptr, hLocks);
+			return nullptr;
+		}
+
+		// every heap starts at the allocation granularity, so do the fixed-size blocks
+		const size_t sizeSlot = Utils::AlignUp(i_sizeSlot < s_MinSlotSize ? s_MinSlotSize : i_sizeSlot, s_MinSlotSize);
+		const uint64_t sizeRegion = static_cast<uint64_t>(sizeSlot) * s_NumHeapSlots;
+
+		// backed by the paging file, an existing region keeps its own size
+		HANDLE hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, static_cast<DWORD>(sizeRegion >> 32), static_cast<DWORD>(sizeRegion), i_pName);
+		const bool bCreator = hMapping != NULL && GetLastError() != ERROR_ALREADY_EXISTS;
+
+		RegionHeader* pRegion = hMapping ? static_cast<RegionHeader*>(MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0)) : nullptr;
+
+		bool success = pRegion != nullptr;
+		if (success && bCreator)
+		{
+			success = CreateHeaps(pRegion, sizeSlot);
+		}
+		else if (success)
+		{
+			// a new region is zero, the magic is only there once the creator finished
+			if (pRegion->Magic != s_RegionMagic || pRegion->PointerSize != sizeof(void*) || pRegion->GuardBandSize != GUARD_BAND_SIZE
+				|| pRegion->HeapAllocatorSize != sizeof(HeapAllocator))
+			{
+				printf("%s is not a shared heap of this build\n", i_pName);
+				success = false;
+			}
+			else if (lockResult == WAIT_ABANDONED)
+			{
+				printf("a process died holding the default heap of %s, the heap may be inconsistent\n", i_pName);
+				pRegion->bDamaged = 1;
+			}
+		}
+
+		ReleaseMutex(hLocks[0]);
+
+		if (success == false)
+		{
+			CloseHandles(hMapping, pRegion, hLocks);
+			return nullptr;
+		}
+
+		return new SharedHeap(hMapping, pRegion, hLocks, bCreator);
+	}
+
+	bool SharedHeap::CreateHeaps(RegionHeader* i_pRegion, const size_t i_sizeSlot)
+	{
+		char* pRegionMemory = reinterpret_cast<char*>(i_pRegion);
+
+		void* pHeapImage = pRegionMemory + s_HeaderSize;
+		void* pAllocatorMemory = static_cast<HeapAllocator*>(pHeapImage) + 1;
+		HeapAllocator* pDefaultHeap = new (pHeapImage) HeapAllocator(pAllocatorMemory, i_sizeSlot - s_HeaderSize - sizeof(HeapAllocator));
+		i_pRegion->pDefaultHeap = pDefaultHeap;
+
+		// the fixed-size heaps and their BitArrays are in the default heap, like in a HeapManager node
+		const size_t sizeBlocks[s_NumFixedSizeHeaps] = { 64, 128, 256 };
+		for (unsigned int i = 0; i < s_NumFixedSizeHeaps; ++i)
+		{
+			const size_t numBlocks = i_sizeSlot / sizeBlocks[i];
+
+			void* pFixedSizeHeap = pDefaultHeap->alloc(sizeof(FixedSizeAllocator));
+			if (pFixedSizeHeap == nullptr)
+				return false;
+
+			BitArray* pAvailableBlocks = BitArray::Create(numBlocks, pDefaultHeap);
+			void* pBlocksMemory = pRegionMemory + (i + 1) * i_sizeSlot;
+
+			i_pRegion->pFSAs[i] = new (pFixedSizeHeap) FixedSizeAllocator(pBlocksMemory, pAvailableBlocks, sizeBlocks[i], numBlocks);
+		}
+
+		i_pRegion->PointerSize = sizeof(void*);
+		i_pRegion->GuardBandSize = GUARD_BAND_SIZE;
+		i_pRegion->HeapAllocatorSize = sizeof(HeapAllocator);
+		i_pRegion->bDamaged = 0;
+		i_pRegion->SlotSize = i_sizeSlot;
+
+		// the region is only recognized once it is complete
+		i_pRegion->Magic = s_RegionMagic;
+
+		return true;
+	}
+
+	void SharedHeap::Close()
+	{
+		CloseHandles(m_hMapping, m_pRegion, m_hLocks);
+
+		delete this;
+	}
+
+	void SharedHeap::CloseHandles(void* i_hMapping, RegionHeader* i_pRegion, void* const* i_phLocks)
+	{
+		if (i_pRegion)
+			UnmapViewOfFile(i_pRegion);
+
+		if (i_hMapping)
+			CloseHandle(i_hMapping);
+
+		for (unsigned int i = 0; i < s_NumHeapSlots; ++i)
+		{
+			if (i_phLocks[i])
+				CloseHandle(i_phLocks[i]);
+		}
+	}
+
+	bool SharedHeap::LockSlot(void* i_hLock, RegionHeader* i_pRegion)
+	{
+		const DWORD result = WaitForSingleObject(i_hLock, INFINITE);
+
+		// the mutex is ours, but its heap was left in the middle of an alloc or free
+		if (result == WAIT_ABANDONED)
+		{
+			printf("a process died holding a shared heap lock, the heap may be inconsistent\n");
+			i_pRegion->bDamaged = 1;
+		}
+
+		return result == WAIT_OBJECT_0 || result == WAIT_ABANDONED;
+	}
+
+	void* SharedHeap::alloc(const size_t i_size, const unsigned int i_alignment /*= 4*/)
+	{
+		// same size classes as HeapManager, the smallest fixed-size heap the block fits in
+		for (unsigned int i = 0; i < s_NumFixedSizeHeaps; ++i)
+		{
+			FixedSizeAllocator* pFSA = m_pRegion->pFSAs[i];
+			const size_t sizeBlock = pFSA->GetBlockSize();
+			if (i_alignment <= sizeBlock && Utils::AlignUp(GUARD_BAND_SIZE, i_alignment) + i_size + GUARD_BAND_SIZE <= sizeBlock)
+			{
+				if (LockSlot(m_hLocks[i + 1], m_pRegion) == false)
+					return nullptr;
+
+				void* pUserMemory = pFSA->FixedSizeAllocator::alloc(i_size, i_alignment);
+				ReleaseMutex(m_hLocks[i + 1]);
+
+				if (pUserMemory)
+					return pUserMemory;
+
+				break;
+			}
+		}
+
+		if (LockSlot(m_hLocks[0], m_pRegion) == false)
+			return nullptr;
+
+		void* pUserMemory = m_pRegion->pDefaultHeap->HeapAllocator::alloc(i_size, i_alignment);
+		ReleaseMutex(m_hLocks[0]);
+
+		return pUserMemory;
+	}
+
+	bool SharedHeap::free(const void* i_ptr)
+	{
+		if (Contains(i_ptr) == false)
+			return false;
+
+		const unsigned int iSlot = static_cast<unsigned int>(GetOffset(i_ptr) / m_pRegion->SlotSize);
+		if (LockSlot(m_hLocks[iSlot], m_pRegion) == false)
+			return false;
+
+		const bool success = iSlot == 0 ? m_pRegion->pDefaultHeap->HeapAllocator::free(i_ptr) : m_pRegion->pFSAs[iSlot - 1]->FixedSizeAllocator::free(i_ptr);
+		ReleaseMutex(m_hLocks[iSlot]);
+
+		return success;
+	}
+
+	void SharedHeap::Collect()
+	{
+		if (LockSlot(m_hLocks[0], m_pRegion) == false)
+			return;
+
+		m_pRegion->pDefaultHeap->HeapAllocator::Collect();
+		ReleaseMutex(m_hLocks[0]);
+	}
+
+	bool SharedHeap::Contains(const void* i_ptr) const
+	{
+		const char* pRegionMemory = reinterpret_cast<const char*>(m_pRegion);
+
+		return i_ptr >= pRegionMemory && i_ptr < pRegionMemory + s_NumHeapSlots * m_pRegion->SlotSize;
+	}
+
+	size_t SharedHeap::GetOffset(const void* i_ptr) const
+	{
+		assert(i_ptr == nullptr || Contains(i_ptr));
+
+		return i_ptr ? static_cast<const char*>(i_ptr) - reinterpret_cast<const char*>(m_pRegion) : 0;
+	}
+
+	void* SharedHeap::GetAddress(const size_t i_offset) const
+	{
+		assert(i_offset < s_NumHeapSlots * m_pRegion->SlotSize);
+
+		return i_offset ? reinterpret_cast<char*>(m_pRegion) + i_offset : nullptr;
+	}
+
+	bool SharedHeap::IsDamaged() const
+	{
+		return m_pRegion->bDamaged != 0;
+	}
+}
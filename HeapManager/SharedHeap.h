@@ -0,0 +1,77 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace HeapManagerProxy
+{
+	class HeapAllocator;
+	class FixedSizeAllocator;
+
+	// default heap and fixed-size heaps of a HeapManager node in named shared memory
+	// every process opening the same name gets the same heaps, mapped at its own address, blocks are passed by offset
+	// each heap has a named mutex, the next owner learns when a process died holding it
+	class SharedHeap
+	{
+	public:
+		// map the region called i_pName, the first process creates it with heaps of i_sizeSlot bytes
+		// nullptr when the region is not a shared heap of this build
+		static SharedHeap* Open(const char* i_pName, const size_t i_sizeSlot = s_DefaultSlotSize);
+
+		// unmap the region, the object is deleted
+		// blocks stay allocated for the other processes, the system removes the region with the last one
+		void Close();
+
+		void* alloc(const size_t i_size, const unsigned int i_alignment = 4);
+
+		bool free(const void* i_ptr);
+
+		// merge the free blocks of the default heap
+		void Collect();
+
+		bool Contains(const void* i_ptr) const;
+
+		// where i_ptr is in the region, the same in every process, 0 for nullptr
+		size_t GetOffset(const void* i_ptr) const;
+
+		// i_offset from GetOffset of any process, in this process
+		void* GetAddress(const size_t i_offset) const;
+
+		// false when another process created the region
+		bool IsCreator() const { return m_bCreator; }
+
+		// a process died holding a heap lock, its heap may be inconsistent
+		bool IsDamaged() const;
+
+		// start of the mapping, changes from one process to the next
+		void* GetBaseAddress() const { return m_pRegion; }
+
+		static const size_t s_DefaultSlotSize = 1024 * 1024;
+
+		static const size_t s_MinSlotSize = 64 * 1024;
+
+	private:
+		struct RegionHeader;
+
+		SharedHeap(void* i_hMapping, RegionHeader* i_pRegion, void* const* i_phLocks, const bool i_bCreator);
+
+		~SharedHeap() {}
+
+		// build the heaps in a new region, under the lock of the default heap
+		static bool CreateHeaps(RegionHeader* i_pRegion, const size_t i_sizeSlot);
+
+		static bool LockSlot(void* i_hLock, RegionHeader* i_pRegion);
+
+		static void CloseHandles(void* i_hMapping, RegionHeader* i_pRegion, void* const* i_phLocks);
+
+		// slot 0 is the default heap behind the header, slots 1 to 3 the fixed-size heaps, as in a HeapManager node
+		static const unsigned int s_NumHeapSlots = 4;
+
+		// the header takes the first cache line of slot 0
+		static const size_t s_HeaderSize = 64;
+
+		void* m_hMapping;
+		RegionHeader* m_pRegion;
+		void* m_hLocks[s_NumHeapSlots];
+		bool m_bCreator;
+	};
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include <Windows.h>
+
+#include <assert.h>
+#include <string.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "SharedHeap.h"
+
+bool SharedHeap_UnitTest()
+{
+	using namespace HeapManagerProxy;
+
+	const char* pName = "Local\\SharedHeap_UnitTest";
+	const size_t sizeSlot = 1024 * 1024;
+	const int numMessages = 20000;
+	const size_t maxQueued = 256;
+
+	struct Message
+	{
+		uint32_t Sequence;
+		uint32_t Size;
+		unsigned char Payload[1];
+	};
+
+	// the region is opened twice, each open maps it at its own address like another process would
+	SharedHeap* pProducer = SharedHeap::Open(pName, sizeSlot);
+	SharedHeap* pConsumer = SharedHeap::Open(pName, sizeSlot);
+	assert(pProducer && pConsumer);
+
+	if (pProducer == nullptr || pConsumer == nullptr)
+		return false;
+
+	bool success = pProducer->IsCreator() && pConsumer->IsCreator() == false;
+	success = success && pProducer->GetBaseAddress() != pConsumer->GetBaseAddress();
+
+	// only offsets go through the queue, the consumer reads the message where the producer wrote it
+	std::deque<size_t> Queue;
+	std::mutex QueueLock;
+	std::atomic<bool> producerSuccess(true);
+
+	std::thread Producer([&]()
+	{
+		for (int i = 0; i < numMessages; ++i)
+		{
+			// at most maxQueued messages are in flight, the heaps are not sized for all of them
+			while (true)
+			{
+				{
+					std::lock_guard<std::mutex> lock(QueueLock);
+					if (Queue.size() < maxQueued)
+						break;
+				}
+
+				std::this_thread::yield();
+			}
+
+			// most messages fit a fixed-size heap, every 8th one comes from the default heap
+			const uint32_t sizePayload = (i % 8) == 7 ? 1000 + (i % 13) * 100 : 8 + (i % 5) * 40;
+
+			Message* pMessage = static_cast<Message*>(pProducer->alloc(offsetof(Message, Payload) + sizePayload, 8));
+			if (pMessage == nullptr)
+			{
+				producerSuccess = false;
+				break;
+			}
+
+			pMessage->Sequence = i;
+			pMessage->Size = sizePayload;
+			memset(pMessage->Payload, i & 0xFF, sizePayload);
+
+			std::lock_guard<std::mutex> lock(QueueLock);
+			Queue.push_back(pProducer->GetOffset(pMessage));
+		}
+	});
+
+	int expected = 0;
+	while (expected < numMessages && (producerSuccess || Queue.empty() == false))
+	{
+		size_t offset = 0;
+		{
+			std::lock_guard<std::mutex> lock(QueueLock);
+			if (Queue.empty() == false)
+			{
+				offset = Queue.front();
+				Queue.pop_front();
+			}
+		}
+
+		if (offset == 0)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		Message* pMessage = static_cast<Message*>(pConsumer->GetAddress(offset));
+		success = success && pMessage->Sequence == static_cast<uint32_t>(expected)
+			&& pMessage->Payload[0] == (expected & 0xFF) && pMessage->Payload[pMessage->Size - 1] == (expected & 0xFF);
+
+		// freed in the other mapping than it was allocated in
+		success = pConsumer->free(pMessage) && success;
+		++expected;
+	}
+
+	Producer.join();
+	success = success && producerSuccess && expected == numMessages;
+
+	// everything came back, the default heap merges to one block again
+	pProducer->Collect();
+	void* pLarge = pProducer->alloc(sizeSlot / 2);
+	success = success && pLarge != nullptr && pConsumer->free(pConsumer->GetAddress(pProducer->GetOffset(pLarge)));
+
+	// an address of the other mapping is not one of this heap
+	success = success && pConsumer->Contains(pProducer->GetBaseAddress()) == false;
+	success = success && pProducer->IsDamaged() == false;
+
+	pConsumer->Close();
+	pProducer->Close();
+
+	return success;
+}
@@ -0,0 +1,249 @@
+#pragma once
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <intrin.h>
+#include <new>
+
+#include "HeapAllocator.h"
+#include "IAllocator.h"
+#include "Utils.h"
+
+namespace HeapManagerProxy
+{
+	// HeapManager with its layout fixed at compile time, for a heap in static storage
+	// slot 0 is the default heap, then one slot of SlotSize bytes for each of BlockSizes, blocks aligned to their size
+	// no constructor runs and nothing is filled up front: a zero object is an empty heap, so a static one
+	// lives in zero pages until used, the default heap is built by the first allocation the blocks do not take
+	// not thread safe, like HeapAllocator
+	template <size_t SlotSize, size_t... BlockSizes>
+	class StaticHeapManager
+	{
+	public:
+		// power-of-two sizes up to s_MaxNaturalAlignment are aligned to their size, others to s_DefaultAlignment
+		void* malloc(const size_t i_size)
+		{
+			const bool bNatural = Utils::IsPowerOfTwo(i_size) && i_size <= s_MaxNaturalAlignment;
+			return AllocAligned(i_size, bNatural ? static_cast<unsigned int>(i_size) : s_DefaultAlignment);
+		}
+
+		// i_alignment is a power of two, small aligned requests go to the first size class that fits
+		void* aligned_alloc(const size_t i_alignment, const size_t i_size)
+		{
+			if (Utils::IsPowerOfTwo(i_alignment) == false || i_alignment > UINT_MAX)
+				return nullptr;
+
+			return AllocAligned(i_size, static_cast<unsigned int>(i_alignment));
+		}
+
+		bool free(void* i_ptr)
+		{
+			if (Contains(i_ptr) == false)
+			{
+				printf("StaticHeapManager does not contains %p\n", i_ptr);
+				return false;
+			}
+
+			const size_t offset = static_cast<const char*>(i_ptr) - m_Region;
+			const size_t iSlot = offset / SlotSize;
+			if (iSlot == 0)
+				return m_pDefaultHeap && m_pDefaultHeap->free(i_ptr);
+
+			const size_t iClass = iSlot - 1;
+			const size_t iBlock = (offset - iSlot * SlotSize) >> GetBlockShift(iClass);
+			const size_t iWord = iBlock / s_BitsPerWord;
+			const t_BitData bit = t_BitData(1) << (iBlock % s_BitsPerWord);
+
+			t_BitData& word = m_AllocatedBlocks[GetFirstWord(iClass) + iWord];
+			if ((word & bit) == 0)
+			{
+				printf("StaticHeapManager block %p is not allocated\n", i_ptr);
+				return false;
+			}
+
+			word &= ~bit;
+			if (iWord < m_FirstFreeWord[iClass])
+				m_FirstFreeWord[iClass] = iWord;
+
+#ifdef _DEBUG
+			memset(m_Region + iSlot * SlotSize + (iBlock << GetBlockShift(iClass)), _bDeadLandFill, s_BlockSizes[iClass]);
+#endif
+			return true;
+		}
+
+		// bytes the caller can use at i_ptr, 0 when the heap does not own it
+		size_t usable_size(const void* i_ptr) const
+		{
+			if (Contains(i_ptr) == false)
+				return 0;
+
+			const size_t offset = static_cast<const char*>(i_ptr) - m_Region;
+			const size_t iSlot = offset / SlotSize;
+			if (iSlot == 0)
+				return m_pDefaultHeap ? m_pDefaultHeap->GetUsableSize(i_ptr) : 0;
+
+			const size_t sizeBlock = s_BlockSizes[iSlot - 1];
+			return sizeBlock - (offset & (sizeBlock - 1)) - GUARD_BAND_SIZE;
+		}
+
+		bool Contains(const void* i_ptr) const
+		{
+			return i_ptr >= m_Region && i_ptr < m_Region + s_RegionSize;
+		}
+
+		bool IsEmpty() const
+		{
+			for (size_t i = 0; i < s_NumBitmapWords; ++i)
+			{
+				if (m_AllocatedBlocks[i])
+					return false;
+			}
+
+			return m_pDefaultHeap == nullptr || m_pDefaultHeap->IsEmpty();
+		}
+
+		// nullptr until an allocation needs it
+		HeapAllocator* GetDefaultHeap() const { return m_pDefaultHeap; }
+
+		static const unsigned int s_DefaultAlignment = 4;
+
+		static const size_t s_MaxNaturalAlignment = 4096;
+
+		static const size_t s_NumSizeClasses = sizeof...(BlockSizes);
+
+		static const size_t s_RegionSize = (s_NumSizeClasses + 1) * SlotSize;
+
+	private:
+#if WIN32
+		typedef uint32_t t_BitData;
+#else
+		typedef uint64_t t_BitData;
+#endif
+
+		static const size_t s_BitsPerWord = sizeof(t_BitData) * 8;
+
+		static constexpr size_t s_BlockSizes[s_NumSizeClasses] = { BlockSizes... };
+
+		static constexpr size_t GetNumWords(const size_t i_class) { return SlotSize / s_BlockSizes[i_class] / s_BitsPerWord; }
+
+		// the bitmaps of all size classes are in one array, one after the other
+		static constexpr size_t GetFirstWord(const size_t i_class)
+		{
+			size_t iFirstWord = 0;
+			for (size_t i = 0; i < i_class; ++i)
+				iFirstWord += GetNumWords(i);
+
+			return iFirstWord;
+		}
+
+		static constexpr size_t GetBlockShift(const size_t i_class)
+		{
+			size_t shift = 0;
+			while ((size_t(1) << shift) < s_BlockSizes[i_class])
+				++shift;
+
+			return shift;
+		}
+
+		static constexpr bool IsLayoutValid()
+		{
+			for (size_t i = 0; i < s_NumSizeClasses; ++i)
+			{
+				// blocks at multiples of their size in the slot, each bitmap in whole words
+				if (Utils::IsPowerOfTwo(s_BlockSizes[i]) == false || s_BlockSizes[i] < GUARD_BAND_SIZE * 2 + 4
+					|| SlotSize % (s_BlockSizes[i] * s_BitsPerWord) != 0)
+					return false;
+
+				// the first class that fits is the smallest
+				if (i > 0 && s_BlockSizes[i] <= s_BlockSizes[i - 1])
+					return false;
+			}
+
+			return SlotSize > sizeof(HeapAllocator);
+		}
+
+		static const size_t s_NumBitmapWords = GetFirstWord(s_NumSizeClasses);
+
+		// the largest block size, so every block is aligned to its size
+		static const size_t s_RegionAlignment = s_BlockSizes[s_NumSizeClasses - 1] > alignof(HeapAllocator) ? s_BlockSizes[s_NumSizeClasses - 1] : alignof(HeapAllocator);
+
+		static_assert(s_NumSizeClasses > 0, "StaticHeapManager needs at least one block size");
+		static_assert(IsLayoutValid(), "BlockSizes should be ascending powers of two, SlotSize a multiple of 64 blocks of each");
+
+		void* AllocAligned(const size_t i_size, const unsigned int i_alignment)
+		{
+			// the sizes are constants, the loop unrolls to a chain of compares
+			for (size_t i = 0; i < s_NumSizeClasses; ++i)
+			{
+				if (i_alignment <= s_BlockSizes[i] && Utils::AlignUp(GUARD_BAND_SIZE, i_alignment) + i_size + GUARD_BAND_SIZE <= s_BlockSizes[i])
+				{
+					void* pUserMemory = AllocBlock(i, i_size, i_alignment);
+					if (pUserMemory)
+						return pUserMemory;
+
+					break;
+				}
+			}
+
+			if (m_pDefaultHeap == nullptr)
+			{
+				void* pAllocatorMemory = reinterpret_cast<HeapAllocator*>(m_Region) + 1;
+				m_pDefaultHeap = new (m_Region) HeapAllocator(pAllocatorMemory, SlotSize - sizeof(HeapAllocator));
+			}
+
+			return m_pDefaultHeap->alloc(i_size, i_alignment);
+		}
+
+		void* AllocBlock(const size_t i_class, const size_t i_size, const unsigned int i_alignment)
+		{
+			t_BitData* pWords = m_AllocatedBlocks + GetFirstWord(i_class);
+
+			// every word before m_FirstFreeWord is full
+			for (size_t iWord = m_FirstFreeWord[i_class]; iWord < GetNumWords(i_class); ++iWord)
+			{
+				if (pWords[iWord] == ~t_BitData(0))
+					continue;
+
+				unsigned long iBit;
+#if WIN32
+				_BitScanForward(&iBit, ~pWords[iWord]);
+#else
+				_BitScanForward64(&iBit, ~pWords[iWord]);
+#endif
+				pWords[iWord] |= t_BitData(1) << iBit;
+				m_FirstFreeWord[i_class] = iWord;
+
+				const size_t iBlock = iWord * s_BitsPerWord + iBit;
+				char* pBlock = m_Region + (i_class + 1) * SlotSize + (iBlock << GetBlockShift(i_class));
+
+				// blocks are aligned to their size, the offset only depends on the guard band and the alignment
+				char* pUserMemory = pBlock + Utils::AlignUp(GUARD_BAND_SIZE, i_alignment);
+
+#ifdef _DEBUG
+				memset(pBlock, _bAlignLandFill, pUserMemory - pBlock);
+				memset(pUserMemory - GUARD_BAND_SIZE, _bNoMansLandFill, GUARD_BAND_SIZE);
+				memset(pUserMemory, _bCleanLandFill, i_size);
+				memset(pUserMemory + i_size, _bNoMansLandFill, GUARD_BAND_SIZE);
+#endif
+				return pUserMemory;
+			}
+
+			m_FirstFreeWord[i_class] = GetNumWords(i_class);
+			return nullptr;
+		}
+
+		// no initializers, a zero object is valid: a set bit is an allocated block
+		alignas(s_RegionAlignment) char m_Region[s_RegionSize];
+
+		t_BitData m_AllocatedBlocks[s_NumBitmapWords];
+
+		size_t m_FirstFreeWord[s_NumSizeClasses];
+
+		HeapAllocator* m_pDefaultHeap;
+	};
+
+	template <size_t SlotSize, size_t... BlockSizes>
+	constexpr size_t StaticHeapManager<SlotSize, BlockSizes...>::s_BlockSizes[];
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <assert.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+#include "StaticHeapManager.h"
+
+typedef HeapManagerProxy::StaticHeapManager<64 * 1024, 16, 64, 256> UnitTestStaticHeap;
+
+static_assert(std::is_trivially_default_constructible<UnitTestStaticHeap>::value && std::is_trivially_destructible<UnitTestStaticHeap>::value,
+	"StaticHeapManager should need no code to start or stop");
+
+// zero initialized, no constructor runs before main
+static UnitTestStaticHeap s_UnitTestStaticHeap;
+
+bool StaticHeapManager_UnitTest()
+{
+	UnitTestStaticHeap& heap = s_UnitTestStaticHeap;
+
+	bool success = heap.IsEmpty() && heap.GetDefaultHeap() == nullptr;
+
+	// every block of the 16 byte class and then some, the rest goes to the default heap
+	const size_t numSmallBlocks = 64 * 1024 / 16;
+	std::vector<void*> Blocks;
+	for (size_t i = 0; i < numSmallBlocks + 100; ++i)
+	{
+		const size_t size = i % 2 ? 3 : 6;
+		void* pBlock = heap.malloc(size);
+		success = success && pBlock != nullptr && heap.Contains(pBlock) && heap.usable_size(pBlock) >= size;
+		Blocks.push_back(pBlock);
+	}
+	success = success && heap.GetDefaultHeap() != nullptr;
+
+	// power-of-two sizes come aligned to their size
+	for (size_t size = 16; size <= 4096; size *= 2)
+	{
+		void* pBlock = heap.malloc(size);
+		success = success && pBlock != nullptr && reinterpret_cast<uintptr_t>(pBlock) % size == 0 && heap.usable_size(pBlock) >= size;
+		Blocks.push_back(pBlock);
+	}
+
+	void* pAligned = heap.aligned_alloc(128, 40);
+	success = success && pAligned != nullptr && reinterpret_cast<uintptr_t>(pAligned) % 128 == 0;
+	Blocks.push_back(pAligned);
+
+	for (size_t i = 0; i < Blocks.size(); ++i)
+		memset(Blocks[i], 0x5A, 3);
+
+	for (size_t i = 0; i < Blocks.size(); ++i)
+		success = heap.free(Blocks[i]) && success;
+
+	// a freed block is found again from the first free word
+	success = success && heap.free(Blocks[0]) == false && heap.malloc(6) == Blocks[0] && heap.free(Blocks[0]);
+
+	heap.GetDefaultHeap()->Collect();
+	success = success && heap.IsEmpty();
+
+	int notOwned = 0;
+	success = success && heap.Contains(&notOwned) == false && heap.usable_size(&notOwned) == 0;
+
+	return success;
+}
@@ -0,0 +1,275 @@
+#include "TinyObjectAllocator.h"
+#include "Utils.h"
+#include "string.h"
+#include "stdio.h"
+#include <assert.h>
+#include <intrin.h>
+
+#if WIN32
+#pragma intrinsic(_BitScanForward)
+#else
+#pragma intrinsic(_BitScanForward64)
+#endif
+
+namespace HeapManagerProxy
+{
+	TinyObjectAllocator::TinyObjectAllocator(void* i_pAllocatorMemory, const size_t i_sizeMemory) :
+		m_numTouchedRuns(0),
+		m_numUsedRuns(0),
+		m_numOutstandingBlocks(0),
+		m_FirstEmptyRun(s_NoRun)
+	{
+		char* pRunTable = static_cast<char*>(Utils::AlignUpAddress(i_pAllocatorMemory, sizeof(t_BitData)));
+		char* pMemoryEnd = static_cast<char*>(i_pAllocatorMemory) + i_sizeMemory;
+
+		// give up runs from the start until the table of the others fits before them
+		char* pFirstRun = static_cast<char*>(Utils::AlignUpAddress(pRunTable, s_RunSize));
+		size_t numRuns = pMemoryEnd > pFirstRun ? (pMemoryEnd - pFirstRun) / s_RunSize : 0;
+		while (numRuns && pRunTable + numRuns * sizeof(TinyRun) > pFirstRun)
+		{
+			pFirstRun += s_RunSize;
+			numRuns = (pMemoryEnd - pFirstRun) / s_RunSize;
+		}
+
+		m_pRuns = reinterpret_cast<TinyRun*>(pRunTable);
+		m_pFirstRun = pFirstRun;
+		m_numRuns = numRuns;
+
+		// run headers are not filled up front, a run is set up when a class first takes it
+		for (size_t i = 0; i < s_NumSizeClasses; ++i)
+			m_PartialRuns[i] = s_NoRun;
+
+#ifdef HEAP_TRACING
+		m_allocLatency.Reset();
+		m_freeLatency.Reset();
+#endif
+	}
+
+	TinyObjectAllocator::~TinyObjectAllocator()
+	{
+	}
+
+	size_t TinyObjectAllocator::GetBlockSize(const size_t sizeAlloc, const unsigned int alignment)
+	{
+		if (alignment > s_MaxBlockSize || sizeAlloc > s_MaxBlockSize)
+			return 0;
+
+		// blocks start at multiples of their size in a run, so a size that is a multiple of the alignment keeps every block aligned
+		const size_t sizeBlock = Utils::AlignUp(Utils::AlignUp(GUARD_BAND_SIZE, alignment) + sizeAlloc + GUARD_BAND_SIZE, alignment < s_Granularity ? s_Granularity : alignment);
+
+		return sizeBlock <= s_MaxBlockSize ? sizeBlock : 0;
+	}
+
+	void* TinyObjectAllocator::alloc(const size_t sizeAlloc, const unsigned int alignment /*= 4*/)
+	{
+		HEAP_PROBE_SCOPE(ProbePoint::FixedSizeAlloc, m_allocLatency, nullptr, sizeAlloc);
+
+		const size_t sizeBlock = GetBlockSize(sizeAlloc, alignment);
+		if (sizeBlock == 0)
+			return nullptr;
+
+		const size_t iClass = sizeBlock / s_Granularity - 1;
+		uint32_t iRun = m_PartialRuns[iClass];
+		if (iRun == s_NoRun)
+		{
+			iRun = TakeRun(iClass);
+			if (iRun == s_NoRun)
+				return nullptr;
+		}
+
+		// a run in the partial list has a free block
+		TinyRun& run = m_pRuns[iRun];
+		size_t iWord = 0;
+		while (run.FreeBlocks[iWord] == 0)
+			++iWord;
+
+		unsigned long iBit;
+#if WIN32
+		_BitScanForward(&iBit, run.FreeBlocks[iWord]);
+#else
+		_BitScanForward64(&iBit, run.FreeBlocks[iWord]);
+#endif
+		run.FreeBlocks[iWord] &= ~(t_BitData(1) << iBit);
+
+		if (--run.NumFreeBlocks == 0)
+			UnlinkRun(iClass, iRun);
+
+		++m_numOutstandingBlocks;
+
+		char* pBlockStartAddr = GetRunMemory(iRun) + (iWord * s_BitsPerWord + iBit) * sizeBlock;
+		char* pUserMemory = pBlockStartAddr + Utils::AlignUp(GUARD_BAND_SIZE, alignment);
+
+		memset(pBlockStartAddr, _bAlignLandFill, pUserMemory - pBlockStartAddr);		// align
+		memset(pUserMemory - GUARD_BAND_SIZE, _bNoMansLandFill, GUARD_BAND_SIZE);		// header guard
+		memset(pUserMemory, _bCleanLandFill, sizeAlloc);								// user memory
+		memset(pUserMemory + sizeAlloc, _bNoMansLandFill, GUARD_BAND_SIZE);				// tail guard
+		memset(pUserMemory + sizeAlloc + GUARD_BAND_SIZE, _bAlignLandFill, pBlockStartAddr + sizeBlock - (pUserMemory + sizeAlloc + GUARD_BAND_SIZE)); // size class
+
+		HEAP_PROBE_RESULT(pUserMemory);
+
+		return pUserMemory;
+	}
+
+	bool TinyObjectAllocator::free(const void* pPtr)
+	{
+		HEAP_PROBE_SCOPE(ProbePoint::FixedSizeFree, m_freeLatency, pPtr, 0);
+
+		if (TinyObjectAllocator::Contains(pPtr) == false)
+			return false;
+
+		const size_t offset = static_cast<const char*>(pPtr) - static_cast<char*>(m_pFirstRun);
+		const uint32_t iRun = static_cast<uint32_t>(offset / s_RunSize);
+		if (iRun >= m_numTouchedRuns || m_pRuns[iRun].SizeClass == s_NoSizeClass)
+			return false;
+
+		TinyRun& run = m_pRuns[iRun];
+		const size_t iClass = run.SizeClass;
+		const size_t sizeBlock = GetClassBlockSize(iClass);
+		const size_t numBlocks = s_RunSize / sizeBlock;
+		const size_t iBlock = (offset % s_RunSize) / sizeBlock;
+
+		// the tail of a run is in no block, a set bit is a block freed already
+		const t_BitData bit = t_BitData(1) << (iBlock % s_BitsPerWord);
+		if (iBlock >= numBlocks || (run.FreeBlocks[iBlock / s_BitsPerWord] & bit))
+			return false;
+
+		memset(GetRunMemory(iRun) + iBlock * sizeBlock, _bDeadLandFill, sizeBlock);	// free memory
+
+		run.FreeBlocks[iBlock / s_BitsPerWord] |= bit;
+		--m_numOutstandingBlocks;
+
+		// a full run is in no list
+		if (++run.NumFreeBlocks == 1)
+			LinkRun(iClass, iRun);
+
+		// an empty run goes to any class, but the last partial run of its class stays so a class
+		// that frees and allocates one block at a time does not set up a run each time
+		if (run.NumFreeBlocks == numBlocks && (run.NextRun != s_NoRun || run.PreviousRun != s_NoRun))
+		{
+			UnlinkRun(iClass, iRun);
+
+			run.SizeClass = s_NoSizeClass;
+			run.NextRun = m_FirstEmptyRun;
+			m_FirstEmptyRun = iRun;
+			--m_numUsedRuns;
+		}
+
+		return true;
+	}
+
+	uint32_t TinyObjectAllocator::TakeRun(const size_t i_iClass)
+	{
+		uint32_t iRun = m_FirstEmptyRun;
+		if (iRun != s_NoRun)
+			m_FirstEmptyRun = m_pRuns[iRun].NextRun;
+		else if (m_numTouchedRuns < m_numRuns)
+			iRun = static_cast<uint32_t>(m_numTouchedRuns++);
+		else
+			return s_NoRun;
+
+		// a bit for each whole block, the tail of the run is never handed out
+		TinyRun& run = m_pRuns[iRun];
+		const size_t numBlocks = s_RunSize / GetClassBlockSize(i_iClass);
+		memset(run.FreeBlocks, 0, sizeof(run.FreeBlocks));
+		memset(run.FreeBlocks, 0xFF, numBlocks / s_BitsPerWord * sizeof(t_BitData));
+		if (numBlocks % s_BitsPerWord)
+			run.FreeBlocks[numBlocks / s_BitsPerWord] = (t_BitData(1) << (numBlocks % s_BitsPerWord)) - 1;
+
+		run.NumFreeBlocks = static_cast<uint16_t>(numBlocks);
+		run.SizeClass = static_cast<uint8_t>(i_iClass);
+		LinkRun(i_iClass, iRun);
+
+		++m_numUsedRuns;
+
+		return iRun;
+	}
+
+	void TinyObjectAllocator::LinkRun(const size_t i_iClass, const uint32_t i_iRun)
+	{
+		TinyRun& run = m_pRuns[i_iRun];
+		run.PreviousRun = s_NoRun;
+		run.NextRun = m_PartialRuns[i_iClass];
+
+		if (run.NextRun != s_NoRun)
+			m_pRuns[run.NextRun].PreviousRun = i_iRun;
+
+		m_PartialRuns[i_iClass] = i_iRun;
+	}
+
+	void TinyObjectAllocator::UnlinkRun(const size_t i_iClass, const uint32_t i_iRun)
+	{
+		TinyRun& run = m_pRuns[i_iRun];
+
+		if (run.PreviousRun != s_NoRun)
+			m_pRuns[run.PreviousRun].NextRun = run.NextRun;
+		else
+			m_PartialRuns[i_iClass] = run.NextRun;
+
+		if (run.NextRun != s_NoRun)
+			m_pRuns[run.NextRun].PreviousRun = run.PreviousRun;
+
+		run.NextRun = s_NoRun;
+		run.PreviousRun = s_NoRun;
+	}
+
+	size_t TinyObjectAllocator::GetUsableSize(const void* pPtr) const
+	{
+		const size_t offset = static_cast<const char*>(pPtr) - static_cast<const char*>(m_pFirstRun);
+		const size_t sizeBlock = GetClassBlockSize(m_pRuns[offset / s_RunSize].SizeClass);
+		const size_t offsetInBlock = offset % s_RunSize % sizeBlock;
+
+		return sizeBlock - offsetInBlock - GUARD_BAND_SIZE;
+	}
+
+	bool TinyObjectAllocator::Contains(const void* pPtr)
+	{
+		const char* pAddr = static_cast<const char*>(pPtr);
+		const char* pFirstRun = static_cast<const char*>(m_pFirstRun);
+
+		return pAddr >= pFirstRun && pAddr < pFirstRun + m_numRuns * s_RunSize;
+	}
+
+	bool TinyObjectAllocator::IsAllocated(const void* pPtr)
+	{
+		if (TinyObjectAllocator::Contains(pPtr) == false)
+			return false;
+
+		const size_t offset = static_cast<const char*>(pPtr) - static_cast<char*>(m_pFirstRun);
+		const size_t iRun = offset / s_RunSize;
+		if (iRun >= m_numTouchedRuns || m_pRuns[iRun].SizeClass == s_NoSizeClass)
+			return false;
+
+		const TinyRun& run = m_pRuns[iRun];
+		const size_t sizeBlock = GetClassBlockSize(run.SizeClass);
+		const size_t iBlock = (offset % s_RunSize) / sizeBlock;
+
+		return iBlock < s_RunSize / sizeBlock && (run.FreeBlocks[iBlock / s_BitsPerWord] & (t_BitData(1) << (iBlock % s_BitsPerWord))) == 0;
+	}
+
+	void TinyObjectAllocator::ShowFreeBlocks()
+	{
+		printf("Tiny runs with free blocks:\n");
+		printf("Start\tBlock\tFree\n");
+		for (size_t iClass = 0; iClass < s_NumSizeClasses; ++iClass)
+		{
+			for (uint32_t iRun = m_PartialRuns[iClass]; iRun != s_NoRun; iRun = m_pRuns[iRun].NextRun)
+				printf("%p\t%zu\t%u\n", GetRunMemory(iRun), GetClassBlockSize(iClass), m_pRuns[iRun].NumFreeBlocks);
+		}
+	}
+
+	void TinyObjectAllocator::ShowOutstandingAllocations()
+	{
+		printf("Tiny runs with allocated blocks:\n");
+		printf("Start\tBlock\tAllocated\n");
+		for (uint32_t iRun = 0; iRun < m_numTouchedRuns; ++iRun)
+		{
+			const TinyRun& run = m_pRuns[iRun];
+			if (run.SizeClass == s_NoSizeClass)
+				continue;
+
+			const size_t sizeBlock = GetClassBlockSize(run.SizeClass);
+			if (run.NumFreeBlocks < s_RunSize / sizeBlock)
+				printf("%p\t%zu\t%zu\n", GetRunMemory(iRun), sizeBlock, s_RunSize / sizeBlock - run.NumFreeBlocks);
+		}
+	}
+}
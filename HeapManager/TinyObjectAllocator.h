@@ -0,0 +1,128 @@
+#pragma once
+#include <stdint.h>
+#include "HeapProbe.h"
+#include "IAllocator.h"
+#include "RelativePtr.h"
+
+namespace HeapManagerProxy
+{
+	// blocks up to 64 bytes in size classes 8 bytes apart, the 64 byte fixed-size heap wastes most of a block on them
+	// the memory is cut into page-sized runs of one class each, a run has one bitmap of its free blocks
+	// blocks are packed with no header, only debug builds put guard bands around the user memory
+	class TinyObjectAllocator : public IAllocator
+	{
+#if WIN32
+		typedef uint32_t t_BitData;
+#else
+		typedef uint64_t t_BitData;
+#endif
+
+	public:
+		TinyObjectAllocator() = delete; // remove default constructor
+
+		// the run table takes the first pages of i_pAllocatorMemory, the runs start on the next page boundary
+		TinyObjectAllocator(void* i_pAllocatorMemory, const size_t i_sizeMemory);
+
+		virtual ~TinyObjectAllocator();
+
+		void* alloc(const size_t sizeAlloc, const unsigned int alignment = 4) override;
+
+		bool free(const void* pPtr) override;
+
+		// bytes from pPtr to the end of its block, less the tail guard
+		size_t GetUsableSize(const void* pPtr) const;
+
+		void Collect() override {}; // no need collect
+
+		bool Contains(const void* pPtr) override;
+
+		bool IsAllocated(const void* pPtr) override;
+
+		void ShowFreeBlocks() override;
+
+		void ShowOutstandingAllocations() override;
+
+		void Destroy() override {};
+
+		bool IsEmpty() override { return m_numOutstandingBlocks == 0; }
+
+		// block of the class a request goes to, with its guard bands and a size that is a multiple of the alignment
+		// 0 when the block would be larger than s_MaxBlockSize
+		static size_t GetBlockSize(const size_t sizeAlloc, const unsigned int alignment);
+
+		inline size_t GetNumRuns() const { return m_numRuns; }
+
+		// runs given to a size class, the pages the outstanding blocks keep
+		inline size_t GetNumUsedRuns() const { return m_numUsedRuns; }
+
+		// high-water mark, runs above it were never used and their pages never touched
+		inline size_t GetNumTouchedRuns() const { return m_numTouchedRuns; }
+
+#ifdef HEAP_TRACING
+		// time spent in alloc and free, probed as fixed-size heap, see HeapProbe.h
+		const LatencyHistogram& GetAllocLatency() const { return m_allocLatency; }
+
+		const LatencyHistogram& GetFreeLatency() const { return m_freeLatency; }
+#endif
+
+		static const size_t s_Granularity = 8;
+
+		static const size_t s_MaxBlockSize = 64;
+
+		static const size_t s_NumSizeClasses = s_MaxBlockSize / s_Granularity;
+
+		static const size_t s_RunSize = 4096;
+
+	private:
+		static const size_t s_BitsPerWord = sizeof(t_BitData) * 8;
+
+		// enough bits for the 8 byte class
+		static const size_t s_NumBitWords = s_RunSize / s_Granularity / s_BitsPerWord;
+
+		static const uint32_t s_NoRun = UINT32_MAX;
+
+		static const uint8_t s_NoSizeClass = UINT8_MAX;
+
+		// header of a run, kept in the run table so the blocks fill the whole page
+		struct TinyRun
+		{
+			t_BitData FreeBlocks[s_NumBitWords]; // a set bit for each free block
+			uint32_t NextRun;
+			uint32_t PreviousRun;
+			uint16_t NumFreeBlocks;
+			uint8_t SizeClass; // s_NoSizeClass for a run in no class
+		};
+
+		static size_t GetClassBlockSize(const size_t i_iClass) { return (i_iClass + 1) * s_Granularity; }
+
+		char* GetRunMemory(const uint32_t i_iRun) const { return static_cast<char*>(m_pFirstRun) + i_iRun * s_RunSize; }
+
+		// an emptied run or the next untouched one set up for i_iClass and put in its partial list
+		uint32_t TakeRun(const size_t i_iClass);
+
+		// i_iRun has free blocks again or is set up, runs of a class with free blocks are linked both ways
+		void LinkRun(const size_t i_iClass, const uint32_t i_iRun);
+
+		void UnlinkRun(const size_t i_iClass, const uint32_t i_iRun);
+
+		// relative, the allocator can live in memory that other processes map at other addresses
+		RelativePtr<TinyRun> m_pRuns;
+		RelativePtr<void> m_pFirstRun;
+
+		size_t m_numRuns;
+		size_t m_numTouchedRuns;
+		size_t m_numUsedRuns;
+		size_t m_numOutstandingBlocks;
+
+		// runs of each class with a free block, the lowest set bit of the first one is allocated next
+		uint32_t m_PartialRuns[s_NumSizeClasses];
+
+		// emptied runs any class can take, linked through NextRun
+		uint32_t m_FirstEmptyRun;
+
+#ifdef HEAP_TRACING
+		LatencyHistogram m_allocLatency;
+		LatencyHistogram m_freeLatency;
+#endif
+	};
+}
@@ -5,7 +5,7 @@ namespace HeapManagerProxy
 {
 	class Utils {
 	public:
-		static bool IsPowerOfTwo(size_t value)
+		static constexpr bool IsPowerOfTwo(size_t value)
 		{
 			return !(value == 0) && !(value & (value - 1));
 		}